@@ -7,14 +7,50 @@
 #define GLFW_DLL 1
 #define GL_GLEXT_PROTOTYPES
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 #include <GLFW/glfw3.h>
 
+// zstd input needs libzstd, build with /DEZVIEW_ZSTD and zstd.lib to get it
+#ifdef EZVIEW_ZSTD
+#include <zstd.h>
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "linmath.h"
 #include <assert.h>
 
+// SSE2 is always there on the x86 targets we build for, wider instruction
+// sets are checked for at runtime before their code paths are used
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define EZ_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define EZ_TARGET(isa)
+#else
+#define EZ_TARGET(isa) __attribute__((target(isa)))
+#endif
+
 
 // Create the structure for the vertex
 typedef struct
@@ -23,13 +59,54 @@ typedef struct
   float TexCoord[2];
 } Vertex;
 
-// Create the structure for the image NOTE "don't care about the alpha channel"
+// The whole input file held in memory. When the platform allows it the file
+// is mapped instead of read so the raster comes straight from the page cache
+typedef struct MappedFile
+{
+    unsigned char *data;
+    size_t size;
+    int mapped; // 1 if data is a file mapping, 0 if it was read into the heap
+} MappedFile;
+
+// Everything the ppm header tells us, plus where the raster starts in the file.
+// depth is the number of channels, only PAM (P7) headers spell it out
+typedef struct PpmHeader
+{
+    int magicNumber, width, height, maxColor, depth;
+    size_t rasterOffset;
+} PpmHeader;
+
+// Create the structure for the image
+// image either points into source (zero copy) or is its own heap allocation.
+// channels is 1 for the grayscale formats (P1, P2, P4, P5), 3 for P3 and P6,
+// and whatever the DEPTH says for PAM (P7), where 2 and 4 carry alpha
 typedef struct Pixmap
 {
-    int width, height, magicNumber;
+    int width, height, magicNumber, channels;
     unsigned char *image;
+    MappedFile source;
 } Pixmap;
 
+// Where decoding of one image has got to, so it can be decoded in one go
+// or a band of rows at a time while the window is already up
+typedef struct ImageLoader
+{
+    Pixmap *pixmap;
+    PpmHeader header;
+    size_t cursor;  // next byte of the raster text still to decode
+    size_t rasterEnd;       // the raster never reaches past this byte
+    int rowsDone;   // rows at the top of pixmap->image that are ready
+    int bandRows;   // rows per published band when decoding on a thread, 0 for all at once
+    int workers;    // threads sharing a P6 conversion
+    unsigned char *lut;     // from buildSampleLut, every sample goes through it
+    volatile long cancel;       // set by the main thread to make the decode thread stop early
+    volatile long rowsReady;    // rowsDone as last published to the main thread
+    volatile long failed;       // published when the raster turned out to be bad
+    struct ChunkReader *reader; // delivers the raster when it is read with -async
+    int compression;            // one of the COMPRESSION_ kinds, COMPRESSION_NONE for plain files
+    double decodeStart, decodeEnd;
+} ImageLoader;
+
 
 // Create all the vertexes to be used for properly displaying the image
 // Essentially using two triangles to represent the entire image
@@ -43,8 +120,34 @@ Vertex vertexes[] = {
 };
 
 
-// These variables are used for the affine transformations
+// Set once at startup from cpuid
+int haveAvx2 = 0;
+int haveSsse3 = 0;
+
+// Ordered dithering when bringing 16 bit images down to 8 bits (-dither)
+int dither = 0;
+
+// Playback rate for files holding several images (-fps)
+double framesPerSecond = 24;
+
+// One image of a multi-image file, netpbm allows any number back to back
+typedef struct Frame
+{
+    PpmHeader header;
+    size_t rasterEnd;
+} Frame;
+
+// Streaming mode uploads bands of roughly this many bytes as they decode
+#define STREAM_BAND_BYTES (1 << 20)
+
+// and checks for newly decoded bands at least this often
+#define STREAM_WAIT_SECONDS 0.005
+
+// These variables are used for the affine transformations. Q and E turn
+// the image by whole quarter turns, which are kept apart from any other
+// rotation so they stay exact
 const double pi = 3.1415926535897;
+int quarterTurns = 0;   // counterclockwise, 0 to 3
 float rotation = 0;
 float scale = 1;
 float translateX = 0;
@@ -52,6 +155,21 @@ float translateY = 0;
 float shearX = 0;
 float shearY = 0;
 
+// Q*R*H*S*T of the values above, Q being the quarter turns, and its
+// inverse. key_callback rebuilds them whenever one of the values changes,
+// and everything that needs the transform, the shader uniform included,
+// reads it from here. turnedInverse is the inverse to use on a copy of the
+// image that has already been turned by quarterTurns
+mat2x3 view = { { 1, 0 }, { 0, 1 }, { 0, 0 } };
+mat2x3 viewInverse = { { 1, 0 }, { 0, 1 }, { 0, 0 } };
+mat2x3 turnedInverse = { { 1, 0 }, { 0, 1 }, { 0, 0 } };
+int viewInvertible = 1;
+
+// Set whenever what is on screen is out of date. The main loop only draws
+// when it is set and otherwise sleeps in glfwWaitEvents
+int viewDirty = 1;
+long framesDrawn = 0;
+
 
 // Same vertex shader from the texDemo
 static const char* vertex_shader_text =
@@ -81,6 +199,69 @@ static void error_callback(int error, const char* description)
 }
 
 
+static void printFrameTimes(void);
+
+// Recomputes view from the turn, rotation, shear, scale and translate
+// values. Shearing both ways by the same amount can flatten the image onto
+// a line, and then there is no inverse
+static void buildView(void)
+{
+    mat2x3 q, r, h, s, t, rest, undo;
+
+    mat2x3_turn(q, quarterTurns);
+    mat2x3_rotate(r, rotation);
+    mat2x3_shear(h, shearX, shearY);
+    mat2x3_scale(s, scale, scale);
+    mat2x3_translate(t, translateX, translateY);
+
+    mat2x3_mul(rest, r, h);    //R*H
+    mat2x3_mul(rest, rest, s); //R*H*S
+    mat2x3_mul(rest, rest, t); //R*H*S*T
+    mat2x3_mul(view, q, rest); //Q*R*H*S*T
+    viewInvertible = mat2x3_invert(viewInverse, view);
+
+    // A turned copy already has Q applied on the image side, so it is seen
+    // through Q*R*H*S*T*Q^-1, whose inverse is Q*(R*H*S*T)^-1*Q^-1
+    if (viewInvertible)
+    {
+        mat2x3_invert(rest, rest);
+        mat2x3_turn(undo, -quarterTurns);
+        mat2x3_mul(turnedInverse, q, rest);
+        mat2x3_mul(turnedInverse, turnedInverse, undo);
+    }
+}
+
+// The transformation values, for code that borrows the view for a while
+// and puts it back afterwards
+typedef struct SavedView
+{
+    int quarterTurns;
+    float rotation, scale, translateX, translateY, shearX, shearY;
+} SavedView;
+
+static void saveView(SavedView *saved)
+{
+    saved->quarterTurns = quarterTurns;
+    saved->rotation = rotation;
+    saved->scale = scale;
+    saved->translateX = translateX;
+    saved->translateY = translateY;
+    saved->shearX = shearX;
+    saved->shearY = shearY;
+}
+
+static void restoreView(const SavedView *saved)
+{
+    quarterTurns = saved->quarterTurns;
+    rotation = saved->rotation;
+    scale = saved->scale;
+    translateX = saved->translateX;
+    translateY = saved->translateY;
+    shearX = saved->shearX;
+    shearY = saved->shearY;
+    buildView();
+}
+
 // This function will perform all of the affine transformations on the loaded image
 // Whenever a key is pressed we will change/affect the loaded image
 // Escape is quit
@@ -96,19 +277,23 @@ static void error_callback(int error, const char* description)
 // down arrow is move down on image
 // left arrow is move left on image
 // right arrow is move right on image
+// T prints how long frames have been taking
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    if (action == GLFW_PRESS)
+        viewDirty = 1;
+
     // Hit escape to quite the ez-view program
     if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
         glfwSetWindowShouldClose(window, GLFW_TRUE);
 
-    // Rotate the image Left wise 90 degrees using W key
+    // Rotate the image Left wise 90 degrees using Q key
     if (key == GLFW_KEY_Q && action == GLFW_PRESS)
-    	rotation += 90*pi/180;
+    	quarterTurns = (quarterTurns + 1) & 3;
 
     // Rotate the image Right wise 90 degrees using E key
     if (key == GLFW_KEY_E && action == GLFW_PRESS)
-    	rotation -= 90*pi/180;
+    	quarterTurns = (quarterTurns + 3) & 3;
 
     // Zoom into the image using =	key
     if (key == GLFW_KEY_EQUAL && action == GLFW_PRESS)
@@ -150,6 +335,25 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     // Shear image down using S key
     if (key == GLFW_KEY_S && action == GLFW_PRESS)
     	shearX -= .1;
+
+    // Print the frame timings so far using T key
+    if (key == GLFW_KEY_T && action == GLFW_PRESS)
+        printFrameTimes();
+
+    if (action == GLFW_PRESS)
+        buildView();
+}
+
+// The window changed size, so the viewport and the picture need redoing
+static void framebuffer_size_callback(GLFWwindow* window, int width, int height)
+{
+    viewDirty = 1;
+}
+
+// The window system lost what was in the window, e.g. it was uncovered
+static void refresh_callback(GLFWwindow* window)
+{
+    viewDirty = 1;
 }
 
 // Same Compile shade checker from the tex demo
@@ -195,280 +399,7690 @@ void glLinkProgramOrDie(GLuint program)
 }
 
 
-// Main will both load the ppm image be it P6 or P3
-// and will load that image into the ez-view application in order to
-// perform some affine transformations on it
-int main(int argc, char *argv[])
-{
-    GLFWwindow* window;
-    GLuint vertex_buffer, vertex_shader, fragment_shader, program;
-    GLint mvp_location, vpos_location;
-
-///////////////////////////////////// START OF IMAGE LOADING /////////////////////////////////////
+///////////////////////////////////// SIMD HELPERS /////////////////////////////////////
 
-    // Create variables for the image loading
-    FILE *source;
-    int magicNumber;
-    char c;
-    int width, height, maxColor;
-    int i, j, size, totalItemsRead, pixel;
+// Index of the lowest set bit, value must not be zero
+static int countTrailingZeros(unsigned int value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
 
-    //Create a buffer for the pixmap image
-    Pixmap *buffer = (Pixmap *)malloc(sizeof(Pixmap));
+// Index of the highest set bit, value must not be zero
+static int highestBit(unsigned int value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return (int)index;
+#else
+    return 31 - __builtin_clz(value);
+#endif
+}
 
-    source = fopen (argv[1], "r");
-    if(source == NULL)
-    {
-        fprintf(stderr, "\nERROR: File cannot be opened & or does not Exist!");
-        fclose(source);
-        free(buffer);
-        exit(-1);
-    }
+// Checks that both the cpu and the os support AVX2
+static int cpuHasAvx2(void)
+{
+#if defined(EZ_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return 0;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, then make sure the os saves the ymm registers
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+        return 0;
+    if ((_xgetbv(0) & 6) != 6)
+        return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+#elif defined(EZ_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
 
-    fscanf(source, "P%c\n", &c);
-    magicNumber = c -'0';// convert the magic number over to an int
+// Checks for SSSE3, which the os needs nothing extra for
+static int cpuHasSsse3(void)
+{
+#if defined(EZ_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] >> 9) & 1;
+#elif defined(EZ_X86)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    return 0;
+#endif
+}
 
-    if (magicNumber != 6 && magicNumber != 3 ) //if not in either p6 or p3 format then exit
-    {
-        fprintf(stderr, "\nERROR: This is not in the correct ppm format!");
-        free(buffer);
-        fclose(source);
-        exit(-1);
-    }
+///////////////////////////////////// THREAD HELPERS /////////////////////////////////////
 
-    c = getc(source);
-    //skip the comments since they do not matter
-    while(c =='#')
-    {
-        c = getc(source);
-        while(c!='\n') //read to the end of the line
-        {
-            c = getc(source);
-        }
-    }
-    // get it ready to read in the width, height, max color
-    ungetc(c, source);
+// Thin wrapper so the same worker code runs on Win32 threads and pthreads
+#ifdef _WIN32
+typedef HANDLE Thread;
+#else
+typedef pthread_t Thread;
+#endif
 
-    // read in the width, height. and max color value
-    fscanf(source, "%d %d %d\n", &width, &height, &maxColor);
+typedef struct ThreadStart
+{
+    void (*proc)(void *context);
+    void *context;
+} ThreadStart;
 
-    if(maxColor > 255 || maxColor <= 0){
-        fprintf(stderr,"\nERROR: Image is not 8 bits per channel!");
-        fclose(source);
-        free(buffer);
-        exit(-1);
-    }
-    // mult the size by three to account for rgb
-    size = width * height * 3;
+#ifdef _WIN32
+static DWORD WINAPI threadTrampoline(LPVOID parameter)
+#else
+static void *threadTrampoline(void *parameter)
+#endif
+{
+    ThreadStart start = *(ThreadStart *)parameter;
+    free(parameter);
+    start.proc(start.context);
+    return 0;
+}
 
-    // Put everything necessary into the buffer to be used to write it out into a different or even same format.
-    // Except for the data because we just want to make sure that we allocate enough memory first.
-    if(!buffer)
-    {
-        fprintf(stderr, "\nERROR: Cannot allocate memory for the ppm image.");
-        fclose(source);
-        free(buffer);
-        exit(-1);
-    }
-    else{
-        buffer->width = width;
-        buffer->height = height;
-        buffer->magicNumber = magicNumber;
-        // Allocate memory for the entire image and mult by three to account for RGB
-        buffer->image = (unsigned char *)malloc(width*height*3);
-    }
+// Starts proc(context) on a new thread. Returns 0 if the thread could not start
+static int startThread(Thread *thread, void (*proc)(void *context), void *context)
+{
+    ThreadStart *start = (ThreadStart *)malloc(sizeof(ThreadStart));
+    if (!start)
+        return 0;
+    start->proc = proc;
+    start->context = context;
 
-    if(!buffer->image){
-        fprintf(stderr,"\nERROR: Cannot allocate memory for the ppm image!");
-        fclose(source);
-        free(buffer);
-        exit(-1);
-    }
-    //printf("\nBuffer successfully created with all stuff!\n");
-    // Read the image into the buffer depending on whether it is in P6 or P3 format
-    // If its raw bits
-    if(magicNumber == 6)
-    {   // Read from the file the entire size of the image at a One Byte size into the buffer
-        totalItemsRead = fread((void *) buffer->image, 1, (size_t) size, source);
-        if (totalItemsRead != size)
-        {
-            fprintf(stderr,"\nERROR: Could not read the entire image! \n");
-            fclose(source);
-            free(buffer);
-            exit(-1);
-        }
-    }
-    else if(magicNumber == 3)
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, threadTrampoline, start, 0, NULL);
+    if (*thread == NULL)
+#else
+    if (pthread_create(thread, NULL, threadTrampoline, start) != 0)
+#endif
     {
-        for(i=0;i<height;i++)
-        {
-            for(j=0;j<width;j++)
-            {
-                fscanf(source, "%d ", &pixel);
-                buffer->image[i*width*3+3*j] = pixel;
-                fscanf(source, "%d ", &pixel);
-                buffer->image[i*width*3+3*j+1] = pixel;
-                fscanf(source, "%d ", &pixel);
-                buffer->image[i*width*3+3*j+2] = pixel;
-            }
-        }
+        free(start);
+        return 0;
     }
+    return 1;
+}
 
-    fclose(source);
+// Waits for a thread from startThread to finish
+static void joinThread(Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
 
-///////////////////////////////////// END OF IMAGE LOADING /////////////////////////////////////
+// Number of logical processors, never less than one
+static int cpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
 
-    // initialize glfw library
-    if (!glfwInit())
-        exit(EXIT_FAILURE);
+// Publishes a value to another thread, everything written before is visible first
+static void atomicStore(volatile long *target, long value)
+{
+#ifdef _WIN32
+    InterlockedExchange(target, value);
+#else
+    __atomic_store_n(target, value, __ATOMIC_RELEASE);
+#endif
+}
 
-    // Same hints used in the demo provided
-	glfwDefaultWindowHints();
-	glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
-	glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+// Reads a value published with atomicStore
+static long atomicLoad(volatile long *target)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange(target, 0, 0);
+#else
+    return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+#endif
+}
 
-    window = glfwCreateWindow(640, 480, "EZ-View", NULL, NULL);
+// Adds one and returns the new value, safe from any number of threads
+static long atomicIncrement(volatile long *target)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(target);
+#else
+    return __atomic_add_fetch(target, 1, __ATOMIC_ACQ_REL);
+#endif
+}
 
-    // If the window does not initiate then terminate the program and close the window
-    if (!window)
-    {
-        glfwTerminate();
-        exit(EXIT_FAILURE);
-    }
+// Monotonic clock in seconds, usable before glfwInit unlike glfwGetTime
+static double nowSeconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
 
-    // Turn on key callback in order to take in the user inputs
-    // for affine transformations
-    glfwSetKeyCallback(window, key_callback);
+// CPU time the whole process has used so far, all threads together
+static double processCpuSeconds(void)
+{
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+        return 0;
+    return ((double)(((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+            (double)(((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 1e-7;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
 
-    glfwMakeContextCurrent(window);
-    glfwSwapInterval(1);
+// Lock plus condition variable, for threads that have to wait on each other
+// rather than just publish values
+typedef struct Monitor
+{
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+} Monitor;
 
+static void initMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(&monitor->lock);
+    InitializeConditionVariable(&monitor->changed);
+#else
+    pthread_mutex_init(&monitor->lock, NULL);
+    pthread_cond_init(&monitor->changed, NULL);
+#endif
+}
 
-    glGenBuffers(1, &vertex_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexes), vertexes, GL_STATIC_DRAW);
+static void destroyMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_destroy(&monitor->lock);
+    pthread_cond_destroy(&monitor->changed);
+#endif
+}
 
-    // Create the vertex shader and  do some error checking
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
-    glCompileShaderOrDie(vertex_shader);
+static void lockMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_lock(&monitor->lock);
+#endif
+}
 
-    // Create the fragment shader and do some error checking
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
-    glCompileShaderOrDie(fragment_shader);
+static void unlockMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_unlock(&monitor->lock);
+#endif
+}
 
+// Sleeps until another thread calls wakeMonitor, the lock must be held
+static void waitMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(&monitor->changed, &monitor->lock, INFINITE);
+#else
+    pthread_cond_wait(&monitor->changed, &monitor->lock);
+#endif
+}
 
-    // Create the program and do some error checking
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
-    glLinkProgramOrDie(program);
+// Wakes every thread waiting on the monitor
+static void wakeMonitor(Monitor *monitor)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&monitor->changed);
+#else
+    pthread_cond_broadcast(&monitor->changed);
+#endif
+}
 
-    mvp_location = glGetUniformLocation(program, "MVP");
-    assert(mvp_location != -1);
+typedef struct WorkerStart
+{
+    void (*proc)(void *context, int index);
+    void *context;
+    int index;
+} WorkerStart;
 
-    vpos_location = glGetAttribLocation(program, "vPos");
-    assert(vpos_location != -1);
+static void workerEntry(void *parameter)
+{
+    WorkerStart *start = (WorkerStart *)parameter;
+    start->proc(start->context, start->index);
+}
 
-    GLint texcoord_location = glGetAttribLocation(program, "TexCoordIn");
-    assert(texcoord_location != -1);
+// Runs proc(context, index) for every index below count, one thread each,
+// and returns once all of them are done. Index 0 runs on the calling thread
+static void runWorkers(int count, void (*proc)(void *context, int index), void *context)
+{
+    WorkerStart *starts = (WorkerStart *)malloc(sizeof(WorkerStart) * count);
+    Thread *threads = (Thread *)malloc(sizeof(Thread) * count);
+    char *started = (char *)calloc(count, 1);
+    int i;
 
-    GLint tex_location = glGetUniformLocation(program, "Texture");
-    assert(tex_location != -1);
+    if (!starts || !threads || !started)
+    {
+        // Out of memory for the bookkeeping, just do it all here
+        for (i = 0; i < count; i++)
+            proc(context, i);
+        free(starts);
+        free(threads);
+        free(started);
+        return;
+    }
 
-    glEnableVertexAttribArray(vpos_location);
-    glVertexAttribPointer(vpos_location,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (void*) 0);
+    for (i = 1; i < count; i++)
+    {
+        starts[i].proc = proc;
+        starts[i].context = context;
+        starts[i].index = i;
+        started[i] = (char)startThread(&threads[i], workerEntry, &starts[i]);
+    }
 
-    glEnableVertexAttribArray(texcoord_location);
-    glVertexAttribPointer(texcoord_location,
-                          2,
-                          GL_FLOAT,
-                          GL_FALSE,
-                          sizeof(Vertex),
-                          (void*) (sizeof(float) * 2));
+    proc(context, 0);
 
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-
-    glTexImage2D(GL_TEXTURE_2D,
-                 0,
-                 GL_RGB,
-                 width,
-                 height,
-                 0,
-                 GL_RGB,
-                 GL_UNSIGNED_BYTE,
-                 buffer->image);
+    // Anything that failed to get its own thread runs here instead
+    for (i = 1; i < count; i++)
+    {
+        if (started[i])
+            joinThread(threads[i]);
+        else
+            proc(context, i);
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texID);
-    glUniform1i(tex_location, 0);
+    free(starts);
+    free(threads);
+    free(started);
+}
 
+///////////////////////////////////// IMAGE LOADING HELPERS /////////////////////////////////////
 
-    while (!glfwWindowShouldClose(window))
-    {
-        float ratio;
-        int windowWidth, windowHeight;
+// Page aligned heap memory, for buffers that are read into or uploaded from
+static void *alignedAlloc(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, 4096);
+#else
+    void *memory;
+    return posix_memalign(&memory, 4096, size) == 0 ? memory : NULL;
+#endif
+}
 
-        //matrices for each transformation and their intermediate values
-        mat4x4 r, h, s, t, rh, rhs, mvp;
+static void alignedFree(void *memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
 
-        glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
-        ratio = windowWidth / (float) windowHeight;
+// Maps the given file into memory, falling back to reading it into the heap
+// when mapping is not possible. Returns 0 if the file could not be opened
+static int openMappedFile(const char *path, MappedFile *file)
+{
+    FILE *source;
+    long length;
 
-        glViewport(0, 0, windowWidth, windowHeight);
-        glClear(GL_COLOR_BUFFER_BIT);
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
 
-         //add current rotation to the given image
-        mat4x4_identity(r);
-        mat4x4_rotate_Z(r, r, rotation);
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        LARGE_INTEGER length64;
+        if (GetFileSizeEx(handle, &length64) && length64.QuadPart > 0)
+        {
+            HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping)
+            {
+                // The view keeps the mapping alive, so both handles can go
+                file->data = (unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+            file->size = (size_t)length64.QuadPart;
+        }
+        CloseHandle(handle);
+        if (file->data)
+        {
+            file->mapped = 1;
+            return 1;
+        }
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+                file->data = (unsigned char *)data;
+                file->size = (size_t)info.st_size;
+                file->mapped = 1;
+            }
+        }
+        close(fd);
+        if (file->mapped)
+            return 1;
+    }
+#endif
 
-        //add current shear value to the given image
-        mat4x4_identity(h);
-        h[0][1] = shearX;
-        h[1][0] = shearY;
+    // Mapping did not work out so read the whole file into the heap instead
+    source = fopen(path, "rb");
+    if (source == NULL)
+        return 0;
 
-        //add current scale value to the given image
-        mat4x4_identity(s);
-        s[0][0] = s[0][0]*scale;
-        s[1][1] = s[1][1]*scale;
+    fseek(source, 0, SEEK_END);
+    length = ftell(source);
+    fseek(source, 0, SEEK_SET);
+    if (length <= 0)
+    {
+        fclose(source);
+        return 0;
+    }
 
-        //add current translate value to the given image
-        mat4x4_identity(t);
-        mat4x4_translate(t, translateX, translateY, 0);
+    file->data = (unsigned char *)malloc((size_t)length);
+    if (!file->data)
+    {
+        fclose(source);
+        return 0;
+    }
+    file->size = fread(file->data, 1, (size_t)length, source);
+    fclose(source);
+    return 1;
+}
 
-        //Do the calculations that will actually affect the image by all current important values
-        mat4x4_mul(rh, r, h); //R*H
-        mat4x4_mul(rhs, rh, s);//R*H*S
-        mat4x4_mul(mvp, rhs, t);//R*H*S*T
+// Releases whatever openMappedFile handed out
+static void closeMappedFile(MappedFile *file)
+{
+    if (!file->data)
+        return;
 
+    if (file->mapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(file->data);
+#else
+        munmap(file->data, file->size);
+#endif
+    }
+    else
+        free(file->data);
 
-        // Render the updated version of the image
-        glUseProgram(program);
-        glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+    file->data = NULL;
+    file->size = 0;
+}
 
-        glfwSwapBuffers(window);
+// Moves i past any whitespace and comments in the header
+static size_t skipHeaderSpace(const unsigned char *data, size_t size, size_t i)
+{
+    for (;;)
+    {
+        while (i < size && (data[i] == ' ' || data[i] == '\t' || data[i] == '\n' ||
+                            data[i] == '\r' || data[i] == '\v' || data[i] == '\f'))
+            i++;
 
-        // Processes the events that have occurred which in this case
-        // come from the keyboard input
-        glfwPollEvents();
+        //skip the comments since they do not matter
+        if (i < size && data[i] == '#')
+        {
+            while (i < size && data[i] != '\n')
+                i++;
+            continue;
+        }
+        return i;
     }
+}
 
-    // Clean Up
+// Reads one decimal number from the header starting at *pos, skipping any
+// whitespace and comments in front of it. Returns 0 if there is no number
+static int readHeaderNumber(const unsigned char *data, size_t size, size_t *pos, int *value)
+{
+    size_t i = skipHeaderSpace(data, size, *pos);
+    long number = 0;
+
+    if (i >= size || data[i] < '0' || data[i] > '9')
+        return 0;
+
+    while (i < size && data[i] >= '0' && data[i] <= '9')
+    {
+        number = number * 10 + (data[i] - '0');
+        if (number > 0x7fffffff)
+            return 0;
+        i++;
+    }
+
+    *value = (int)number;
+    *pos = i;
+    return 1;
+}
+
+// Reads one upper case header keyword such as WIDTH into word
+static int readHeaderWord(const unsigned char *data, size_t size, size_t *pos,
+                          char *word, size_t room)
+{
+    size_t i = skipHeaderSpace(data, size, *pos), length = 0;
+
+    while (i < size && ((data[i] >= 'A' && data[i] <= 'Z') || data[i] == '_'))
+    {
+        if (length + 1 < room)
+            word[length++] = (char)data[i];
+        i++;
+    }
+    word[length] = '\0';
+    *pos = i;
+    return length > 0;
+}
+
+// PAM headers are KEY value lines ending in ENDHDR. Only the depth decides
+// how the image is shown, so GRAYSCALE, RGB, their _ALPHA versions and any
+// other tuple type with a depth of 1 to 4 all work
+static int parsePamHeader(const unsigned char *data, size_t size, PpmHeader *header)
+{
+    size_t pos = 2;
+    char key[16];
+
+    header->width = header->height = header->depth = header->maxColor = 0;
+
+    while (readHeaderWord(data, size, &pos, key, sizeof(key)))
+    {
+        if (strcmp(key, "ENDHDR") == 0)
+        {
+            // The raster starts on the line after ENDHDR
+            while (pos < size && data[pos] != '\n')
+                pos++;
+            if (pos >= size)
+                return 0;
+            header->rasterOffset = pos + 1;
+            return header->width > 0 && header->height > 0 &&
+                   header->depth >= 1 && header->depth <= 4;
+        }
+        else if (strcmp(key, "WIDTH") == 0)
+        {
+            if (!readHeaderNumber(data, size, &pos, &header->width))
+                return 0;
+        }
+        else if (strcmp(key, "HEIGHT") == 0)
+        {
+            if (!readHeaderNumber(data, size, &pos, &header->height))
+                return 0;
+        }
+        else if (strcmp(key, "DEPTH") == 0)
+        {
+            if (!readHeaderNumber(data, size, &pos, &header->depth))
+                return 0;
+        }
+        else if (strcmp(key, "MAXVAL") == 0)
+        {
+            if (!readHeaderNumber(data, size, &pos, &header->maxColor))
+                return 0;
+        }
+        else if (strcmp(key, "TUPLTYPE") == 0)
+        {
+            while (pos < size && data[pos] != '\n')
+                pos++;
+        }
+        else
+            return 0;
+    }
+    return 0;
+}
+
+// Parses the netpbm header in place and finds where the raster starts.
+// Returns 0 if the header is not a P1 to P7 header we understand
+static int parsePpmHeader(const unsigned char *data, size_t size, PpmHeader *header)
+{
+    size_t pos = 2;
+
+    if (size < 2 || data[0] != 'P')
+        return 0;
+
+    header->magicNumber = data[1] - '0';// convert the magic number over to an int
+    if (header->magicNumber == 7)
+        return parsePamHeader(data, size, header);
+    if (header->magicNumber < 1 || header->magicNumber > 6)
+        return 0;
+    header->depth = (header->magicNumber == 3 || header->magicNumber == 6) ? 3 : 1;
+
+    // read in the width, height. and max color value, bitmaps have no max color
+    header->maxColor = 1;
+    if (!readHeaderNumber(data, size, &pos, &header->width) ||
+        !readHeaderNumber(data, size, &pos, &header->height))
+        return 0;
+    if (header->magicNumber != 1 && header->magicNumber != 4 &&
+        !readHeaderNumber(data, size, &pos, &header->maxColor))
+        return 0;
+
+    if (header->width <= 0 || header->height <= 0)
+        return 0;
+
+    // Exactly one whitespace character separates the max color from the raster
+    if (pos >= size)
+        return 0;
+    header->rasterOffset = pos + 1;
+    return 1;
+}
+
+// Bytes a binary raster takes up in the file, 0 for the plain text formats
+static size_t rawRasterSize(const PpmHeader *header, int channels)
+{
+    size_t pixels = (size_t)header->width * header->height;
+
+    if (header->magicNumber == 4)
+        return (size_t)((header->width + 7) / 8) * header->height;
+    if (header->magicNumber >= 5)
+        return pixels * channels * (header->maxColor > 255 ? 2 : 1);
+    return 0;
+}
+
+// Headers asking for a bigger pixmap than this are refused before anything
+// is allocated
+#define MAX_IMAGE_BYTES (1ULL << 34)
+
+// Whether the 8 bit pixmap for a header can be held at all: no more than
+// MAX_IMAGE_BYTES, or half the address space, and each row small enough
+// for int even at 16 bits a sample
+static int imageSizeAllowed(const PpmHeader *header, int channels)
+{
+    unsigned long long row = (unsigned long long)header->width * channels, bytes;
+
+    if (row > INT_MAX / 2)
+        return 0;
+    bytes = row * (unsigned long long)header->height;
+    return bytes <= MAX_IMAGE_BYTES && bytes <= (size_t)-1 / 2;
+}
+
+// A binary raster with a max color of 255 can be used straight from the file
+static int rasterInPlace(const PpmHeader *header)
+{
+    return header->magicNumber >= 5 && header->maxColor == 255;
+}
+
+// Texture format matching the pixmap layout
+static GLenum pixmapFormat(const Pixmap *buffer)
+{
+    switch (buffer->channels)
+    {
+    case 1:
+        return GL_LUMINANCE;
+    case 2:
+        return GL_LUMINANCE_ALPHA;
+    case 4:
+        return GL_RGBA;
+    default:
+        return GL_RGB;
+    }
+}
+
+// Brings a sample from 0..maxColor to 0..255, rounding to nearest
+static unsigned char scaleSample(int value, int maxColor)
+{
+    if (value >= maxColor)
+        return 255;
+    return (unsigned char)((value * 255 + maxColor / 2) / maxColor);
+}
+
+// The SIMD tokenizer hands out values of up to 3 digits, or 5 for 16 bit
+// images, so the table covers all of those without a range check
+#define SAMPLE_LUT_SIZE(maxColor) ((maxColor) > 255 ? 100000 : 1000)
+
+// Builds the table every decoded sample is looked up in on its way into the
+// pixmap, mapping 0..maxColor onto 0..255 and anything above to 255. With a
+// maxColor of 255 it is the identity, so scaled and unscaled images cost the same
+static unsigned char *buildSampleLut(int maxColor)
+{
+    int size = SAMPLE_LUT_SIZE(maxColor), value;
+    unsigned char *lut = (unsigned char *)malloc(size);
+
+    if (lut)
+        for (value = 0; value < size; value++)
+            lut[value] = scaleSample(value, maxColor);
+    return lut;
+}
+
+// Turns the digit and whitespace masks of one block of P3 text into samples.
+// Only tokens that are known to be complete inside the block are decoded, the
+// scalar path takes over at anything unusual (comments, long tokens, junk).
+// Returns the number of samples written and sets *advance to how far the
+// caller can move forward, which is always to whitespace or a token start
+static size_t decodeAsciiMasks(const unsigned char *block, unsigned int digits,
+                               unsigned int spaces, int width, size_t *advance,
+                               unsigned char *out, size_t room, const unsigned char *lut,
+                               int maxColor)
+{
+    unsigned int full = width == 32 ? 0xffffffffu : (1u << width) - 1;
+    unsigned int other = ~(digits | spaces) & full;
+    unsigned int starts, ends;
+    int limit = width, partial = -1;
+    int start = 0, end, length, value, k;
+    int longest = maxColor > 255 ? 5 : 3;
+    size_t count = 0, consumed = 0;
+
+    // Anything past the first odd byte is left for the scalar path
+    if (other)
+    {
+        limit = countTrailingZeros(other);
+        digits &= (1u << limit) - 1;
+    }
+
+    starts = digits & ~(digits << 1);
+    ends = digits & ~(digits >> 1);
+
+    // A run that touches the end of the block may carry on into the next one
+    if (limit == width && (digits >> (width - 1)) & 1)
+    {
+        partial = highestBit(starts);
+        starts &= ~(1u << partial);
+        ends &= partial ? (1u << partial) - 1 : 0;
+    }
+
+    while (starts)
+    {
+        start = countTrailingZeros(starts);
+        if (count == room)
+            break;
+
+        end = countTrailingZeros(ends & ~((1u << start) - 1));
+        length = end - start + 1;
+        if (length > longest)
+            break;
+
+        if (length == 1)
+            value = block[start] - '0';
+        else if (length == 2)
+            value = (block[start] - '0') * 10 + (block[start + 1] - '0');
+        else
+        {
+            value = 0;
+            for (k = start; k <= end; k++)
+                value = value * 10 + (block[k] - '0');
+        }
+        out[count] = lut[value];
+
+        count++;
+        consumed = end + 1;
+        starts &= starts - 1;
+    }
+
+    if (starts)
+        *advance = count ? consumed : (size_t)start;
+    else if (partial >= 0)
+        *advance = (size_t)partial;
+    else
+        *advance = (size_t)limit;
+    return count;
+}
+
+#ifdef EZ_X86
+// Classifies 16 bytes of P3 text at once with SSE2 compares
+EZ_TARGET("sse2")
+static size_t decodeAsciiBlockSse2(const unsigned char *text, size_t *advance,
+                                   unsigned char *out, size_t room,
+                                   const unsigned char *lut, int maxColor)
+{
+    __m128i bytes = _mm_loadu_si128((const __m128i *)text);
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                 _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                                               _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1))));
+
+    return decodeAsciiMasks(text, (unsigned int)_mm_movemask_epi8(digit),
+                            (unsigned int)_mm_movemask_epi8(space), 16, advance, out, room, lut, maxColor);
+}
+
+// Same as the SSE2 version but 32 bytes at a time
+EZ_TARGET("avx2")
+static size_t decodeAsciiBlockAvx2(const unsigned char *text, size_t *advance,
+                                   unsigned char *out, size_t room,
+                                   const unsigned char *lut, int maxColor)
+{
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)text);
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                    _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('\t' - 1)),
+                                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), bytes)));
+
+    return decodeAsciiMasks(text, (unsigned int)_mm256_movemask_epi8(digit),
+                            (unsigned int)_mm256_movemask_epi8(space), 32, advance, out, room, lut, maxColor);
+}
+#endif
+
+// Decodes up to count P3 samples from text starting at *pos into out.
+// The SIMD block decoders do the bulk of the work and the scalar
+// readHeaderNumber picks up whatever they leave behind. Returns how many
+// samples were decoded, which is less than count on malformed input
+static size_t decodeAsciiSamples(const unsigned char *text, size_t size, size_t *pos,
+                                 unsigned char *out, size_t count,
+                                 const unsigned char *lut, int maxColor)
+{
+    size_t done = 0, p = *pos, advance;
+    int value;
+
+    while (done < count)
+    {
+#ifdef EZ_X86
+        advance = 0;
+        if (haveAvx2 && size - p >= 32)
+            done += decodeAsciiBlockAvx2(text + p, &advance, out + done, count - done,
+                                         lut, maxColor);
+        else if (size - p >= 16)
+            done += decodeAsciiBlockSse2(text + p, &advance, out + done, count - done,
+                                         lut, maxColor);
+        if (advance)
+        {
+            p += advance;
+            continue;
+        }
+#endif
+        if (!readHeaderNumber(text, size, &p, &value))
+            break;
+        out[done++] = lut[value > maxColor ? maxColor : value];
+    }
+
+    *pos = p;
+    return done;
+}
+
+static int isAsciiSpace(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// Decodes up to count P1 pixels. Each one is a single '0' or '1' and they
+// do not have to be separated, so the sample tokenizer can not be used.
+// 1 is black. Returns how many pixels were decoded
+static size_t decodeAsciiBits(const unsigned char *text, size_t size, size_t *pos,
+                              unsigned char *out, size_t count)
+{
+    size_t done = 0, p = *pos;
+
+    while (done < count && p < size)
+    {
+        unsigned char c = text[p];
+        if (c == '0' || c == '1')
+            out[done++] = c == '1' ? 0 : 255;
+        else if (c == '#')
+        {
+            while (p < size && text[p] != '\n')
+                p++;
+            continue;
+        }
+        else if (!isAsciiSpace(c))
+            break;
+        p++;
+    }
+
+    *pos = p;
+    return done;
+}
+
+// Counts the samples in text[begin, end) without decoding them.
+// Returns -1 if there is anything but digits and whitespace in there
+static long countAsciiSamples(const unsigned char *text, size_t begin, size_t end)
+{
+    size_t p = begin;
+    long count = 0;
+    int previousDigit = 0;
+
+#ifdef EZ_X86
+    // Every digit whose left neighbour is not a digit starts a sample
+    while (end - p >= 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(text + p));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                     _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                                                   _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1))));
+        unsigned int digits = (unsigned int)_mm_movemask_epi8(digit);
+        unsigned int spaces = (unsigned int)_mm_movemask_epi8(space);
+        unsigned int starts;
+
+        if ((digits | spaces) != 0xffff)
+            return -1;
+
+        starts = digits & ~((digits << 1) | (unsigned int)previousDigit);
+        while (starts)
+        {
+            count++;
+            starts &= starts - 1;
+        }
+        previousDigit = (digits >> 15) & 1;
+        p += 16;
+    }
+#endif
+
+    for (; p < end; p++)
+    {
+        if (text[p] >= '0' && text[p] <= '9')
+        {
+            if (!previousDigit)
+                count++;
+            previousDigit = 1;
+        }
+        else if (isAsciiSpace(text[p]))
+            previousDigit = 0;
+        else
+            return -1;
+    }
+    return count;
+}
+
+// Shared state for decoding one P3 raster across several threads
+typedef struct AsciiJob
+{
+    const unsigned char *text;
+    size_t *bounds;     // chunk i is text[bounds[i], bounds[i+1])
+    long *counts;       // samples in each chunk, then -1 on a bad chunk
+    size_t *offsets;    // where each chunk starts writing in out
+    unsigned char *out;
+    size_t total;       // number of samples the image needs
+    const unsigned char *lut;
+    int maxColor;
+    int pass;           // 0 counts, 1 decodes
+} AsciiJob;
+
+static void asciiWorker(void *context, int index)
+{
+    AsciiJob *job = (AsciiJob *)context;
+    size_t begin = job->bounds[index], end = job->bounds[index + 1], want;
+
+    if (job->pass == 0)
+    {
+        job->counts[index] = countAsciiSamples(job->text, begin, end);
+        return;
+    }
+
+    if (job->offsets[index] >= job->total)
+        return;
+    want = job->total - job->offsets[index];
+    if ((size_t)job->counts[index] < want)
+        want = (size_t)job->counts[index];
+
+    if (decodeAsciiSamples(job->text, end, &begin, job->out + job->offsets[index], want,
+                           job->lut, job->maxColor) != want)
+        job->counts[index] = -1;
+}
+
+// Decodes a P3 raster of total samples from text[begin, size) into out,
+// splitting the text across all cores. Each chunk is counted first and a
+// prefix sum over the counts tells every chunk where its samples go.
+// Returns 0 if the raster is malformed or short
+static int decodeAsciiRaster(const unsigned char *text, size_t size, size_t begin,
+                             unsigned char *out, size_t total,
+                             const unsigned char *lut, int maxColor)
+{
+    AsciiJob job;
+    int chunks = cpuCount(), i, ok = 1;
+    size_t sum = 0;
+
+    // Not worth the threads for small files, and a comment could hide
+    // whitespace that a chunk boundary would wrongly split on
+    if (chunks > 64)
+        chunks = 64;
+    if ((size - begin) / chunks < (1 << 18))
+        chunks = (int)((size - begin) >> 18);
+    if (chunks <= 1 || memchr(text + begin, '#', size - begin))
+        return decodeAsciiSamples(text, size, &begin, out, total, lut, maxColor) == total;
+
+    job.text = text;
+    job.out = out;
+    job.total = total;
+    job.lut = lut;
+    job.maxColor = maxColor;
+    job.bounds = (size_t *)malloc(sizeof(size_t) * (chunks + 1));
+    job.counts = (long *)malloc(sizeof(long) * chunks);
+    job.offsets = (size_t *)malloc(sizeof(size_t) * chunks);
+    if (!job.bounds || !job.counts || !job.offsets)
+    {
+        free(job.bounds);
+        free(job.counts);
+        free(job.offsets);
+        return decodeAsciiSamples(text, size, &begin, out, total, lut, maxColor) == total;
+    }
+
+    // Chunk boundaries always land on whitespace so no sample is split
+    job.bounds[0] = begin;
+    job.bounds[chunks] = size;
+    for (i = 1; i < chunks; i++)
+    {
+        size_t bound = begin + (size - begin) / chunks * i;
+        if (bound < job.bounds[i - 1])
+            bound = job.bounds[i - 1];
+        while (bound < size && !isAsciiSpace(text[bound]))
+            bound++;
+        job.bounds[i] = bound;
+    }
+
+    job.pass = 0;
+    runWorkers(chunks, asciiWorker, &job);
+
+    for (i = 0; i < chunks; i++)
+    {
+        if (job.counts[i] < 0)
+            ok = 0;
+        job.offsets[i] = sum;
+        sum += job.counts[i] < 0 ? 0 : (size_t)job.counts[i];
+    }
+
+    if (ok && sum >= total)
+    {
+        job.pass = 1;
+        runWorkers(chunks, asciiWorker, &job);
+        for (i = 0; i < chunks; i++)
+            if (job.counts[i] < 0)
+                ok = 0;
+    }
+    else if (ok)
+        ok = -1; // too few samples, which the serial path would reject too
+
+    free(job.bounds);
+    free(job.counts);
+    free(job.offsets);
+
+    // Odd bytes somewhere in the text, let the serial path decide if they
+    // matter so both paths accept and reject exactly the same files
+    if (ok == 0)
+        return decodeAsciiSamples(text, size, &begin, out, total, lut, maxColor) == total;
+    return ok == 1;
+}
+
+// 4x4 Bayer matrix for ordered dithering
+static const unsigned char bayer4[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+// Fills in the rounding offset, in 32nds, for the first 56 samples of image
+// row y. The pattern repeats every 48 samples (every 4 pixels for any of 1
+// to 4 channels), and the extra 8 let the SIMD kernel load 8 at once from
+// any phase. Without dithering every sample gets 16/32, plain round to nearest
+#define DITHER_PERIOD 48
+
+static void ditherOffsets(unsigned short offsets[DITHER_PERIOD + 8], int y, int channels)
+{
+    int k;
+    for (k = 0; k < DITHER_PERIOD + 8; k++)
+        offsets[k] = dither ? 2 * bayer4[y & 3][(k / channels) & 3] + 1 : 16;
+}
+
+#ifdef EZ_X86
+// Byte swaps and rescales 8 samples at a time. The float estimate of
+// v*255/maxColor + offset/32 is off by at most one, so it is checked against
+// the exact integer bounds q*32*maxColor <= 8160*v + offset*maxColor < (q+1)*32*maxColor
+// and nudged, which keeps the result identical to the scalar code
+EZ_TARGET("sse2")
+static size_t convertSamples16Sse2(const unsigned char *src, unsigned char *dst, size_t count,
+                                   int maxColor, const unsigned short *offsets)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i m = _mm_set1_epi16((short)maxColor);
+    const __m128i k8160 = _mm_set1_epi16(8160);
+    const __m128i limit = _mm_set1_epi32(maxColor * 32 - 1);
+    const __m128 scale = _mm_set1_ps(255.0f / maxColor);
+    const __m128 sixteenth = _mm_set1_ps(1 / 32.0f);
+    size_t i;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        __m128i raw = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i v = _mm_or_si128(_mm_slli_epi16(raw, 8), _mm_srli_epi16(raw, 8));
+        __m128i o = _mm_loadu_si128((const __m128i *)(offsets + i % DITHER_PERIOD));
+        __m128i lo, hi, n0, n1, q0, q1, qs, r0, r1;
+        __m128 f0, f1;
+
+        // Samples above maxColor are clamped like the scalar path does
+        v = _mm_sub_epi16(v, _mm_subs_epu16(v, m));
+
+        // n = 8160*v + o*maxColor, exact in 32 bits
+        lo = _mm_mullo_epi16(v, k8160);
+        hi = _mm_mulhi_epu16(v, k8160);
+        n0 = _mm_unpacklo_epi16(lo, hi);
+        n1 = _mm_unpackhi_epi16(lo, hi);
+        lo = _mm_mullo_epi16(o, m);
+        hi = _mm_mulhi_epu16(o, m);
+        n0 = _mm_add_epi32(n0, _mm_unpacklo_epi16(lo, hi));
+        n1 = _mm_add_epi32(n1, _mm_unpackhi_epi16(lo, hi));
+
+        f0 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), scale),
+                        _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(o, zero)), sixteenth));
+        f1 = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), scale),
+                        _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(o, zero)), sixteenth));
+        q0 = _mm_cvttps_epi32(f0);
+        q1 = _mm_cvttps_epi32(f1);
+
+        // r = n - q*32*maxColor tells us which way the estimate is off
+        qs = _mm_slli_epi16(_mm_packs_epi32(q0, q1), 5);
+        lo = _mm_mullo_epi16(qs, m);
+        hi = _mm_mulhi_epu16(qs, m);
+        r0 = _mm_sub_epi32(n0, _mm_unpacklo_epi16(lo, hi));
+        r1 = _mm_sub_epi32(n1, _mm_unpackhi_epi16(lo, hi));
+        q0 = _mm_add_epi32(q0, _mm_sub_epi32(_mm_cmplt_epi32(r0, zero), _mm_cmpgt_epi32(r0, limit)));
+        q1 = _mm_add_epi32(q1, _mm_sub_epi32(_mm_cmplt_epi32(r1, zero), _mm_cmpgt_epi32(r1, limit)));
+
+        qs = _mm_packs_epi32(q0, q1);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(qs, qs));
+    }
+    return i;
+}
+#endif
+
+// Converts count big endian 16 bit samples to 8 bits, rounding with the
+// offsets from ditherOffsets
+static void convertSamples16(const unsigned char *src, unsigned char *dst, size_t count,
+                             int maxColor, const unsigned short *offsets)
+{
+    size_t i = 0;
+    int value;
+
+#ifdef EZ_X86
+    i = convertSamples16Sse2(src, dst, count, maxColor, offsets);
+#endif
+    for (; i < count; i++)
+    {
+        value = (src[2 * i] << 8) | src[2 * i + 1];
+        if (value > maxColor)
+            value = maxColor;
+        dst[i] = (unsigned char)((8160 * value + offsets[i % DITHER_PERIOD] * maxColor) / (32 * maxColor));
+    }
+}
+
+// Copies count 8 bit samples through the lookup table
+static void mapSamples(const unsigned char *src, unsigned char *dst, size_t count,
+                       const unsigned char *lut)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        dst[i] = lut[src[i]];
+        dst[i + 1] = lut[src[i + 1]];
+        dst[i + 2] = lut[src[i + 2]];
+        dst[i + 3] = lut[src[i + 3]];
+    }
+    for (; i < count; i++)
+        dst[i] = lut[src[i]];
+}
+
+#ifdef EZ_X86
+// Expands 16 PBM bits at a time into bytes. Each pair of source bytes is
+// spread over all 16 lanes, masked with that lane's bit and compared
+EZ_TARGET("sse2")
+static size_t expandBitsSse2(const unsigned char *src, unsigned char *dst, size_t pixels)
+{
+    const __m128i bits = _mm_setr_epi8((char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                       (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m128i white = _mm_set1_epi8((char)255);
+    size_t i;
+
+    for (i = 0; i + 16 <= pixels; i += 16)
+    {
+        __m128i x = _mm_cvtsi32_si128(src[i / 8] | (src[i / 8 + 1] << 8));
+        x = _mm_unpacklo_epi8(x, x);
+        x = _mm_unpacklo_epi16(x, x);
+        x = _mm_unpacklo_epi32(x, x);
+        x = _mm_cmpeq_epi8(_mm_and_si128(x, bits), bits);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_andnot_si128(x, white));
+    }
+    return i;
+}
+#endif
+
+// Expands one row of packed PBM bits, where 1 is black, into gray bytes
+static void expandBits(const unsigned char *src, unsigned char *dst, size_t pixels)
+{
+    size_t i = 0;
+
+#ifdef EZ_X86
+    i = expandBitsSse2(src, dst, pixels);
+#endif
+    for (; i < pixels; i++)
+        dst[i] = (src[i >> 3] >> (7 - (i & 7))) & 1 ? 0 : 255;
+}
+
+// Bytes in one row of a binary raster as it is stored in the file
+static size_t rawRowSize(const PpmHeader *header, int channels)
+{
+    return header->height ? rawRasterSize(header, channels) / header->height : 0;
+}
+
+// Converts rows [first, last) of a binary raster that can not be used in
+// place (bitmaps, 16 bit or a max color below 255) into the pixmap. raw
+// holds the file's bytes for row first onwards
+static void convertRows(ImageLoader *loader, const unsigned char *raw, int first, int last)
+{
+    Pixmap *buffer = loader->pixmap;
+    size_t rowSize = (size_t)buffer->width * buffer->channels;
+    size_t rawRow = rawRowSize(&loader->header, buffer->channels);
+    unsigned short offsets[DITHER_PERIOD + 8];
+    int y;
+
+    for (y = first; y < last; y++, raw += rawRow)
+    {
+        if (loader->header.magicNumber == 4)
+            expandBits(raw, buffer->image + rowSize * y, (size_t)buffer->width);
+        else if (loader->header.maxColor > 255)
+        {
+            ditherOffsets(offsets, y, buffer->channels);
+            convertSamples16(raw, buffer->image + rowSize * y, rowSize,
+                             loader->header.maxColor, offsets);
+        }
+        else
+            mapSamples(raw, buffer->image + rowSize * y, rowSize, loader->lut);
+    }
+}
+
+// Converts rows [first, last) straight from the raster in the file
+static void convertFileRows(ImageLoader *loader, int first, int last)
+{
+    convertRows(loader, loader->pixmap->source.data + loader->header.rasterOffset +
+                rawRowSize(&loader->header, loader->pixmap->channels) * first, first, last);
+}
+
+static void convertRowsWorker(void *context, int index)
+{
+    ImageLoader *loader = (ImageLoader *)context;
+    int workers = loader->workers, rows = loader->pixmap->height - loader->rowsDone;
+
+    convertFileRows(loader, loader->rowsDone + (int)((long long)rows * index / workers),
+                loader->rowsDone + (int)((long long)rows * (index + 1) / workers));
+}
+
+// Decodes up to rows more rows of the image. Returns 0 if the raster turns
+// out to be malformed or short
+static int decodeImageRows(ImageLoader *loader, int rows)
+{
+    Pixmap *buffer = loader->pixmap;
+    size_t rowSize = (size_t)buffer->width * buffer->channels;
+    int magicNumber = loader->header.magicNumber;
+
+    if (rows > buffer->height - loader->rowsDone)
+        rows = buffer->height - loader->rowsDone;
+
+    // Binary rows with a max color of 255 are already sitting in the mapped file
+    if (magicNumber == 1)
+    {
+        size_t want = rowSize * rows;
+        if (decodeAsciiBits(buffer->source.data, loader->rasterEnd, &loader->cursor,
+                            buffer->image + rowSize * loader->rowsDone, want) != want)
+            return 0;
+    }
+    else if (magicNumber == 2 || magicNumber == 3)
+    {
+        size_t want = rowSize * rows;
+        if (decodeAsciiSamples(buffer->source.data, loader->rasterEnd, &loader->cursor,
+                               buffer->image + rowSize * loader->rowsDone, want,
+                               loader->lut, loader->header.maxColor) != want)
+            return 0;
+    }
+    else if (!rasterInPlace(&loader->header))
+        convertFileRows(loader, loader->rowsDone, loader->rowsDone + rows);
+
+    loader->rowsDone += rows;
+    return 1;
+}
+
+// Decodes whatever is left of the image, on every core when it is all left
+static int decodeImage(ImageLoader *loader)
+{
+    Pixmap *buffer = loader->pixmap;
+
+    int magicNumber = loader->header.magicNumber;
+
+    if ((magicNumber == 2 || magicNumber == 3) && loader->rowsDone == 0)
+    {
+        if (!decodeAsciiRaster(buffer->source.data, loader->rasterEnd, loader->cursor,
+                               buffer->image, (size_t)buffer->width * buffer->height * buffer->channels,
+                               loader->lut, loader->header.maxColor))
+            return 0;
+        loader->rowsDone = buffer->height;
+        return 1;
+    }
+
+    // Binary conversion is split by rows across the cores
+    if (rawRasterSize(&loader->header, buffer->channels) && !rasterInPlace(&loader->header))
+    {
+        loader->workers = cpuCount();
+        if (loader->workers > buffer->height - loader->rowsDone)
+            loader->workers = buffer->height - loader->rowsDone;
+        if (loader->workers > 1)
+        {
+            runWorkers(loader->workers, convertRowsWorker, loader);
+            loader->rowsDone = buffer->height;
+            return 1;
+        }
+    }
+    return decodeImageRows(loader, buffer->height - loader->rowsDone);
+}
+
+///////////////////////////////////// ASYNC READS /////////////////////////////////////
+
+// With -async a binary raster is not paged in through the mapping but read
+// by a few threads with positioned reads, ASYNC_CHUNK_BYTES at a time into
+// a ring of ASYNC_SLOTS buffers. The decode thread converts and publishes
+// one chunk while the readers have the next ones in flight, which keeps
+// slow network disks busy instead of faulting in one page at a time
+#define ASYNC_CHUNK_BYTES (4 << 20)
+#define ASYNC_READERS 3
+#define ASYNC_SLOTS 6
+
+// Asks for the readers when a raster is large enough for them to pay off (-async)
+int asyncReads = 0;
+
+// Each reader opens its own handle so reads never share a file position
+#ifdef _WIN32
+typedef HANDLE ReadHandle;
+#define NO_READ_HANDLE INVALID_HANDLE_VALUE
+#else
+typedef int ReadHandle;
+#define NO_READ_HANDLE (-1)
+#endif
+
+static ReadHandle openReadHandle(const char *path)
+{
+#ifdef _WIN32
+    return CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                       FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#else
+    int fd = open(path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return fd;
+#endif
+}
+
+static void closeReadHandle(ReadHandle handle)
+{
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    close(handle);
+#endif
+}
+
+// Reads exactly size bytes at offset. Returns 0 on an error or a short file
+static int readAt(ReadHandle handle, unsigned char *out, size_t size, unsigned long long offset)
+{
+    while (size)
+    {
+        size_t want = size < (1u << 30) ? size : (1u << 30);
+#ifdef _WIN32
+        OVERLAPPED position;
+        DWORD got = 0;
+        memset(&position, 0, sizeof(position));
+        position.Offset = (DWORD)offset;
+        position.OffsetHigh = (DWORD)(offset >> 32);
+        if (!ReadFile(handle, out, (DWORD)want, &got, &position) || got == 0)
+            return 0;
+#else
+        ssize_t got = pread(handle, out, want, (off_t)offset);
+        if (got <= 0)
+            return 0;
+#endif
+        out += got;
+        size -= (size_t)got;
+        offset += (unsigned long long)got;
+    }
+    return 1;
+}
+
+typedef struct ChunkReader
+{
+    const char *path;
+    unsigned long long rasterOffset;
+    size_t rawRow, chunkBytes, lastChunkBytes;
+    int rowsPerChunk, chunkCount;
+    unsigned char *ring;     // ASYNC_SLOTS chunks, or NULL when reading straight into the pixmap
+    unsigned char *direct;   // where chunk 0 goes when there is no ring
+
+    Monitor monitor;        // guards everything below
+    int nextChunk;          // next chunk a reader will pick up
+    int released;           // chunks the decode thread is done with
+    int ready[ASYNC_SLOTS]; // chunk number + 1 sitting in each slot, 0 while empty
+    char *done;             // per chunk flag without a ring, they arrive in any order
+    int failed, stop;
+
+    Thread threads[ASYNC_READERS];
+    int threadCount;
+    double start, waited, finish;
+} ChunkReader;
+
+static unsigned char *chunkMemory(ChunkReader *reader, int chunk)
+{
+    if (reader->ring)
+        return reader->ring + (size_t)(chunk % ASYNC_SLOTS) * reader->chunkBytes;
+    return reader->direct + (size_t)chunk * reader->chunkBytes;
+}
+
+// Body of each reader thread: claim the next chunk, wait for its slot in
+// the ring to be given back, read it, hand it over. Repeat until done
+static void chunkReaderThread(void *context)
+{
+    ChunkReader *reader = (ChunkReader *)context;
+    ReadHandle handle = openReadHandle(reader->path);
+    int chunk, ok;
+
+    lockMonitor(&reader->monitor);
+    if (handle == NO_READ_HANDLE)
+    {
+        reader->failed = 1;
+        wakeMonitor(&reader->monitor);
+    }
+    while (!reader->failed && !reader->stop && reader->nextChunk < reader->chunkCount)
+    {
+        chunk = reader->nextChunk++;
+        while (reader->ring && chunk >= reader->released + ASYNC_SLOTS &&
+               !reader->failed && !reader->stop)
+            waitMonitor(&reader->monitor);
+        if (reader->failed || reader->stop)
+            break;
+        unlockMonitor(&reader->monitor);
+
+        ok = readAt(handle, chunkMemory(reader, chunk),
+                    chunk == reader->chunkCount - 1 ? reader->lastChunkBytes : reader->chunkBytes,
+                    reader->rasterOffset + (unsigned long long)chunk * reader->chunkBytes);
+
+        lockMonitor(&reader->monitor);
+        if (!ok)
+            reader->failed = 1;
+        else if (reader->ring)
+            reader->ready[chunk % ASYNC_SLOTS] = chunk + 1;
+        else
+            reader->done[chunk] = 1;
+        wakeMonitor(&reader->monitor);
+    }
+    unlockMonitor(&reader->monitor);
+
+    if (handle != NO_READ_HANDLE)
+        closeReadHandle(handle);
+}
+
+// Starts reading the raster of the image at path. Rasters that are used as
+// they are get read straight into the pixmap, the rest go through the ring
+// and are converted from there. Returns NULL if the readers could not start
+static ChunkReader *startChunkReader(const char *path, const PpmHeader *header, Pixmap *buffer)
+{
+    ChunkReader *reader = (ChunkReader *)calloc(1, sizeof(ChunkReader));
+    size_t rawSize = rawRasterSize(header, buffer->channels);
+    int i;
+
+    if (!reader)
+        return NULL;
+
+    // Chunks are whole rows so every chunk converts on its own
+    reader->path = path;
+    reader->rasterOffset = header->rasterOffset;
+    reader->rawRow = rawRowSize(header, buffer->channels);
+    reader->rowsPerChunk = (int)(ASYNC_CHUNK_BYTES / reader->rawRow);
+    if (reader->rowsPerChunk < 1)
+        reader->rowsPerChunk = 1;
+    reader->chunkBytes = reader->rawRow * reader->rowsPerChunk;
+    reader->chunkCount = (header->height + reader->rowsPerChunk - 1) / reader->rowsPerChunk;
+    reader->lastChunkBytes = rawSize - reader->chunkBytes * (reader->chunkCount - 1);
+
+    if (rasterInPlace(header))
+    {
+        reader->direct = buffer->image;
+        reader->done = (char *)calloc(reader->chunkCount, 1);
+    }
+    else
+        reader->ring = (unsigned char *)alignedAlloc(reader->chunkBytes * ASYNC_SLOTS);
+    if (!reader->done && !reader->ring)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    initMonitor(&reader->monitor);
+    reader->start = nowSeconds();
+    for (i = 0; i < ASYNC_READERS && i < reader->chunkCount; i++)
+    {
+        if (!startThread(&reader->threads[reader->threadCount], chunkReaderThread, reader))
+            break;
+        reader->threadCount++;
+    }
+    if (reader->threadCount == 0)
+    {
+        destroyMonitor(&reader->monitor);
+        alignedFree(reader->ring);
+        free(reader->done);
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// Waits for a chunk to arrive. Returns its memory, or NULL if reading failed
+static unsigned char *waitChunk(ChunkReader *reader, int chunk)
+{
+    double started = nowSeconds();
+    int arrived;
+
+    lockMonitor(&reader->monitor);
+    for (;;)
+    {
+        arrived = reader->ring ? reader->ready[chunk % ASYNC_SLOTS] == chunk + 1 :
+                                 reader->done[chunk];
+        if (arrived || reader->failed)
+            break;
+        waitMonitor(&reader->monitor);
+    }
+    unlockMonitor(&reader->monitor);
+
+    reader->waited += nowSeconds() - started;
+    return arrived ? chunkMemory(reader, chunk) : NULL;
+}
+
+// Gives a chunk's slot back to the readers
+static void releaseChunk(ChunkReader *reader, int chunk)
+{
+    lockMonitor(&reader->monitor);
+    reader->ready[chunk % ASYNC_SLOTS] = 0;
+    reader->released = chunk + 1;
+    wakeMonitor(&reader->monitor);
+    unlockMonitor(&reader->monitor);
+}
+
+// Converts and publishes the image chunk by chunk as the readers deliver it
+static int decodeChunks(ImageLoader *loader)
+{
+    ChunkReader *reader = loader->reader;
+    const unsigned char *raw;
+    int chunk, rows;
+
+    for (chunk = 0; chunk < reader->chunkCount && !atomicLoad(&loader->cancel); chunk++)
+    {
+        raw = waitChunk(reader, chunk);
+        if (!raw)
+            return 0;
+
+        rows = loader->pixmap->height - loader->rowsDone;
+        if (rows > reader->rowsPerChunk)
+            rows = reader->rowsPerChunk;
+        if (reader->ring)
+            convertRows(loader, raw, loader->rowsDone, loader->rowsDone + rows);
+        releaseChunk(reader, chunk);
+
+        loader->rowsDone += rows;
+        atomicStore(&loader->rowsReady, loader->rowsDone);
+    }
+    reader->finish = nowSeconds();
+    return 1;
+}
+
+// Stops the readers, reports how they did and frees them
+static void finishChunkReader(ChunkReader *reader, int rowsDone)
+{
+    double elapsed;
+    int i;
+
+    lockMonitor(&reader->monitor);
+    reader->stop = 1;
+    wakeMonitor(&reader->monitor);
+    unlockMonitor(&reader->monitor);
+    for (i = 0; i < reader->threadCount; i++)
+        joinThread(reader->threads[i]);
+
+    if (reader->finish > reader->start)
+    {
+        elapsed = reader->finish - reader->start;
+        printf("Async read: %.1f MB in %.3f s, %.1f MB/s, compute waited on I/O %.0f%% of the time\n",
+               (double)reader->rawRow * rowsDone / 1e6, elapsed,
+               (double)reader->rawRow * rowsDone / 1e6 / elapsed, 100 * reader->waited / elapsed);
+        printf("            %d readers, %d chunks of %.1f MB, %s\n", reader->threadCount,
+               reader->chunkCount, reader->chunkBytes / 1e6,
+               reader->ring ? "converted from a ring of buffers" : "read straight into the image");
+    }
+
+    destroyMonitor(&reader->monitor);
+    alignedFree(reader->ring);
+    free(reader->done);
+    free(reader);
+}
+
+///////////////////////////////////// COMPRESSED INPUT /////////////////////////////////////
+
+// gzip (and zstd when built with EZVIEW_ZSTD) images are decompressed
+// straight into the pixmap. Only the compressed file is mapped and only a
+// window of decompressed bytes exists at a time, so there is never a copy
+// of the uncompressed file. Files made of several members or frames have
+// them decompressed in parallel, each into its own part of the raster
+#define COMPRESSION_NONE 0
+#define COMPRESSION_GZIP 1
+#define COMPRESSION_ZSTD 2
+
+#define INFLATE_HISTORY 32768
+#define INFLATE_CHUNK (1 << 20)
+#define INFLATE_SLACK 320
+#define INFLATE_OK 1
+#define INFLATE_STOPPED 0
+#define INFLATE_ERROR (-1)
+
+// Enough of the decompressed stream to hold any header we accept
+#define PEEK_BYTES 65536
+
+// Gets handed each piece of decompressed output in order. Returns 0 to stop
+typedef int (*InflateSink)(void *context, const unsigned char *data, size_t size);
+
+// Decoding tables and the output window of one inflate stream, one per thread
+typedef struct Inflater
+{
+    unsigned short lengthTable[1 << 15], distanceTable[1 << 15];
+    unsigned short fixedLengths[1 << 9], fixedDistances[1 << 5];
+    int fixedLengthBits, fixedDistanceBits;
+    unsigned char *window;  // INFLATE_HISTORY + INFLATE_CHUNK + INFLATE_SLACK
+} Inflater;
+
+typedef struct BitReader
+{
+    const unsigned char *next, *end;
+    unsigned long long bits;
+    int count;
+    size_t padding;     // zero bytes made up past the end of the input
+} BitReader;
+
+// One gzip member or zstd frame, and where its output lands in the stream
+typedef struct Member
+{
+    size_t offset, size;
+    unsigned long long outputOffset, outputSize;
+} Member;
+
+static unsigned long crcTable[8][256];
+
+// Slicing by 8 CRC-32 tables for checking gzip members
+static void initCrc32(void)
+{
+    unsigned long c;
+    int i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = (unsigned long)i;
+        for (j = 0; j < 8; j++)
+            c = c & 1 ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        crcTable[0][i] = c;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 8; j++)
+            crcTable[j][i] = (crcTable[j - 1][i] >> 8) ^ crcTable[0][crcTable[j - 1][i] & 0xff];
+}
+
+static unsigned long crc32Update(unsigned long crc, const unsigned char *data, size_t size)
+{
+    unsigned long low, high;
+
+    crc = ~crc & 0xffffffffUL;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        low = crc ^ (data[0] | (unsigned long)data[1] << 8 | (unsigned long)data[2] << 16 |
+                     (unsigned long)data[3] << 24);
+        high = data[4] | (unsigned long)data[5] << 8 | (unsigned long)data[6] << 16 |
+               (unsigned long)data[7] << 24;
+        crc = crcTable[7][low & 0xff] ^ crcTable[6][(low >> 8) & 0xff] ^
+              crcTable[5][(low >> 16) & 0xff] ^ crcTable[4][low >> 24 & 0xff] ^
+              crcTable[3][high & 0xff] ^ crcTable[2][(high >> 8) & 0xff] ^
+              crcTable[1][(high >> 16) & 0xff] ^ crcTable[0][high >> 24 & 0xff];
+    }
+    while (size--)
+        crc = crcTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc & 0xffffffffUL;
+}
+
+static unsigned long readLittle32(const unsigned char *data)
+{
+    return data[0] | (unsigned long)data[1] << 8 | (unsigned long)data[2] << 16 |
+           (unsigned long)data[3] << 24;
+}
+
+// Tops the bit buffer up to at least 56 bits, with zeros past the end
+static void refillBits(BitReader *in)
+{
+    if (in->end - in->next >= 8)
+    {
+        unsigned long long word;
+        memcpy(&word, in->next, 8);
+        in->bits |= word << in->count;
+        in->next += (63 - in->count) >> 3;
+        in->count |= 56;
+        return;
+    }
+    while (in->count <= 56)
+    {
+        if (in->next < in->end)
+            in->bits |= (unsigned long long)*in->next++ << in->count;
+        else
+            in->padding++;
+        in->count += 8;
+    }
+}
+
+static unsigned int getBits(BitReader *in, int count)
+{
+    unsigned int value;
+
+    if (in->count < count)
+        refillBits(in);
+    value = (unsigned int)(in->bits & ((1ULL << count) - 1));
+    in->bits >>= count;
+    in->count -= count;
+    return value;
+}
+
+// Builds a lookup table indexed by the next tableBits input bits, each
+// entry holding symbol << 4 | code length. Unused entries stay 0. Returns 0
+// if the code lengths do not describe a valid prefix code
+static int buildHuffman(unsigned short *table, int *tableBits, const unsigned char *lengths, int count)
+{
+    int lengthCount[16], next[16], code = 0, left = 1, maxLength = 0, symbol, length, i;
+    unsigned int reversed;
+
+    memset(lengthCount, 0, sizeof(lengthCount));
+    for (symbol = 0; symbol < count; symbol++)
+        lengthCount[lengths[symbol]]++;
+    lengthCount[0] = 0;
+    for (length = 1; length < 16; length++)
+    {
+        left = (left << 1) - lengthCount[length];
+        if (left < 0)
+            return 0;
+        if (lengthCount[length])
+            maxLength = length;
+        code = (code + lengthCount[length - 1]) << 1;
+        next[length] = code;
+    }
+    if (maxLength == 0)
+        maxLength = 1;
+
+    *tableBits = maxLength;
+    memset(table, 0, sizeof(unsigned short) << maxLength);
+    for (symbol = 0; symbol < count; symbol++)
+    {
+        length = lengths[symbol];
+        if (!length)
+            continue;
+        code = next[length]++;
+        for (reversed = 0, i = 0; i < length; i++)
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        for (i = (int)reversed; i < 1 << maxLength; i += 1 << length)
+            table[i] = (unsigned short)(symbol << 4 | length);
+    }
+    return 1;
+}
+
+static int decodeSymbol(BitReader *in, const unsigned short *table, int tableBits)
+{
+    unsigned int entry;
+
+    if (in->count < 15)
+        refillBits(in);
+    entry = table[in->bits & ((1u << tableBits) - 1)];
+    if (!(entry & 15))
+        return -1;
+    in->bits >>= entry & 15;
+    in->count -= entry & 15;
+    return (int)(entry >> 4);
+}
+
+static Inflater *createInflater(void)
+{
+    Inflater *inflater = (Inflater *)malloc(sizeof(Inflater));
+    unsigned char lengths[320];
+    int i;
+
+    if (!inflater)
+        return NULL;
+    inflater->window = (unsigned char *)malloc(INFLATE_HISTORY + INFLATE_CHUNK + INFLATE_SLACK);
+    if (!inflater->window)
+    {
+        free(inflater);
+        return NULL;
+    }
+
+    for (i = 0; i < 288; i++)
+        lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    buildHuffman(inflater->fixedLengths, &inflater->fixedLengthBits, lengths, 288);
+    for (i = 0; i < 30; i++)
+        lengths[i] = 5;
+    buildHuffman(inflater->fixedDistances, &inflater->fixedDistanceBits, lengths, 30);
+    return inflater;
+}
+
+static void freeInflater(Inflater *inflater)
+{
+    if (!inflater)
+        return;
+    free(inflater->window);
+    free(inflater);
+}
+
+// Reads the code length code and then the two codes of a dynamic block
+static int readDynamicTables(Inflater *inflater, BitReader *in, int *lengthBits, int *distanceBits)
+{
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char lengths[320], codeLengths[19];
+    unsigned short codeTable[1 << 7];
+    int lengthCount = getBits(in, 5) + 257, distanceCount = getBits(in, 5) + 1;
+    int codeCount = getBits(in, 4) + 4, codeBits, symbol, repeat, previous, i = 0;
+
+    if (lengthCount > 286 || distanceCount > 30)
+        return 0;
+    memset(codeLengths, 0, sizeof(codeLengths));
+    for (i = 0; i < codeCount; i++)
+        codeLengths[order[i]] = (unsigned char)getBits(in, 3);
+    if (!buildHuffman(codeTable, &codeBits, codeLengths, 19))
+        return 0;
+
+    for (i = 0; i < lengthCount + distanceCount;)
+    {
+        symbol = decodeSymbol(in, codeTable, codeBits);
+        if (symbol < 0)
+            return 0;
+        if (symbol < 16)
+        {
+            lengths[i++] = (unsigned char)symbol;
+            continue;
+        }
+        previous = 0;
+        if (symbol == 16)
+        {
+            if (i == 0)
+                return 0;
+            previous = lengths[i - 1];
+            repeat = 3 + getBits(in, 2);
+        }
+        else if (symbol == 17)
+            repeat = 3 + getBits(in, 3);
+        else
+            repeat = 11 + getBits(in, 7);
+        if (i + repeat > lengthCount + distanceCount)
+            return 0;
+        while (repeat--)
+            lengths[i++] = (unsigned char)previous;
+    }
+
+    if (lengths[256] == 0)
+        return 0;
+    return buildHuffman(inflater->lengthTable, lengthBits, lengths, lengthCount) &&
+           buildHuffman(inflater->distanceTable, distanceBits, lengths + lengthCount, distanceCount);
+}
+
+// Inflates one raw deflate stream, handing the output to sink a window at
+// a time. *consumed is how many input bytes the stream took up, *crc and
+// *total describe the output
+static int inflateStream(Inflater *inflater, const unsigned char *data, size_t size, size_t *consumed,
+                         unsigned long *crc, unsigned long long *total, InflateSink sink, void *context)
+{
+    static const unsigned short lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const unsigned char lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                                   3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const unsigned short distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                                     193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                                     4097, 6145, 8193, 12289, 16385, 24577 };
+    static const unsigned char distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                                     7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    BitReader in;
+    unsigned char *out = inflater->window, *to;
+    const unsigned char *from;
+    const unsigned short *lengthTable, *distanceTable;
+    size_t pos = 0, flushed = 0, used;
+    int last, type, lengthBits, distanceBits, symbol, length, distance;
+
+    in.next = data;
+    in.end = data + size;
+    in.bits = 0;
+    in.count = 0;
+    in.padding = 0;
+    *crc = 0;
+    *total = 0;
+
+    do
+    {
+        last = getBits(&in, 1);
+        type = getBits(&in, 2);
+
+        if (type == 0)
+        {
+            // Stored block, byte aligned and copied as is
+            unsigned int stored, check;
+            getBits(&in, in.count & 7);
+            stored = getBits(&in, 16);
+            check = getBits(&in, 16);
+            if ((stored ^ 0xffff) != check)
+                return INFLATE_ERROR;
+            while (stored--)
+            {
+                if (pos >= INFLATE_HISTORY + INFLATE_CHUNK)
+                {
+                    *crc = crc32Update(*crc, out + flushed, pos - flushed);
+                    *total += pos - flushed;
+                    if (!sink(context, out + flushed, pos - flushed))
+                        return INFLATE_STOPPED;
+                    memmove(out, out + pos - INFLATE_HISTORY, INFLATE_HISTORY);
+                    pos = flushed = INFLATE_HISTORY;
+                }
+                out[pos++] = (unsigned char)getBits(&in, 8);
+            }
+            continue;
+        }
+
+        if (type == 1)
+        {
+            lengthTable = inflater->fixedLengths;
+            lengthBits = inflater->fixedLengthBits;
+            distanceTable = inflater->fixedDistances;
+            distanceBits = inflater->fixedDistanceBits;
+        }
+        else if (type == 2 && readDynamicTables(inflater, &in, &lengthBits, &distanceBits))
+        {
+            lengthTable = inflater->lengthTable;
+            distanceTable = inflater->distanceTable;
+        }
+        else
+            return INFLATE_ERROR;
+
+        for (;;)
+        {
+            // Keep the last 32K as history and hand the rest to the sink
+            if (pos >= INFLATE_HISTORY + INFLATE_CHUNK)
+            {
+                *crc = crc32Update(*crc, out + flushed, pos - flushed);
+                *total += pos - flushed;
+                if (!sink(context, out + flushed, pos - flushed))
+                    return INFLATE_STOPPED;
+                memmove(out, out + pos - INFLATE_HISTORY, INFLATE_HISTORY);
+                pos = flushed = INFLATE_HISTORY;
+            }
+            if (in.padding > 16)
+                return INFLATE_ERROR;
+
+            symbol = decodeSymbol(&in, lengthTable, lengthBits);
+            if (symbol < 256)
+            {
+                if (symbol < 0)
+                    return INFLATE_ERROR;
+                out[pos++] = (unsigned char)symbol;
+                continue;
+            }
+            if (symbol == 256)
+                break;
+
+            symbol -= 257;
+            if (symbol >= 29)
+                return INFLATE_ERROR;
+            length = lengthBase[symbol] + getBits(&in, lengthExtra[symbol]);
+            symbol = decodeSymbol(&in, distanceTable, distanceBits);
+            if (symbol < 0 || symbol >= 30)
+                return INFLATE_ERROR;
+            distance = distanceBase[symbol] + getBits(&in, distanceExtra[symbol]);
+            if ((size_t)distance > pos)
+                return INFLATE_ERROR;
+
+            // Far enough back copies go 8 bytes at a time, the slack past
+            // the window end absorbs the overshoot
+            from = out + pos - distance;
+            to = out + pos;
+            pos += length;
+            if (distance >= 8)
+            {
+                do
+                {
+                    memcpy(to, from, 8);
+                    to += 8;
+                    from += 8;
+                } while (to < out + pos);
+            }
+            else if (distance == 1)
+                memset(to, *from, length);
+            else
+                while (length--)
+                    *to++ = *from++;
+        }
+    } while (!last);
+
+    // Whole bytes still sitting in the bit buffer were never used
+    used = (size_t)(in.next - data) + in.padding - (size_t)(in.count >> 3);
+    if (used > size)
+        return INFLATE_ERROR;
+    *consumed = used;
+
+    *crc = crc32Update(*crc, out + flushed, pos - flushed);
+    *total += pos - flushed;
+    if (pos > flushed && !sink(context, out + flushed, pos - flushed))
+        return INFLATE_STOPPED;
+    return INFLATE_OK;
+}
+
+// Size of the gzip member header at data, 0 if there is not one
+static size_t gzipHeaderSize(const unsigned char *data, size_t size)
+{
+    size_t i = 10;
+    int flags;
+
+    if (size < 18 || data[0] != 0x1f || data[1] != 0x8b || data[2] != 8 || (data[3] & 0xe0))
+        return 0;
+    flags = data[3];
+    if (flags & 4)
+        i = 12 + (data[10] | (size_t)data[11] << 8);
+    if (flags & 8)
+    {
+        while (i < size && data[i])
+            i++;
+        i++;
+    }
+    if (flags & 16)
+    {
+        while (i < size && data[i])
+            i++;
+        i++;
+    }
+    if (flags & 2)
+        i += 2;
+    return i + 8 <= size ? i : 0;
+}
+
+// Decompresses the gzip member at data and checks it against its trailer
+static int gunzipMember(Inflater *inflater, const unsigned char *data, size_t size, size_t *consumed,
+                        unsigned long long *total, InflateSink sink, void *context)
+{
+    size_t header = gzipHeaderSize(data, size), used;
+    unsigned long crc;
+    int result;
+
+    if (!header)
+        return INFLATE_ERROR;
+    result = inflateStream(inflater, data + header, size - header - 8, &used, &crc, total, sink, context);
+    if (result != INFLATE_OK)
+        return result;
+    if (readLittle32(data + header + used) != crc ||
+        readLittle32(data + header + used + 4) != (unsigned long)(*total & 0xffffffffUL))
+        return INFLATE_ERROR;
+    *consumed = header + used + 8;
+    return INFLATE_OK;
+}
+
+// Works out what the file is compressed with from its first bytes
+static int compressionOf(const MappedFile *file)
+{
+    if (file->size >= 18 && file->data[0] == 0x1f && file->data[1] == 0x8b)
+        return COMPRESSION_GZIP;
+    if (file->size >= 4 && readLittle32(file->data) == 0xfd2fb528UL)
+        return COMPRESSION_ZSTD;
+    return COMPRESSION_NONE;
+}
+
+// Splits a gzip file into members. Members carry no length, so the guess
+// is every spot that looks like a member header, with the output size of
+// each taken from the ISIZE ending the member before it. Every member is
+// checked when it is decoded, so a wrong guess only costs time
+static int findGzipMembers(const unsigned char *data, size_t size, Member **members)
+{
+    int count = 0, capacity = 0, i;
+    const unsigned char *hit;
+    size_t start = 0;
+
+    *members = NULL;
+    for (;;)
+    {
+        if (count == capacity)
+        {
+            Member *grown;
+            capacity = capacity ? capacity * 2 : 64;
+            grown = (Member *)realloc(*members, sizeof(Member) * capacity);
+            if (!grown)
+            {
+                free(*members);
+                *members = NULL;
+                return 0;
+            }
+            *members = grown;
+        }
+        (*members)[count++].offset = start;
+
+        // Next candidate at least one minimal member further on
+        for (start += 20; start < size; start = (size_t)(hit - data) + 1)
+        {
+            hit = (const unsigned char *)memchr(data + start, 0x1f, size - start);
+            if (!hit)
+            {
+                start = size;
+                break;
+            }
+            if (gzipHeaderSize(hit, size - (size_t)(hit - data)) &&
+                (hit[8] == 0 || hit[8] == 2 || hit[8] == 4) && (hit[9] <= 13 || hit[9] == 255))
+            {
+                start = (size_t)(hit - data);
+                break;
+            }
+        }
+        if (start >= size)
+            break;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        size_t end = i + 1 < count ? (*members)[i + 1].offset : size;
+        (*members)[i].size = end - (*members)[i].offset;
+        (*members)[i].outputSize = readLittle32(data + end - 4);
+        (*members)[i].outputOffset = i ? (*members)[i - 1].outputOffset + (*members)[i - 1].outputSize : 0;
+    }
+    return count;
+}
+
+#ifdef EZVIEW_ZSTD
+// zstd frames know their own compressed size and usually their content
+// size too, so the split is exact. Returns 0 when any frame does not
+// record its content size, which leaves it to the serial decoder
+static int findZstdFrames(const unsigned char *data, size_t size, Member **members)
+{
+    int count = 0, capacity = 0;
+    size_t offset = 0, frame;
+    unsigned long long content;
+
+    *members = NULL;
+    while (offset < size)
+    {
+        frame = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+        content = ZSTD_getFrameContentSize(data + offset, size - offset);
+        if (ZSTD_isError(frame) || content == ZSTD_CONTENTSIZE_UNKNOWN ||
+            content == ZSTD_CONTENTSIZE_ERROR)
+        {
+            free(*members);
+            *members = NULL;
+            return 0;
+        }
+        if (count == capacity)
+        {
+            Member *grown;
+            capacity = capacity ? capacity * 2 : 64;
+            grown = (Member *)realloc(*members, sizeof(Member) * capacity);
+            if (!grown)
+            {
+                free(*members);
+                *members = NULL;
+                return 0;
+            }
+            *members = grown;
+        }
+        (*members)[count].offset = offset;
+        (*members)[count].size = frame;
+        (*members)[count].outputSize = content;
+        (*members)[count].outputOffset = count ? (*members)[count - 1].outputOffset +
+                                                 (*members)[count - 1].outputSize : 0;
+        count++;
+        offset += frame;
+    }
+    return count;
+}
+
+// Decompresses zstd frames through a window. Several frames in a row are
+// fine, the stream just carries on into the next one
+static int unzstdFrames(ZSTD_DCtx *stream, unsigned char *window, size_t windowSize,
+                        const unsigned char *data, size_t size, unsigned long long *total,
+                        InflateSink sink, void *context)
+{
+    ZSTD_inBuffer input;
+    ZSTD_outBuffer output;
+    size_t result = 0;
+
+    ZSTD_DCtx_reset(stream, ZSTD_reset_session_only);
+    input.src = data;
+    input.size = size;
+    input.pos = 0;
+    *total = 0;
+    do
+    {
+        output.dst = window;
+        output.size = windowSize;
+        output.pos = 0;
+        result = ZSTD_decompressStream(stream, &output, &input);
+        if (ZSTD_isError(result))
+            return INFLATE_ERROR;
+        *total += output.pos;
+        if (output.pos && !sink(context, window, output.pos))
+            return INFLATE_STOPPED;
+    } while (input.pos < input.size || output.pos == output.size);
+    return result == 0 ? INFLATE_OK : INFLATE_ERROR;
+}
+#endif
+
+// Takes the raster bytes of a decompressed stream, or one member's part of
+// it, and puts them in the pixmap. Rasters used as they are get copied
+// straight in, the rest are gathered into whole rows and converted. Rows
+// split between two members are gathered in seam buffers, converted once
+// both sides are in. Text rasters are tokenized from a window, cut after
+// the last newline so no number or comment is ever split
+typedef struct RasterSink
+{
+    ImageLoader *loader;
+    unsigned long long position;    // stream offset of the next byte to arrive
+    unsigned long long rasterOffset, rasterSize;
+    size_t rawRow;
+    int inPlace, text, publish;
+
+    unsigned char *rows;        // SINK_ROW_BYTES of whole raw rows waiting to be converted
+    int windowRows, firstRow, rowCount;
+    long long leadRow, trailRow;            // rows shared with the members either side
+    unsigned char *leadSeam, *trailSeam;
+
+    size_t textFilled;          // text waiting in rows for the tokenizer
+    size_t samplesDone, samplesTotal;
+    int failed;
+} RasterSink;
+
+#define SINK_ROW_BYTES (1 << 20)
+
+static void flushSinkRows(RasterSink *sink)
+{
+    if (!sink->rowCount)
+        return;
+    convertRows(sink->loader, sink->rows, sink->firstRow, sink->firstRow + sink->rowCount);
+    if (sink->publish)
+        atomicStore(&sink->loader->rowsReady, sink->firstRow + sink->rowCount);
+    sink->rowCount = 0;
+}
+
+// Runs the tokenizer over the text gathered so far. Unless this is the
+// end of the stream it stops after the last newline. A window with no
+// newline and no comment can also be cut after any space, or anywhere at
+// all for P1. Returns 0 on malformed text: at the end, samples missing,
+// before it, a tokenizer that can not get past the start of the window
+static int flushSinkText(RasterSink *sink, int final)
+{
+    ImageLoader *loader = sink->loader;
+    size_t cut = sink->textFilled, pos = 0, want, got, rowSize;
+
+    if (!final)
+    {
+        while (cut && sink->rows[cut - 1] != '\n')
+            cut--;
+        if (!cut && !memchr(sink->rows, '#', sink->textFilled))
+        {
+            cut = sink->textFilled;
+            while (loader->header.magicNumber != 1 && cut && !isAsciiSpace(sink->rows[cut - 1]))
+                cut--;
+        }
+        if (!cut)
+            return 0;
+    }
+
+    want = sink->samplesTotal - sink->samplesDone;
+    if (loader->header.magicNumber == 1)
+        got = decodeAsciiBits(sink->rows, cut, &pos, loader->pixmap->image + sink->samplesDone, want);
+    else
+        got = decodeAsciiSamples(sink->rows, cut, &pos, loader->pixmap->image + sink->samplesDone,
+                                 want, loader->lut, loader->header.maxColor);
+    sink->samplesDone += got;
+
+    // Anything that stops it at the very start never goes away by itself,
+    // the window would just stay full
+    if (!final && pos == 0 && sink->samplesDone < sink->samplesTotal)
+        return 0;
+
+    memmove(sink->rows, sink->rows + pos, sink->textFilled - pos);
+    sink->textFilled -= pos;
+
+    rowSize = (size_t)loader->pixmap->width * loader->pixmap->channels;
+    if (sink->publish)
+        atomicStore(&loader->rowsReady, (long)(sink->samplesDone / rowSize));
+    return !final || sink->samplesDone == sink->samplesTotal;
+}
+
+static int sinkBytes(void *context, const unsigned char *data, size_t size)
+{
+    RasterSink *sink = (RasterSink *)context;
+    unsigned long long at = sink->position, r;
+    size_t take, column;
+    long long row;
+
+    sink->position += size;
+    if (atomicLoad(&sink->loader->cancel))
+        return 0;
+
+    // Only the raster matters, the header was read from a peek
+    if (at + size <= sink->rasterOffset)
+        return 1;
+    if (at < sink->rasterOffset)
+    {
+        data += sink->rasterOffset - at;
+        size -= (size_t)(sink->rasterOffset - at);
+        at = sink->rasterOffset;
+    }
+    r = at - sink->rasterOffset;
+
+    if (sink->text)
+    {
+        // Whatever follows the last sample is not needed
+        while (size && sink->samplesDone < sink->samplesTotal)
+        {
+            take = SINK_ROW_BYTES - sink->textFilled;
+            if (take > size)
+                take = size;
+            memcpy(sink->rows + sink->textFilled, data, take);
+            sink->textFilled += take;
+            data += take;
+            size -= take;
+            if (sink->textFilled == SINK_ROW_BYTES && !flushSinkText(sink, 0))
+            {
+                sink->failed = 1;
+                return 0;
+            }
+        }
+        return sink->samplesDone < sink->samplesTotal;
+    }
+
+    if (r >= sink->rasterSize)
+        return 1;
+    if (r + size > sink->rasterSize)
+        size = (size_t)(sink->rasterSize - r);
+
+    if (sink->inPlace)
+    {
+        memcpy(sink->loader->pixmap->image + r, data, size);
+        if (sink->publish)
+            atomicStore(&sink->loader->rowsReady, (long)((r + size) / sink->rawRow));
+        return 1;
+    }
+
+    while (size)
+    {
+        row = (long long)(r / sink->rawRow);
+        column = (size_t)(r % sink->rawRow);
+        take = sink->rawRow - column;
+        if (take > size)
+            take = size;
+
+        if (row == sink->leadRow)
+            memcpy(sink->leadSeam + column, data, take);
+        else if (row == sink->trailRow)
+            memcpy(sink->trailSeam + column, data, take);
+        else
+        {
+            if (sink->rowCount == 0)
+                sink->firstRow = (int)row;
+            memcpy(sink->rows + (size_t)(row - sink->firstRow) * sink->rawRow + column, data, take);
+            if (column + take == sink->rawRow && ++sink->rowCount == sink->windowRows)
+                flushSinkRows(sink);
+        }
+        data += take;
+        size -= take;
+        r += take;
+    }
+    return 1;
+}
+
+static int initRasterSink(RasterSink *sink, ImageLoader *loader)
+{
+    Pixmap *buffer = loader->pixmap;
+
+    memset(sink, 0, sizeof(RasterSink));
+    sink->loader = loader;
+    sink->rasterOffset = loader->header.rasterOffset;
+    sink->text = loader->header.magicNumber <= 3;
+    sink->inPlace = rasterInPlace(&loader->header);
+    sink->rawRow = rawRowSize(&loader->header, buffer->channels);
+    sink->rasterSize = rawRasterSize(&loader->header, buffer->channels);
+    sink->samplesTotal = (size_t)buffer->width * buffer->height * buffer->channels;
+    sink->leadRow = sink->trailRow = -1;
+    if (sink->inPlace)
+        return 1;
+
+    sink->windowRows = sink->text ? 0 : (int)(SINK_ROW_BYTES / sink->rawRow);
+    if (!sink->text && sink->windowRows < 1)
+        sink->windowRows = 1;
+    sink->rows = (unsigned char *)malloc(sink->text ? SINK_ROW_BYTES : sink->windowRows * sink->rawRow);
+    return sink->rows != NULL;
+}
+
+// Shared by the member workers
+typedef struct MemberJob
+{
+    ImageLoader *loader;
+    const unsigned char *data;
+    const Member *members;
+    int count;
+    unsigned char **seams;  // per member, the seam of the row it starts in
+    volatile long next;
+    volatile long failed;
+} MemberJob;
+
+static void memberWorker(void *context, int index)
+{
+    MemberJob *job = (MemberJob *)context;
+    RasterSink sink;
+    Inflater *inflater = NULL;
+    unsigned long long total = 0, first, end;
+    size_t consumed;
+    int member, result = INFLATE_ERROR;
+#ifdef EZVIEW_ZSTD
+    ZSTD_DCtx *stream = NULL;
+    unsigned char *window = NULL;
+#endif
+
+    (void)index;
+    if (!initRasterSink(&sink, job->loader))
+    {
+        atomicStore(&job->failed, 1);
+        return;
+    }
+    if (job->loader->compression == COMPRESSION_GZIP)
+        inflater = createInflater();
+#ifdef EZVIEW_ZSTD
+    else
+    {
+        stream = ZSTD_createDCtx();
+        window = (unsigned char *)malloc(ZSTD_DStreamOutSize());
+    }
+#endif
+
+    while (!atomicLoad(&job->failed) &&
+           (member = (int)atomicIncrement(&job->next) - 1) < job->count)
+    {
+        const Member *m = &job->members[member];
+
+        // Rows this member only has part of go to the seams at either end
+        sink.position = m->outputOffset;
+        sink.rowCount = 0;
+        first = m->outputOffset > sink.rasterOffset ? m->outputOffset - sink.rasterOffset : 0;
+        end = m->outputOffset + m->outputSize;
+        end = end > sink.rasterOffset ? end - sink.rasterOffset : 0;
+        sink.leadRow = job->seams[member] ? (long long)(first / sink.rawRow) : -1;
+        sink.leadSeam = job->seams[member];
+        sink.trailRow = member + 1 < job->count && job->seams[member + 1] ?
+                        (long long)(end / sink.rawRow) : -1;
+        sink.trailSeam = member + 1 < job->count ? job->seams[member + 1] : NULL;
+
+        result = INFLATE_ERROR;
+        if (inflater)
+        {
+            result = gunzipMember(inflater, job->data + m->offset, m->size, &consumed, &total,
+                                  sinkBytes, &sink);
+            if (result == INFLATE_OK && consumed != m->size)
+                result = INFLATE_ERROR;
+        }
+#ifdef EZVIEW_ZSTD
+        else if (stream && window)
+            result = unzstdFrames(stream, window, ZSTD_DStreamOutSize(), job->data + m->offset,
+                                  m->size, &total, sinkBytes, &sink);
+#endif
+        if (result != INFLATE_OK || total != m->outputSize)
+        {
+            atomicStore(&job->failed, 1);
+            break;
+        }
+        flushSinkRows(&sink);
+    }
+
+    freeInflater(inflater);
+#ifdef EZVIEW_ZSTD
+    ZSTD_freeDCtx(stream);
+    free(window);
+#endif
+    free(sink.rows);
+}
+
+// Decodes every member on its own thread. Returns 0 if the members did not
+// check out, in which case the serial decoder has to start over
+static int decodeMembers(ImageLoader *loader, const Member *members, int count)
+{
+    Pixmap *buffer = loader->pixmap;
+    size_t rawRow = rawRowSize(&loader->header, buffer->channels);
+    unsigned long long rasterOffset = loader->header.rasterOffset;
+    unsigned long long rasterSize = rawRasterSize(&loader->header, buffer->channels), r;
+    MemberJob job;
+    int i, workers, ok;
+
+    job.loader = loader;
+    job.data = buffer->source.data;
+    job.members = members;
+    job.count = count;
+    job.next = 0;
+    job.failed = 0;
+    job.seams = (unsigned char **)calloc(count, sizeof(unsigned char *));
+    if (!job.seams)
+        return 0;
+
+    // A seam for every row a member starts part way into. Members that
+    // start in the same row share it
+    for (i = 1; i < count && !rasterInPlace(&loader->header); i++)
+    {
+        if (members[i].outputOffset <= rasterOffset)
+            continue;
+        r = members[i].outputOffset - rasterOffset;
+        if (r >= rasterSize || r % rawRow == 0)
+            continue;
+        if (job.seams[i - 1] && members[i - 1].outputOffset > rasterOffset &&
+            (members[i - 1].outputOffset - rasterOffset) / rawRow == r / rawRow)
+            job.seams[i] = job.seams[i - 1];
+        else if (!(job.seams[i] = (unsigned char *)malloc(rawRow)))
+            job.failed = 1;
+    }
+
+    workers = cpuCount();
+    if (workers > count)
+        workers = count;
+    if (!job.failed)
+        runWorkers(workers, memberWorker, &job);
+    ok = !job.failed && members[count - 1].outputOffset + members[count - 1].outputSize >=
+                        rasterOffset + rasterSize;
+
+    for (i = 1; i < count; i++)
+    {
+        if (!job.seams[i] || job.seams[i] == job.seams[i - 1])
+            continue;
+        r = (members[i].outputOffset - rasterOffset) / rawRow;
+        if (ok)
+            convertRows(loader, job.seams[i], (int)r, (int)r + 1);
+        free(job.seams[i]);
+    }
+    free(job.seams);
+    return ok;
+}
+
+// Decodes a compressed image. Files of several members are tried in
+// parallel first, everything else and anything that did not check out goes
+// through one stream in order
+static int decodeCompressed(ImageLoader *loader)
+{
+    Pixmap *buffer = loader->pixmap;
+    Member *members = NULL;
+    RasterSink sink;
+    int count = 0, result = INFLATE_ERROR;
+    unsigned long long total;
+    size_t offset = 0, consumed;
+
+    if (loader->header.magicNumber > 3)
+    {
+        if (loader->compression == COMPRESSION_GZIP)
+            count = findGzipMembers(buffer->source.data, buffer->source.size, &members);
+#ifdef EZVIEW_ZSTD
+        else
+            count = findZstdFrames(buffer->source.data, buffer->source.size, &members);
+#endif
+        if (count > 1 && decodeMembers(loader, members, count))
+        {
+            free(members);
+            loader->rowsDone = buffer->height;
+            printf("Decompressed %d %s in parallel\n", count,
+                   loader->compression == COMPRESSION_GZIP ? "gzip members" : "zstd frames");
+            return 1;
+        }
+        free(members);
+    }
+
+    if (!initRasterSink(&sink, loader))
+        return 0;
+    sink.publish = 1;
+    if (loader->compression == COMPRESSION_GZIP)
+    {
+        Inflater *inflater = createInflater();
+
+        // Members one after another until something that is not one
+        while (inflater && gzipHeaderSize(buffer->source.data + offset, buffer->source.size - offset))
+        {
+            result = gunzipMember(inflater, buffer->source.data + offset, buffer->source.size - offset,
+                                  &consumed, &total, sinkBytes, &sink);
+            if (result != INFLATE_OK)
+                break;
+            offset += consumed;
+        }
+        freeInflater(inflater);
+    }
+#ifdef EZVIEW_ZSTD
+    else
+    {
+        ZSTD_DCtx *stream = ZSTD_createDCtx();
+        unsigned char *window = (unsigned char *)malloc(ZSTD_DStreamOutSize());
+        if (stream && window)
+            result = unzstdFrames(stream, window, ZSTD_DStreamOutSize(), buffer->source.data,
+                                  buffer->source.size, &total, sinkBytes, &sink);
+        ZSTD_freeDCtx(stream);
+        free(window);
+    }
+#endif
+
+    // A sink that stopped early has everything it wanted
+    if (result != INFLATE_ERROR && !sink.failed)
+    {
+        if (sink.text)
+            result = flushSinkText(&sink, 1);
+        else
+        {
+            flushSinkRows(&sink);
+            result = sink.position >= sink.rasterOffset + sink.rasterSize;
+        }
+    }
+    else
+        result = 0;
+    free(sink.rows);
+    if (result)
+        loader->rowsDone = buffer->height;
+    return result;
+}
+
+// Collects the start of the decompressed stream, for parsing its header
+static int peekSink(void *context, const unsigned char *data, size_t size)
+{
+    MappedFile *peek = (MappedFile *)context;
+    size_t take = PEEK_BYTES - peek->size;
+
+    if (take > size)
+        take = size;
+    memcpy(peek->data + peek->size, data, take);
+    peek->size += take;
+    return peek->size < PEEK_BYTES;
+}
+
+// Decompresses just enough of the file to read the header. Returns how
+// many bytes ended up in peek, which holds PEEK_BYTES
+static size_t peekCompressed(const MappedFile *file, int compression, unsigned char *peek)
+{
+    MappedFile collected;
+    unsigned long long total;
+    size_t consumed, offset = 0;
+
+    collected.data = peek;
+    collected.size = 0;
+    collected.mapped = 0;
+    if (compression == COMPRESSION_GZIP)
+    {
+        Inflater *inflater = createInflater();
+        while (inflater && collected.size < PEEK_BYTES &&
+               gzipHeaderSize(file->data + offset, file->size - offset) &&
+               gunzipMember(inflater, file->data + offset, file->size - offset, &consumed, &total,
+                            peekSink, &collected) == INFLATE_OK)
+            offset += consumed;
+        freeInflater(inflater);
+    }
+#ifdef EZVIEW_ZSTD
+    else
+    {
+        ZSTD_DCtx *stream = ZSTD_createDCtx();
+        unsigned char *window = (unsigned char *)malloc(ZSTD_DStreamOutSize());
+        if (stream && window)
+            unzstdFrames(stream, window, ZSTD_DStreamOutSize(), file->data, file->size, &total,
+                         peekSink, &collected);
+        ZSTD_freeDCtx(stream);
+        free(window);
+    }
+#endif
+    return collected.size;
+}
+
+// Body of the decode thread. Either decodes everything and publishes it at
+// the end, or publishes band by band so the main thread can stream it
+static void decodeThread(void *context)
+{
+    ImageLoader *loader = (ImageLoader *)context;
+    int ok = 1;
+
+    loader->decodeStart = nowSeconds();
+    if (loader->reader)
+        ok = decodeChunks(loader);
+    else if (loader->compression)
+        ok = decodeCompressed(loader);
+    else if (loader->bandRows == 0)
+        ok = decodeImage(loader);
+    else
+    {
+        while (ok && loader->rowsDone < loader->pixmap->height && !atomicLoad(&loader->cancel))
+        {
+            ok = decodeImageRows(loader, loader->bandRows);
+            atomicStore(&loader->rowsReady, loader->rowsDone);
+        }
+    }
+    loader->decodeEnd = nowSeconds();
+
+    if (!ok)
+        atomicStore(&loader->failed, 1);
+    atomicStore(&loader->rowsReady, loader->rowsDone);
+}
+
+// Finds where the raster that starts at header->rasterOffset ends. Binary
+// rasters have a known size. Text rasters run to the end of the file unless
+// another header could follow, in which case the samples have to be walked.
+// Returns 0 if the raster is short or malformed
+static size_t findRasterEnd(const unsigned char *data, size_t size, const PpmHeader *header)
+{
+    size_t raw = rawRasterSize(header, header->depth), pos = header->rasterOffset, left, want;
+    unsigned char scratch[4096];
+    unsigned char *lut;
+
+    if (raw)
+        return size - header->rasterOffset >= raw ? header->rasterOffset + raw : 0;
+
+    if (!memchr(data + pos, 'P', size - pos))
+        return size;
+
+    lut = buildSampleLut(header->maxColor);
+    if (!lut)
+        return 0;
+    left = (size_t)header->width * header->height * header->depth;
+    while (left)
+    {
+        want = left < sizeof(scratch) ? left : sizeof(scratch);
+        if ((header->magicNumber == 1 ?
+             decodeAsciiBits(data, size, &pos, scratch, want) :
+             decodeAsciiSamples(data, size, &pos, scratch, want, lut, header->maxColor)) != want)
+        {
+            pos = 0;
+            break;
+        }
+        left -= want;
+    }
+    free(lut);
+    return pos;
+}
+
+// Scans the file once for every image in it, starting from the one already
+// parsed. Images that do not match the first one in size and channels can
+// not share its texture, so the index stops there. Returns the frame count
+static int indexFrames(const MappedFile *file, const PpmHeader *first, Frame **frames)
+{
+    PpmHeader header = *first;
+    int count = 0, capacity = 0;
+    size_t end, next;
+
+    *frames = NULL;
+    for (;;)
+    {
+        end = findRasterEnd(file->data, file->size, &header);
+        if (!end)
+            break;
+
+        if (count == capacity)
+        {
+            Frame *grown;
+            capacity = capacity ? capacity * 2 : 8;
+            grown = (Frame *)realloc(*frames, sizeof(Frame) * capacity);
+            if (!grown)
+                break;
+            *frames = grown;
+        }
+        (*frames)[count].header = header;
+        (*frames)[count].rasterEnd = end;
+        count++;
+
+        next = skipHeaderSpace(file->data, file->size, end);
+        if (next >= file->size || !parsePpmHeader(file->data + next, file->size - next, &header))
+            break;
+        header.rasterOffset += next;
+
+        if (header.width != first->width || header.height != first->height ||
+            header.depth != first->depth || header.maxColor <= 0 || header.maxColor > 65535)
+        {
+            printf("Image %d of the file does not match the first one, playing %d\n",
+                   count + 1, count);
+            break;
+        }
+    }
+    return count;
+}
+
+// Frees the pixmap along with the file that may be backing its raster
+static void freePixmap(Pixmap *buffer)
+{
+    unsigned char *start = buffer->source.data;
+
+    if (buffer->image && !(start && buffer->image >= start &&
+                           buffer->image < start + buffer->source.size))
+        free(buffer->image);
+
+    closeMappedFile(&buffer->source);
     free(buffer);
+}
+
+///////////////////////////////////// DECODE CACHE /////////////////////////////////////
+
+// Text rasters are slow to parse, so once decoded they are written to a
+// cache entry holding the 8 bit raster at a page aligned offset. The next
+// time the same file is opened the entry is mapped and used zero copy
+#define CACHE_RASTER_OFFSET 4096
+#define CACHE_SAMPLE_BYTES (64 * 1024)
+#define CACHE_VERSION 1
+
+// Cache size limit in bytes, least recently used entries go first (-cachesize)
+unsigned long long cacheBudget = 2048ULL * 1024 * 1024;
+
+// Sits at the front of every cache entry
+typedef struct CacheHeader
+{
+    char magic[8];
+    int version;
+    int width, height, maxColor, channels, magicNumber;
+    unsigned long long key, sourceSize;
+    long long sourceTime;
+} CacheHeader;
+
+// Where the cache entry for the open file lives and what it has to match
+typedef struct DecodeCache
+{
+    char directory[1024];
+    char entry[1100];
+    unsigned long long key, sourceSize;
+    long long sourceTime;
+} DecodeCache;
+
+// One file found in the cache directory
+typedef struct CacheEntry
+{
+    char name[64];
+    unsigned long long size;
+    long long lastUsed;
+} CacheEntry;
+
+// 64 bit FNV-1a, only ever run over the path and a few samples of the file
+static unsigned long long hashBytes(unsigned long long hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Finds the cache directory and makes sure it exists. EZVIEW_CACHE picks
+// the directory, otherwise it goes under the user's local cache folder
+static int cacheDirectory(char *directory, size_t room)
+{
+    const char *custom = getenv("EZVIEW_CACHE");
+
+#ifdef _WIN32
+    const char *base = getenv("LOCALAPPDATA");
+
+    if (custom && *custom)
+        snprintf(directory, room, "%s", custom);
+    else if (base && *base)
+        snprintf(directory, room, "%s\\ezview", base);
+    else
+        return 0;
+    CreateDirectoryA(directory, NULL);
+    DWORD attributes = GetFileAttributesA(directory);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    struct stat info;
+
+    if (custom && *custom)
+        snprintf(directory, room, "%s", custom);
+    else if (base && *base)
+        snprintf(directory, room, "%s/ezview", base);
+    else if (home && *home)
+    {
+        snprintf(directory, room, "%s/.cache", home);
+        mkdir(directory, 0755);
+        snprintf(directory, room, "%s/.cache/ezview", home);
+    }
+    else
+        return 0;
+    mkdir(directory, 0700);
+    return stat(directory, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+// Fills in the key for the file at path: its full path, modification time
+// and size, plus a hash of its first and last CACHE_SAMPLE_BYTES so a file
+// rewritten within the same second still misses. Returns 0 if the cache
+// can not be used
+static int openDecodeCache(DecodeCache *cache, const char *path, const MappedFile *source)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    size_t sample = source->size < CACHE_SAMPLE_BYTES ? source->size : CACHE_SAMPLE_BYTES;
+    char *fullPath;
+
+    if (!cacheDirectory(cache->directory, sizeof(cache->directory)))
+        return 0;
+
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes))
+        return 0;
+    cache->sourceTime = ((long long)attributes.ftLastWriteTime.dwHighDateTime << 32) |
+                        attributes.ftLastWriteTime.dwLowDateTime;
+    fullPath = _fullpath(NULL, path, 0);
+#else
+    struct stat info;
+    if (stat(path, &info) != 0)
+        return 0;
+    cache->sourceTime = (long long)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    fullPath = realpath(path, NULL);
+#endif
+    if (!fullPath)
+        return 0;
+
+    cache->sourceSize = source->size;
+    hash = hashBytes(hash, fullPath, strlen(fullPath));
+    hash = hashBytes(hash, &cache->sourceTime, sizeof(cache->sourceTime));
+    hash = hashBytes(hash, &cache->sourceSize, sizeof(cache->sourceSize));
+    hash = hashBytes(hash, source->data, sample);
+    hash = hashBytes(hash, source->data + source->size - sample, sample);
+    free(fullPath);
+
+    cache->key = hash;
+    snprintf(cache->entry, sizeof(cache->entry), "%s/%016llx.ezc", cache->directory, hash);
+    return 1;
+}
+
+// Marks an entry as just used by bumping its modification time
+static void touchCacheEntry(const char *path)
+{
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(handle, NULL, NULL, &now);
+        CloseHandle(handle);
+    }
+#else
+    utime(path, NULL);
+#endif
+}
+
+// Maps the cache entry for the file if there is a good one. Anything that
+// does not match the file's header exactly is treated as a miss
+static int loadDecodeCache(const DecodeCache *cache, const PpmHeader *header, MappedFile *cached)
+{
+    const CacheHeader *entry;
+    size_t rasterSize = (size_t)header->width * header->height * header->depth;
+
+    if (!openMappedFile(cache->entry, cached))
+        return 0;
+
+    entry = (const CacheHeader *)cached->data;
+    if (cached->size != CACHE_RASTER_OFFSET + rasterSize ||
+        memcmp(entry->magic, "EZVCACHE", 8) != 0 || entry->version != CACHE_VERSION ||
+        entry->key != cache->key || entry->sourceSize != cache->sourceSize ||
+        entry->sourceTime != cache->sourceTime || entry->width != header->width ||
+        entry->height != header->height || entry->channels != header->depth ||
+        entry->maxColor != header->maxColor || entry->magicNumber != header->magicNumber)
+    {
+        closeMappedFile(cached);
+        return 0;
+    }
+
+    touchCacheEntry(cache->entry);
+    return 1;
+}
+
+// Lists every entry in the cache directory. Returns how many there are
+static int listCacheEntries(const char *directory, CacheEntry **entries)
+{
+    int count = 0, capacity = 0;
+
+    *entries = NULL;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    char pattern[1100];
+    HANDLE search;
+
+    snprintf(pattern, sizeof(pattern), "%s\\*.ezc", directory);
+    search = FindFirstFileA(pattern, &found);
+    if (search == INVALID_HANDLE_VALUE)
+        return 0;
+    do
+    {
+        if (strlen(found.cFileName) >= sizeof((*entries)->name))
+            continue;
+#else
+    DIR *search = opendir(directory);
+    struct dirent *found;
+    struct stat info;
+    char path[1200];
+    size_t length;
+
+    if (!search)
+        return 0;
+    while ((found = readdir(search)) != NULL)
+    {
+        length = strlen(found->d_name);
+        if (length < 4 || length >= sizeof((*entries)->name) ||
+            strcmp(found->d_name + length - 4, ".ezc") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, found->d_name);
+        if (stat(path, &info) != 0)
+            continue;
+#endif
+        if (count == capacity)
+        {
+            CacheEntry *grown;
+            capacity = capacity ? capacity * 2 : 32;
+            grown = (CacheEntry *)realloc(*entries, sizeof(CacheEntry) * capacity);
+            if (!grown)
+                break;
+            *entries = grown;
+        }
+#ifdef _WIN32
+        strcpy((*entries)[count].name, found.cFileName);
+        (*entries)[count].size = ((unsigned long long)found.nFileSizeHigh << 32) | found.nFileSizeLow;
+        (*entries)[count].lastUsed = ((long long)found.ftLastWriteTime.dwHighDateTime << 32) |
+                                     found.ftLastWriteTime.dwLowDateTime;
+        count++;
+    } while (FindNextFileA(search, &found));
+    FindClose(search);
+#else
+        strcpy((*entries)[count].name, found->d_name);
+        (*entries)[count].size = (unsigned long long)info.st_size;
+        (*entries)[count].lastUsed = (long long)info.st_mtime;
+        count++;
+    }
+    closedir(search);
+#endif
+    return count;
+}
+
+static int compareLastUsed(const void *a, const void *b)
+{
+    long long first = ((const CacheEntry *)a)->lastUsed, second = ((const CacheEntry *)b)->lastUsed;
+    return first < second ? -1 : first > second;
+}
+
+// Deletes the least recently used entries until the cache fits in budget
+// bytes. A budget of 0 empties it. Returns how many entries were deleted
+static int trimDecodeCache(const char *directory, unsigned long long budget)
+{
+    CacheEntry *entries;
+    unsigned long long total = 0;
+    char path[1200];
+    int count = listCacheEntries(directory, &entries), i, removed = 0;
+
+    for (i = 0; i < count; i++)
+        total += entries[i].size;
+    qsort(entries, count, sizeof(CacheEntry), compareLastUsed);
+
+    for (i = 0; i < count && total > budget; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", directory, entries[i].name);
+        if (remove(path) == 0)
+        {
+            total -= entries[i].size;
+            removed++;
+        }
+    }
+    free(entries);
+    return removed;
+}
+
+// Writes the decoded raster out as a cache entry. It goes to a temporary
+// file first and is renamed into place, so a half written entry is never
+// picked up. Returns 0 if it could not be written
+static int storeDecodeCache(const DecodeCache *cache, const PpmHeader *header, const Pixmap *buffer)
+{
+    size_t rasterSize = (size_t)buffer->width * buffer->height * buffer->channels;
+    char temporary[1200];
+    unsigned char *front;
+    CacheHeader *entry;
+    FILE *out;
+    int ok;
+
+    if (CACHE_RASTER_OFFSET + rasterSize > cacheBudget)
+        return 0;
+
+    front = (unsigned char *)calloc(1, CACHE_RASTER_OFFSET);
+    if (!front)
+        return 0;
+    entry = (CacheHeader *)front;
+    memcpy(entry->magic, "EZVCACHE", 8);
+    entry->version = CACHE_VERSION;
+    entry->width = header->width;
+    entry->height = header->height;
+    entry->maxColor = header->maxColor;
+    entry->channels = header->depth;
+    entry->magicNumber = header->magicNumber;
+    entry->key = cache->key;
+    entry->sourceSize = cache->sourceSize;
+    entry->sourceTime = cache->sourceTime;
+
+#ifdef _WIN32
+    snprintf(temporary, sizeof(temporary), "%s.%lu.tmp", cache->entry, (unsigned long)GetCurrentProcessId());
+#else
+    snprintf(temporary, sizeof(temporary), "%s.%lu.tmp", cache->entry, (unsigned long)getpid());
+#endif
+    out = fopen(temporary, "wb");
+    if (!out)
+    {
+        free(front);
+        return 0;
+    }
+    ok = fwrite(front, 1, CACHE_RASTER_OFFSET, out) == CACHE_RASTER_OFFSET &&
+         fwrite(buffer->image, 1, rasterSize, out) == rasterSize;
+    ok = fclose(out) == 0 && ok;
+    free(front);
+
+#ifdef _WIN32
+    ok = ok && MoveFileExA(temporary, cache->entry, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(temporary, cache->entry) == 0;
+#endif
+    if (!ok)
+    {
+        remove(temporary);
+        return 0;
+    }
+
+    trimDecodeCache(cache->directory, cacheBudget);
+    return 1;
+}
+
+
+///////////////////////////////////// ETC1 /////////////////////////////////////
+
+// With -etc1 the tiles go to the card as ETC1, 4 bits a pixel instead of 24.
+// A 4x4 block is split into two 2x4 or 4x2 halves, each with a base colour
+// and one of 8 tables of brightness offsets, and every pixel picks one of
+// its table's four offsets. The fast preset takes each half's average colour
+// as its base and picks offsets from the unclamped error, which is cheap to
+// work out since an offset moves all three channels together. The best
+// preset also tries both ways of storing the base colours and scores every
+// offset by its real clamped error
+
+#define ETC1_OFF 0
+#define ETC1_FAST 1
+#define ETC1_BEST 2
+int etc1Mode = ETC1_OFF;
+
+// The small and large offset of each table, pixel index 0 to 3 is
+// +small, +large, -small, -large
+static const int etc1Tables[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+// One half of a block while it is being fitted
+typedef struct Etc1Half
+{
+    int pixels[8][3];
+    int positions[8];   // x * 4 + y, the pixel's bit in the index planes
+    int base[3];        // expanded to 8 bits
+    int table;
+    int indices[8];
+    long error;
+} Etc1Half;
+
+// Splits an image region into blocks for the encoder's workers, by rows of
+// blocks
+typedef struct Etc1Job
+{
+    const unsigned char *image;
+    unsigned char *blocks;
+    int imageWidth, channels, x, y, width, height, mode, workers;
+} Etc1Job;
+
+// Bytes of ETC1 data for a width by height image, ETC1 rounds both up to
+// whole blocks
+static size_t etc1Size(int width, int height)
+{
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+static int clampByte(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static int etc1Offset(int table, int index)
+{
+    return index & 2 ? -etc1Tables[table][index & 1] : etc1Tables[table][index & 1];
+}
+
+#ifdef EZ_X86
+
+// The fast preset's table search for all 8 pixels of a half at once, with
+// madd doing the 16 by 16 bit products into 32 bit lanes. Returns the
+// cheapest table and its cost on top of the bare error in *cost
+EZ_TARGET("sse2")
+static int fastEtc1TableSse2(const int distance[8], long *cost)
+{
+    __m128i d0 = _mm_loadu_si128((const __m128i *)distance);
+    __m128i d1 = _mm_loadu_si128((const __m128i *)(distance + 4));
+    int table, best = 0, small, large, error;
+
+    for (table = 0; table < 8; table++)
+    {
+        small = etc1Tables[table][0];
+        large = etc1Tables[table][1];
+        __m128i ks = _mm_set1_epi32(-2 * small & 0xFFFF), cs = _mm_set1_epi32(3 * small * small);
+        __m128i kl = _mm_set1_epi32(-2 * large & 0xFFFF), cl = _mm_set1_epi32(3 * large * large);
+        __m128i s0 = _mm_add_epi32(_mm_madd_epi16(d0, ks), cs), s1 = _mm_add_epi32(_mm_madd_epi16(d1, ks), cs);
+        __m128i l0 = _mm_add_epi32(_mm_madd_epi16(d0, kl), cl), l1 = _mm_add_epi32(_mm_madd_epi16(d1, kl), cl);
+        __m128i m0 = _mm_cmplt_epi32(l0, s0), m1 = _mm_cmplt_epi32(l1, s1);
+        __m128i sum = _mm_add_epi32(_mm_or_si128(_mm_and_si128(m0, l0), _mm_andnot_si128(m0, s0)),
+                                    _mm_or_si128(_mm_and_si128(m1, l1), _mm_andnot_si128(m1, s1)));
+
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+        error = _mm_cvtsi128_si32(sum);
+        if (table == 0 || error < *cost)
+        {
+            *cost = error;
+            best = table;
+        }
+    }
+    return best;
+}
+
+#endif
+
+// Picks the table and pixel indices for a half whose base is already set
+static void fitEtc1Half(Etc1Half *half, int mode)
+{
+    int table, i, c, index, best = 0, offset, d, small, large;
+    int indices[8], distance[8], below[8];
+    long error, pixelError, bestPixel, bare = 0;
+
+    // Unclamped, offset m costs 3m^2 - 2md on top of the pixel's error
+    // against the bare base, d being how far its channels sum above the
+    // base. So the sign of the offset follows d and only its size is a choice
+    for (i = 0; i < 8; i++)
+    {
+        d = 0;
+        for (c = 0; c < 3; c++)
+        {
+            d += half->pixels[i][c] - half->base[c];
+            bare += (long)(half->pixels[i][c] - half->base[c]) * (half->pixels[i][c] - half->base[c]);
+        }
+        below[i] = d < 0 ? 2 : 0;
+        distance[i] = d < 0 ? -d : d;
+    }
+
+    if (mode == ETC1_FAST)
+    {
+#ifdef EZ_X86
+        half->table = fastEtc1TableSse2(distance, &half->error);
+#else
+        for (table = 0; table < 8; table++)
+        {
+            small = etc1Tables[table][0];
+            large = etc1Tables[table][1];
+            error = 0;
+            for (i = 0; i < 8; i++)
+            {
+                long smallError = 3 * small * small - 2 * small * distance[i];
+                long largeError = 3 * large * large - 2 * large * distance[i];
+                error += largeError < smallError ? largeError : smallError;
+            }
+            if (table == 0 || error < half->error)
+            {
+                half->error = error;
+                half->table = table;
+            }
+        }
+#endif
+        small = etc1Tables[half->table][0];
+        large = etc1Tables[half->table][1];
+        for (i = 0; i < 8; i++)
+            half->indices[i] = (3 * large * large - 2 * large * distance[i] <
+                                3 * small * small - 2 * small * distance[i]) | below[i];
+        half->error += bare;
+        return;
+    }
+
+    // The best preset scores every offset by its real, clamped error
+    half->error = -1;
+    for (table = 0; table < 8; table++)
+    {
+        error = 0;
+        for (i = 0; i < 8; i++)
+        {
+            bestPixel = -1;
+            for (index = 0; index < 4; index++)
+            {
+                offset = etc1Offset(table, index);
+                pixelError = 0;
+                for (c = 0; c < 3; c++)
+                {
+                    d = clampByte(half->base[c] + offset) - half->pixels[i][c];
+                    pixelError += d * d;
+                }
+                if (bestPixel < 0 || pixelError < bestPixel)
+                {
+                    bestPixel = pixelError;
+                    best = index;
+                }
+            }
+            error += bestPixel;
+            indices[i] = best;
+        }
+        if (half->error < 0 || error < half->error)
+        {
+            half->error = error;
+            half->table = table;
+            memcpy(half->indices, indices, sizeof(indices));
+        }
+    }
+}
+
+// Encodes one block given as 16 RGB pixels, row by row
+static void encodeEtc1Block(const unsigned char pixels[16][3], int mode, unsigned char out[8])
+{
+    Etc1Half halves[2][2], trial[2];
+    int flip, h, i, c, x, y, n[2], sum[2][3], q5[2][3], q4[2][3];
+    int differential, tryDifferential, tryIndividual, pass;
+    int bestFlip = 0, bestDifferential = 0, bestQ[2][3] = { { 0 } };
+    long error, bestError = -1;
+    unsigned int high, low = 0;
+
+    for (flip = 0; flip < 2; flip++)
+    {
+        // Gather the two halves, left and right unless flipped to top and bottom
+        n[0] = n[1] = 0;
+        memset(sum, 0, sizeof(sum));
+        for (y = 0; y < 4; y++)
+            for (x = 0; x < 4; x++)
+            {
+                h = flip ? y >= 2 : x >= 2;
+                for (c = 0; c < 3; c++)
+                {
+                    trial[h].pixels[n[h]][c] = pixels[y * 4 + x][c];
+                    sum[h][c] += pixels[y * 4 + x][c];
+                }
+                trial[h].positions[n[h]++] = x * 4 + y;
+            }
+
+        // Differential mode keeps 5 bits of each base as long as the second
+        // is within -4 to 3 steps of the first, individual mode 4 bits each
+        differential = 1;
+        for (h = 0; h < 2; h++)
+            for (c = 0; c < 3; c++)
+            {
+                q5[h][c] = ((sum[h][c] + 4) / 8 * 31 + 127) / 255;
+                q4[h][c] = ((sum[h][c] + 4) / 8 * 15 + 127) / 255;
+            }
+        for (c = 0; c < 3; c++)
+            if (q5[1][c] - q5[0][c] < -4 || q5[1][c] - q5[0][c] > 3)
+                differential = 0;
+        tryDifferential = differential;
+        tryIndividual = !differential || mode == ETC1_BEST;
+
+        for (pass = 0; pass < 2; pass++)
+        {
+            if ((pass == 0 && !tryDifferential) || (pass == 1 && !tryIndividual))
+                continue;
+            error = 0;
+            for (h = 0; h < 2; h++)
+            {
+                for (c = 0; c < 3; c++)
+                    trial[h].base[c] = pass == 0 ? (q5[h][c] << 3) | (q5[h][c] >> 2) : q4[h][c] * 17;
+                fitEtc1Half(&trial[h], mode);
+                error += trial[h].error;
+            }
+            if (bestError < 0 || error < bestError)
+            {
+                bestError = error;
+                bestFlip = flip;
+                bestDifferential = pass == 0;
+                memcpy(halves[flip], trial, sizeof(trial));
+                memcpy(bestQ, pass == 0 ? q5 : q4, sizeof(bestQ));
+            }
+        }
+    }
+
+    if (bestDifferential)
+        high = (unsigned int)bestQ[0][0] << 27 | (unsigned int)((bestQ[1][0] - bestQ[0][0]) & 7) << 24 |
+               (unsigned int)bestQ[0][1] << 19 | (unsigned int)((bestQ[1][1] - bestQ[0][1]) & 7) << 16 |
+               (unsigned int)bestQ[0][2] << 11 | (unsigned int)((bestQ[1][2] - bestQ[0][2]) & 7) << 8;
+    else
+        high = (unsigned int)bestQ[0][0] << 28 | (unsigned int)bestQ[1][0] << 24 |
+               (unsigned int)bestQ[0][1] << 20 | (unsigned int)bestQ[1][1] << 16 |
+               (unsigned int)bestQ[0][2] << 12 | (unsigned int)bestQ[1][2] << 8;
+    high |= (unsigned int)halves[bestFlip][0].table << 5 | (unsigned int)halves[bestFlip][1].table << 2 |
+            (unsigned int)bestDifferential << 1 | (unsigned int)bestFlip;
+
+    // Index bits are split into a plane of high bits over a plane of low ones
+    for (h = 0; h < 2; h++)
+        for (i = 0; i < 8; i++)
+            low |= (unsigned int)(halves[bestFlip][h].indices[i] >> 1) << (16 + halves[bestFlip][h].positions[i]) |
+                   (unsigned int)(halves[bestFlip][h].indices[i] & 1) << halves[bestFlip][h].positions[i];
+
+    for (i = 0; i < 4; i++)
+    {
+        out[i] = (unsigned char)(high >> (24 - 8 * i));
+        out[4 + i] = (unsigned char)(low >> (24 - 8 * i));
+    }
+}
+
+// Decodes one block to 16 RGB pixels, row by row
+static void decodeEtc1Block(const unsigned char in[8], unsigned char pixels[16][3])
+{
+    unsigned int high = (unsigned int)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+    unsigned int low = (unsigned int)in[4] << 24 | in[5] << 16 | in[6] << 8 | in[7];
+    int base[2][3], tables[2], flip = high & 1, x, y, c, h, q, d, position, index;
+
+    for (c = 0; c < 3; c++)
+    {
+        if (high & 2)
+        {
+            q = (high >> (27 - 8 * c)) & 31;
+            d = (high >> (24 - 8 * c)) & 7;
+            d = d >= 4 ? d - 8 : d;
+            base[0][c] = (q << 3) | (q >> 2);
+            base[1][c] = ((q + d) << 3) | ((q + d) >> 2);
+        }
+        else
+        {
+            base[0][c] = ((high >> (28 - 8 * c)) & 15) * 17;
+            base[1][c] = ((high >> (24 - 8 * c)) & 15) * 17;
+        }
+    }
+    tables[0] = (high >> 5) & 7;
+    tables[1] = (high >> 2) & 7;
+
+    for (y = 0; y < 4; y++)
+        for (x = 0; x < 4; x++)
+        {
+            h = flip ? y >= 2 : x >= 2;
+            position = x * 4 + y;
+            index = ((low >> (16 + position)) & 1) << 1 | ((low >> position) & 1);
+            for (c = 0; c < 3; c++)
+                pixels[y * 4 + x][c] = (unsigned char)clampByte(base[h][c] + etc1Offset(tables[h], index));
+        }
+}
+
+static void etc1Worker(void *context, int index)
+{
+    Etc1Job *job = (Etc1Job *)context;
+    int blocksWide = (job->width + 3) / 4, blocksHigh = (job->height + 3) / 4;
+    int rows = (blocksHigh + job->workers - 1) / job->workers;
+    int first = index * rows, last = first + rows < blocksHigh ? first + rows : blocksHigh;
+    int bx, by, i, c, x, y;
+    unsigned char pixels[16][3];
+    const unsigned char *pixel;
+
+    for (by = first; by < last; by++)
+        for (bx = 0; bx < blocksWide; bx++)
+        {
+            // Blocks hanging over the edge repeat the last row and column.
+            // Gray comes from the first channel, colour from the first three,
+            // and alpha is left behind
+            for (i = 0; i < 16; i++)
+            {
+                x = bx * 4 + (i & 3) < job->width ? bx * 4 + (i & 3) : job->width - 1;
+                y = by * 4 + (i >> 2) < job->height ? by * 4 + (i >> 2) : job->height - 1;
+                pixel = job->image + ((size_t)(job->y + y) * job->imageWidth + job->x + x) * job->channels;
+                for (c = 0; c < 3; c++)
+                    pixels[i][c] = pixel[job->channels >= 3 ? c : 0];
+            }
+            encodeEtc1Block((const unsigned char (*)[3])pixels, job->mode,
+                            job->blocks + ((size_t)by * blocksWide + bx) * 8);
+        }
+}
+
+// Encodes the width by height region at (x, y) of an image of any channel
+// count imageWidth pixels wide into etc1Size(width, height) bytes of blocks, with
+// the rows of blocks shared out over the cores
+static void encodeEtc1(const unsigned char *image, int imageWidth, int channels, int x, int y,
+                       int width, int height, int mode, unsigned char *blocks)
+{
+    Etc1Job job;
+
+    job.image = image;
+    job.blocks = blocks;
+    job.imageWidth = imageWidth;
+    job.channels = channels;
+    job.x = x;
+    job.y = y;
+    job.width = width;
+    job.height = height;
+    job.mode = mode;
+
+    // Small regions are done before a thread would have started
+    job.workers = cpuCount();
+    if (job.workers > (height + 3) / 4 / 16)
+        job.workers = (height + 3) / 4 / 16 > 1 ? (height + 3) / 4 / 16 : 1;
+    runWorkers(job.workers, etc1Worker, &job);
+}
+
+// Decodes width by height pixels of blocks back to RGB
+static void decodeEtc1(const unsigned char *blocks, int width, int height, unsigned char *rgb)
+{
+    int blocksWide = (width + 3) / 4, bx, by, i, x, y;
+    unsigned char pixels[16][3];
+
+    for (by = 0; by < (height + 3) / 4; by++)
+        for (bx = 0; bx < blocksWide; bx++)
+        {
+            decodeEtc1Block(blocks + ((size_t)by * blocksWide + bx) * 8, pixels);
+            for (i = 0; i < 16; i++)
+            {
+                x = bx * 4 + (i & 3);
+                y = by * 4 + (i >> 2);
+                if (x < width && y < height)
+                    memcpy(rgb + ((size_t)y * width + x) * 3, pixels[i], 3);
+            }
+        }
+}
+
+// Encodes the whole image with both presets, decodes it again and prints
+// the time taken and the PSNR against the original (-etc1test). Needs no
+// GL, so it runs on machines without a display. ETC1 has no alpha, so only
+// the colour of images with alpha is compared
+static void testEtc1(const Pixmap *buffer)
+{
+    static const char *names[] = { "", "fast", "best" };
+    size_t size = etc1Size(buffer->width, buffer->height);
+    size_t pixels = (size_t)buffer->width * buffer->height, i;
+    unsigned char *blocks = (unsigned char *)malloc(size);
+    unsigned char *rgb = (unsigned char *)malloc(pixels * 3);
+    double start, encoded, squared, d;
+    int mode, c;
+
+    if (!blocks || !rgb)
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the ETC1 test!");
+        exit(-1);
+    }
+
+    printf("ETC1 test: %d x %d, %d threads, %.1f MB as ETC1 instead of %.1f MB\n",
+           buffer->width, buffer->height, cpuCount(), size / 1048576.0, pixels * 3 / 1048576.0);
+    for (mode = ETC1_FAST; mode <= ETC1_BEST; mode++)
+    {
+        start = nowSeconds();
+        encodeEtc1(buffer->image, buffer->width, buffer->channels, 0, 0,
+                   buffer->width, buffer->height, mode, blocks);
+        encoded = nowSeconds() - start;
+        decodeEtc1(blocks, buffer->width, buffer->height, rgb);
+
+        squared = 0;
+        for (i = 0; i < pixels; i++)
+            for (c = 0; c < 3; c++)
+            {
+                d = (double)rgb[i * 3 + c] - buffer->image[i * buffer->channels + (buffer->channels >= 3 ? c : 0)];
+                squared += d * d;
+            }
+        squared /= pixels * 3;
+        printf("  %-4s  %8.1f ms  %7.1f MP/s  PSNR %.2f dB\n", names[mode], encoded * 1000,
+               pixels / encoded / 1e6, squared > 0 ? 10 * log10(255.0 * 255.0 / squared) : 99.0);
+    }
+    free(blocks);
+    free(rgb);
+}
+
+///////////////////////////////////// QUARTER TURNS /////////////////////////////////////
+
+// Turning an image by quarter turns moves every pixel without resampling.
+// The destination is done in square blocks of this many pixels, so the
+// columns read from the source and the rows written both stay in cache
+#define TURN_BLOCK 64
+
+typedef struct TurnJob
+{
+    const unsigned char *src;
+    unsigned char *dst;
+    int width, height;      // of src, dst is height by width for odd turns
+    int channels, turns;
+    int dstWidth, dstHeight;
+    volatile long nextBand;
+} TurnJob;
+
+// The source pixel that lands on destination pixel (u, v)
+static void turnedFrom(const TurnJob *job, int u, int v, int *x, int *y)
+{
+    switch (job->turns)
+    {
+    case 1:
+        *x = job->width - 1 - v;
+        *y = u;
+        break;
+    case 2:
+        *x = job->width - 1 - u;
+        *y = job->height - 1 - v;
+        break;
+    case 3:
+        *x = v;
+        *y = job->height - 1 - u;
+        break;
+    default:
+        *x = u;
+        *y = v;
+    }
+}
+
+// Copies the destination pixels in [u0, u1) x [v0, v1) one at a time
+static void turnBlockScalar(const TurnJob *job, int u0, int v0, int u1, int v1)
+{
+    int u, v, x, y, c, channels = job->channels;
+    const unsigned char *in;
+    unsigned char *out;
+
+    for (v = v0; v < v1; v++)
+    {
+        out = job->dst + ((size_t)v * job->dstWidth + u0) * channels;
+        for (u = u0; u < u1; u++)
+        {
+            turnedFrom(job, u, v, &x, &y);
+            in = job->src + ((size_t)y * job->width + x) * channels;
+            for (c = 0; c < channels; c++)
+                *out++ = in[c];
+        }
+    }
+}
+
+#ifdef EZ_X86
+
+// Four pixels of 3 or 4 bytes from p as four 32 bit lanes. RGB reads 4
+// bytes past the pixels, the caller makes sure they are there
+EZ_TARGET("ssse3")
+static __m128i loadTurnPixels(const unsigned char *p, int channels)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i pixels = _mm_loadu_si128((const __m128i *)p);
+    return channels == 4 ? pixels : _mm_shuffle_epi8(pixels, spread);
+}
+
+// Stores four 32 bit lanes back as pixels of 3 or 4 bytes
+EZ_TARGET("ssse3")
+static void storeTurnPixels(unsigned char *p, __m128i pixels, int channels)
+{
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int last;
+
+    if (channels == 4)
+    {
+        _mm_storeu_si128((__m128i *)p, pixels);
+        return;
+    }
+    pixels = _mm_shuffle_epi8(pixels, pack);
+    _mm_storel_epi64((__m128i *)p, pixels);
+    last = _mm_cvtsi128_si32(_mm_srli_si128(pixels, 8));
+    memcpy(p + 8, &last, 4);
+}
+
+// Copies the destination pixels in [u0, u1) x [v0, v1) as 4x4 squares: four
+// source rows are loaded, transposed with unpacks and, depending on the
+// direction, lane reversed before being stored as four destination rows.
+// RGB is widened to 32 bit lanes with pshufb on the way in and narrowed on
+// the way out. Pixels that do not make up a whole square, and RGB squares
+// whose loads would run off the end of the image, are left to the scalar copy
+EZ_TARGET("ssse3")
+static void turnBlockSsse3(const TurnJob *job, int u0, int v0, int u1, int v1)
+{
+    int channels = job->channels, width = job->width, height = job->height;
+    size_t rowBytes = (size_t)width * channels, end = rowBytes * height;
+    size_t dstRow = (size_t)job->dstWidth * channels;
+    int uEnd = u0 + (u1 - u0) / 4 * 4, vEnd = v0 + (v1 - v0) / 4 * 4;
+    int u, v, k, x, y;
+    const unsigned char *in;
+    unsigned char *out;
+    __m128i r[4], t0, t1, t2, t3, c[4];
+
+    for (v = v0; v < vEnd; v += 4)
+    {
+        for (u = u0; u < uEnd; u += 4)
+        {
+            // The top left of the source square, its rows run down in y
+            if (job->turns == 1)
+            {
+                x = width - 4 - v;
+                y = u;
+            }
+            else if (job->turns == 3)
+            {
+                x = v;
+                y = height - 4 - u;
+            }
+            else
+            {
+                x = width - 4 - u;
+                y = height - 4 - v;
+            }
+            in = job->src + (size_t)y * rowBytes + (size_t)x * channels;
+            if (channels == 3 && (size_t)(in - job->src) + 3 * rowBytes + 16 > end)
+            {
+                turnBlockScalar(job, u, v, u + 4, v + 4);
+                continue;
+            }
+            for (k = 0; k < 4; k++)
+                r[k] = loadTurnPixels(in + k * rowBytes, channels);
+            out = job->dst + (size_t)v * dstRow + (size_t)u * channels;
+
+            if (job->turns == 2)
+            {
+                // Half a turn is each row backwards, in the opposite order
+                for (k = 0; k < 4; k++)
+                    storeTurnPixels(out + k * dstRow, _mm_shuffle_epi32(r[3 - k], 0x1B), channels);
+                continue;
+            }
+
+            // c[j] is source column j from top to bottom
+            t0 = _mm_unpacklo_epi32(r[0], r[1]);
+            t1 = _mm_unpacklo_epi32(r[2], r[3]);
+            t2 = _mm_unpackhi_epi32(r[0], r[1]);
+            t3 = _mm_unpackhi_epi32(r[2], r[3]);
+            c[0] = _mm_unpacklo_epi64(t0, t1);
+            c[1] = _mm_unpackhi_epi64(t0, t1);
+            c[2] = _mm_unpacklo_epi64(t2, t3);
+            c[3] = _mm_unpackhi_epi64(t2, t3);
+
+            // Counterclockwise, destination rows are the source columns from
+            // the right. Clockwise, they are the columns from the left read
+            // bottom to top
+            for (k = 0; k < 4; k++)
+                storeTurnPixels(out + k * dstRow, job->turns == 1 ? c[3 - k] : _mm_shuffle_epi32(c[k], 0x1B),
+                                channels);
+        }
+        if (uEnd < u1)
+            turnBlockScalar(job, uEnd, v, u1, v + 4);
+    }
+    if (vEnd < v1)
+        turnBlockScalar(job, u0, vEnd, u1, v1);
+}
+
+#endif
+
+static void turnWorker(void *context, int index)
+{
+    TurnJob *job = (TurnJob *)context;
+    long band;
+    int u, v, u1, v1;
+
+    while ((band = atomicIncrement(&job->nextBand) - 1) * TURN_BLOCK < job->dstHeight)
+    {
+        v = (int)band * TURN_BLOCK;
+        v1 = v + TURN_BLOCK < job->dstHeight ? v + TURN_BLOCK : job->dstHeight;
+
+        // A half turn reads and writes whole rows, so blocks would only
+        // cut the runs short
+        for (u = 0; u < job->dstWidth; u += job->turns == 2 ? job->dstWidth : TURN_BLOCK)
+        {
+            u1 = job->turns == 2 || u + TURN_BLOCK > job->dstWidth ? job->dstWidth : u + TURN_BLOCK;
+#ifdef EZ_X86
+            if (haveSsse3 && (job->channels == 3 || job->channels == 4))
+            {
+                turnBlockSsse3(job, u, v, u1, v1);
+                continue;
+            }
+#endif
+            turnBlockScalar(job, u, v, u1, v1);
+        }
+    }
+}
+
+// Turns width by height pixels counterclockwise by turns quarter turns into
+// dst, which is height by width for odd turns. Every pixel is copied exactly.
+// Bands of blocks are shared out over the cores
+static void turnPixels(const unsigned char *src, int width, int height, int channels, int turns,
+                       unsigned char *dst)
+{
+    TurnJob job;
+    int workers;
+
+    job.src = src;
+    job.dst = dst;
+    job.width = width;
+    job.height = height;
+    job.channels = channels;
+    job.turns = turns & 3;
+    job.dstWidth = job.turns & 1 ? height : width;
+    job.dstHeight = job.turns & 1 ? width : height;
+    job.nextBand = 0;
+
+    if (job.turns == 0)
+    {
+        memcpy(dst, src, (size_t)width * height * channels);
+        return;
+    }
+
+    workers = cpuCount();
+    if (workers > (job.dstHeight + TURN_BLOCK - 1) / TURN_BLOCK)
+        workers = (job.dstHeight + TURN_BLOCK - 1) / TURN_BLOCK;
+    runWorkers(workers, turnWorker, &job);
+}
+
+// A copy of source turned by quarterTurns, for the cpu renderer and
+// -export. Returns 0 if there is no memory for it
+static int turnPixmap(const Pixmap *source, Pixmap *turned)
+{
+    memset(turned, 0, sizeof(Pixmap));
+    turned->width = quarterTurns & 1 ? source->height : source->width;
+    turned->height = quarterTurns & 1 ? source->width : source->height;
+    turned->channels = source->channels;
+    turned->magicNumber = source->magicNumber;
+    turned->image = (unsigned char *)malloc((size_t)source->width * source->height * source->channels);
+    if (!turned->image)
+        return 0;
+    turnPixels(source->image, source->width, source->height, source->channels, quarterTurns, turned->image);
+    return 1;
+}
+
+// Times a quarter turn each way and a half turn of a made up 100 MP RGB
+// image, in GB/s read plus written (-benchturn)
+static void benchmarkTurns(void)
+{
+    static const char *names[] = { "", "counterclockwise", "half turn", "clockwise" };
+    int width = 10000, height = 10000, turns, run;
+    size_t bytes = (size_t)width * height * 3, k;
+    unsigned char *src = (unsigned char *)malloc(bytes), *dst = (unsigned char *)malloc(bytes);
+    double start, elapsed, best;
+
+    if (!src || !dst)
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the turn benchmark!");
+        exit(-1);
+    }
+    for (k = 0; k < bytes; k++)
+        src[k] = (unsigned char)(k * 31);
+
+    printf("Turn benchmark, %d x %d RGB, %d threads, %s, best of 3\n", width, height, cpuCount(),
+           haveSsse3 ? "SSSE3" : "scalar");
+    for (turns = 1; turns <= 3; turns++)
+    {
+        best = 1e30;
+        for (run = 0; run < 3; run++)
+        {
+            start = nowSeconds();
+            turnPixels(src, width, height, 3, turns, dst);
+            elapsed = nowSeconds() - start;
+            best = elapsed < best ? elapsed : best;
+        }
+        printf("  %-17s %8.1f ms  %6.2f GB/s\n", names[turns], best * 1000, 2.0 * bytes / best / 1e9);
+    }
+    free(src);
+    free(dst);
+}
+
+///////////////////////////////////// CPU RENDERING /////////////////////////////////////
+
+// Renders the view without GL (-render), for machines with no graphics
+// card. The output is what the window would show: the image quad put
+// through view, sampled nearest like the base texture or bilinear, and
+// anything with alpha blended over the black background. SAMPLE_BICUBIC
+// and SAMPLE_LANCZOS draw bilinear too, from a copy resized first with
+// that filter when the view shrinks the image
+enum { SAMPLE_NEAREST, SAMPLE_BILINEAR, SAMPLE_BICUBIC, SAMPLE_LANCZOS };
+
+static const char *sampleNames[] = { "nearest", "bilinear", "bicubic", "lanczos" };
+
+int renderSampling = SAMPLE_NEAREST;
+
+// How source coordinates are found for each output pixel. WALK_FIXED
+// steps 16.16 fixed point coordinates along each row with one add a pixel
+// and clips the row to the image up front. WALK_FLOAT transforms every
+// pixel in float and tests it against the edges, it is kept for sources too
+// big for 16.16 and to benchmark against (-benchrender)
+enum { WALK_FLOAT, WALK_FIXED };
+
+// ENGINE_WARP finds every output pixel's texels on its own, as above.
+// ENGINE_SHEAR (-engine shear) instead splits the view into three passes
+// that each only move pixels along their own row or column
+enum { ENGINE_WARP, ENGINE_SHEAR };
+
+int renderEngine = ENGINE_WARP;
+
+// Output rows are handed out to the workers in bands of this many
+#define RENDER_BAND_ROWS 16
+
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define FIXED_HALF (FIXED_ONE / 2)
+
+// Sources wider or taller than this, or views that step further than
+// FIXED_MAX_STEP texels a pixel, do not fit 16.16 and walk in float
+#define FIXED_MAX_SIZE 32767
+#define FIXED_MAX_STEP 16384
+
+typedef struct RenderJob
+{
+    const Pixmap *source;
+    unsigned char *pixels;      // width * height RGB, top row first
+    int width, height;
+    int sampling;
+    int walker;                 // WALK_FIXED or WALK_FLOAT
+    mat2x3 toTexel;             // output pixel to source texel coordinates
+    float sMax, tMax;           // the far edges of the quad in texels, the near ones are 0
+    volatile long nextBand;
+} RenderJob;
+
+// The source pixel at p as RGBA bytes, R lowest
+static unsigned int loadTexel(const unsigned char *p, int channels)
+{
+    switch (channels)
+    {
+    case 1:
+        return p[0] * 0x010101u | 0xFF000000u;
+    case 2:
+        return p[0] * 0x010101u | (unsigned int)p[1] << 24;
+    case 3:
+        return p[0] | p[1] << 8 | p[2] << 16 | 0xFF000000u;
+    default:
+        return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+    }
+}
+
+static unsigned int fetchTexel(const Pixmap *source, int x, int y)
+{
+    return loadTexel(source->image + ((size_t)y * source->width + x) * source->channels, source->channels);
+}
+
+// (a * (256 - w) + b * w) / 256 rounded, on one channel
+static unsigned int lerpChannel(unsigned int a, unsigned int b, int w)
+{
+    return (a * (256 - w) + b * w + 128) >> 8;
+}
+
+// c * alpha / 255 rounded, the same as blending over black
+static unsigned int blendChannel(unsigned int c, unsigned int alpha)
+{
+    c = c * alpha + 128;
+    return (c + (c >> 8)) >> 8;
+}
+
+// Renders one output row a pixel at a time, for builds without SSE2. The
+// SSE2 version below gives exactly the same bytes, -selftest holds it to that
+static void renderRowScalar(const RenderJob *job, int y, unsigned char *out)
+{
+    const Pixmap *source = job->source;
+    float rowS = job->toTexel[2][0] + y * job->toTexel[1][0];
+    float rowT = job->toTexel[2][1] + y * job->toTexel[1][1];
+    float s, t, fs, ft;
+    int x, c, x0, y0, x1, y1, wx, wy;
+    unsigned int color, c00, c10, c01, c11;
+
+    for (x = 0; x < job->width; x++, out += 3)
+    {
+        s = rowS + x * job->toTexel[0][0];
+        t = rowT + x * job->toTexel[0][1];
+        if (!(s >= 0 && s <= job->sMax && t >= 0 && t <= job->tMax))
+        {
+            out[0] = out[1] = out[2] = 0;
+            continue;
+        }
+
+        if (job->sampling == SAMPLE_NEAREST)
+        {
+            x0 = (int)s < source->width - 1 ? (int)s : source->width - 1;
+            y0 = (int)t < source->height - 1 ? (int)t : source->height - 1;
+            color = fetchTexel(source, x0, y0);
+        }
+        else
+        {
+            // GL_LINEAR, texel centres are at half coordinates and the
+            // edges are clamped
+            fs = s - 0.5f;
+            ft = t - 0.5f;
+            x0 = (int)floorf(fs);
+            y0 = (int)floorf(ft);
+            wx = (int)((fs - x0) * 256 + 0.5f);
+            wy = (int)((ft - y0) * 256 + 0.5f);
+            x1 = x0 + 1 < source->width - 1 ? x0 + 1 : source->width - 1;
+            y1 = y0 + 1 < source->height - 1 ? y0 + 1 : source->height - 1;
+            x0 = x0 > 0 ? x0 : 0;
+            y0 = y0 > 0 ? y0 : 0;
+            c00 = fetchTexel(source, x0, y0);
+            c10 = fetchTexel(source, x1, y0);
+            c01 = fetchTexel(source, x0, y1);
+            c11 = fetchTexel(source, x1, y1);
+            color = 0;
+            for (c = 0; c < 32; c += 8)
+                color |= lerpChannel(lerpChannel((c00 >> c) & 255, (c10 >> c) & 255, wx),
+                                     lerpChannel((c01 >> c) & 255, (c11 >> c) & 255, wx), wy) << c;
+        }
+
+        for (c = 0; c < 3; c++)
+            out[c] = (unsigned char)(source->channels == 2 || source->channels == 4 ?
+                                     blendChannel((color >> 8 * c) & 255, color >> 24) :
+                                     (color >> 8 * c) & 255);
+    }
+}
+
+#ifdef EZ_X86
+
+// (a * (256 - w) + b * w + 128) >> 8 on 8 channels of 16 bits. None of the
+// sums go past 65535, so the wrapping 16 bit adds are exact
+EZ_TARGET("sse2")
+static __m128i lerpChannelsSse2(__m128i a, __m128i b, __m128i w)
+{
+    const __m128i full = _mm_set1_epi16(256), half = _mm_set1_epi16(128);
+    __m128i sum = _mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(full, w)), _mm_mullo_epi16(b, w));
+    return _mm_srli_epi16(_mm_add_epi16(sum, half), 8);
+}
+
+// Lane weights w0 w1 w2 w3 as 16 bit words, each repeated for the four
+// channels of its pixel: pixels 0 and 1 in *low, 2 and 3 in *high
+EZ_TARGET("sse2")
+static void spreadWeightsSse2(__m128i weights, __m128i *low, __m128i *high)
+{
+    __m128i words = _mm_packs_epi32(weights, weights);
+    words = _mm_unpacklo_epi16(words, words);
+    *low = _mm_unpacklo_epi32(words, words);
+    *high = _mm_unpackhi_epi32(words, words);
+}
+
+// Bilinear blend of four RGBA texels per lane
+EZ_TARGET("sse2")
+static __m128i bilinearSse2(__m128i c00, __m128i c10, __m128i c01, __m128i c11, __m128i wx, __m128i wy)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i wxLow, wxHigh, wyLow, wyHigh, low, high;
+
+    spreadWeightsSse2(wx, &wxLow, &wxHigh);
+    spreadWeightsSse2(wy, &wyLow, &wyHigh);
+    low = lerpChannelsSse2(lerpChannelsSse2(_mm_unpacklo_epi8(c00, zero), _mm_unpacklo_epi8(c10, zero), wxLow),
+                           lerpChannelsSse2(_mm_unpacklo_epi8(c01, zero), _mm_unpacklo_epi8(c11, zero), wxLow),
+                           wyLow);
+    high = lerpChannelsSse2(lerpChannelsSse2(_mm_unpackhi_epi8(c00, zero), _mm_unpackhi_epi8(c10, zero), wxHigh),
+                            lerpChannelsSse2(_mm_unpackhi_epi8(c01, zero), _mm_unpackhi_epi8(c11, zero), wxHigh),
+                            wyHigh);
+    return _mm_packus_epi16(low, high);
+}
+
+// Multiplies each pixel's colour by its alpha, as blending over black does
+EZ_TARGET("sse2")
+static __m128i blendOverBlackSse2(__m128i color)
+{
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+    __m128i low = _mm_unpacklo_epi8(color, zero), high = _mm_unpackhi_epi8(color, zero);
+    __m128i alphaLow = _mm_shufflehi_epi16(_mm_shufflelo_epi16(low, 0xFF), 0xFF);
+    __m128i alphaHigh = _mm_shufflehi_epi16(_mm_shufflelo_epi16(high, 0xFF), 0xFF);
+
+    low = _mm_add_epi16(_mm_mullo_epi16(low, alphaLow), half);
+    high = _mm_add_epi16(_mm_mullo_epi16(high, alphaHigh), half);
+    low = _mm_srli_epi16(_mm_add_epi16(low, _mm_srli_epi16(low, 8)), 8);
+    high = _mm_srli_epi16(_mm_add_epi16(high, _mm_srli_epi16(high, 8)), 8);
+    return _mm_packus_epi16(low, high);
+}
+
+// floor of values well inside the int range
+EZ_TARGET("sse2")
+static __m128i floorSse2(__m128 v)
+{
+    __m128i truncated = _mm_cvttps_epi32(v);
+    return _mm_add_epi32(truncated, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(truncated), v)));
+}
+
+// Renders one output row four pixels at a time. The texel coordinates,
+// edge test, weights, filtering and blending are all done across the four
+// lanes, only the texel loads themselves are one at a time
+EZ_TARGET("sse2")
+static void renderRowSse2(const RenderJob *job, int y, unsigned char *out)
+{
+    const Pixmap *source = job->source;
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+    const __m128 dsdx = _mm_set1_ps(job->toTexel[0][0]), dtdx = _mm_set1_ps(job->toTexel[0][1]);
+    const __m128 rowS = _mm_set1_ps(job->toTexel[2][0] + y * job->toTexel[1][0]);
+    const __m128 rowT = _mm_set1_ps(job->toTexel[2][1] + y * job->toTexel[1][1]);
+    const __m128 sMax = _mm_set1_ps(job->sMax), tMax = _mm_set1_ps(job->tMax);
+    const __m128 lastX = _mm_set1_ps((float)(source->width - 1));
+    const __m128 lastY = _mm_set1_ps((float)(source->height - 1));
+    const __m128i maxX = _mm_set1_epi32(source->width - 1), maxY = _mm_set1_epi32(source->height - 1);
+    int alpha = source->channels == 2 || source->channels == 4;
+    int x, i, n, mask;
+    __m128 px, s, t, inside;
+    __m128i color, x0, y0, x1, y1, wx, wy;
+    int xs[8], ys[8];
+    unsigned int texels[16];
+
+    for (x = 0; x < job->width; x += 4)
+    {
+        n = job->width - x < 4 ? job->width - x : 4;
+        px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+        s = _mm_add_ps(rowS, _mm_mul_ps(px, dsdx));
+        t = _mm_add_ps(rowT, _mm_mul_ps(px, dtdx));
+        inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(s, zero), _mm_cmple_ps(s, sMax)),
+                            _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmple_ps(t, tMax)));
+        mask = _mm_movemask_ps(inside);
+        if (mask == 0)
+        {
+            memset(out + x * 3, 0, n * 3);
+            continue;
+        }
+
+        if (job->sampling == SAMPLE_NEAREST)
+        {
+            // Lanes off the quad are clamped so their loads stay in the image
+            x0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(s, zero), lastX));
+            y0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(t, zero), lastY));
+            _mm_storeu_si128((__m128i *)xs, x0);
+            _mm_storeu_si128((__m128i *)ys, y0);
+            for (i = 0; i < 4; i++)
+                texels[i] = mask >> i & 1 ? fetchTexel(source, xs[i], ys[i]) : 0;
+            color = _mm_loadu_si128((const __m128i *)texels);
+        }
+        else
+        {
+            // Clamping to the last texel only moves the weight between two
+            // loads of that same texel, so the colour does not change
+            s = _mm_min_ps(_mm_max_ps(_mm_sub_ps(s, half), _mm_set1_ps(-1)), lastX);
+            t = _mm_min_ps(_mm_max_ps(_mm_sub_ps(t, half), _mm_set1_ps(-1)), lastY);
+            x0 = floorSse2(s);
+            y0 = floorSse2(t);
+            wx = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(s, _mm_cvtepi32_ps(x0)), _mm_set1_ps(256)), half));
+            wy = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_sub_ps(t, _mm_cvtepi32_ps(y0)), _mm_set1_ps(256)), half));
+
+            // x1 = min(x0 + 1, last) and x0 = max(x0, 0), without SSE4.1
+            x1 = _mm_sub_epi32(x0, _mm_set1_epi32(-1));
+            y1 = _mm_sub_epi32(y0, _mm_set1_epi32(-1));
+            x1 = _mm_add_epi32(x1, _mm_cmpgt_epi32(x1, maxX));
+            y1 = _mm_add_epi32(y1, _mm_cmpgt_epi32(y1, maxY));
+            x0 = _mm_andnot_si128(_mm_srai_epi32(x0, 31), x0);
+            y0 = _mm_andnot_si128(_mm_srai_epi32(y0, 31), y0);
+            _mm_storeu_si128((__m128i *)xs, x0);
+            _mm_storeu_si128((__m128i *)(xs + 4), x1);
+            _mm_storeu_si128((__m128i *)ys, y0);
+            _mm_storeu_si128((__m128i *)(ys + 4), y1);
+            for (i = 0; i < 4; i++)
+            {
+                if (mask >> i & 1)
+                {
+                    texels[i] = fetchTexel(source, xs[i], ys[i]);
+                    texels[i + 4] = fetchTexel(source, xs[i + 4], ys[i]);
+                    texels[i + 8] = fetchTexel(source, xs[i], ys[i + 4]);
+                    texels[i + 12] = fetchTexel(source, xs[i + 4], ys[i + 4]);
+                }
+                else
+                    texels[i] = texels[i + 4] = texels[i + 8] = texels[i + 12] = 0;
+            }
+            color = bilinearSse2(_mm_loadu_si128((const __m128i *)texels),
+                                 _mm_loadu_si128((const __m128i *)(texels + 4)),
+                                 _mm_loadu_si128((const __m128i *)(texels + 8)),
+                                 _mm_loadu_si128((const __m128i *)(texels + 12)), wx, wy);
+        }
+
+        if (alpha)
+            color = blendOverBlackSse2(color);
+        color = _mm_and_si128(color, _mm_castps_si128(inside));
+
+        _mm_storeu_si128((__m128i *)texels, color);
+        for (i = 0; i < n; i++)
+        {
+            out[(x + i) * 3] = (unsigned char)texels[i];
+            out[(x + i) * 3 + 1] = (unsigned char)(texels[i] >> 8);
+            out[(x + i) * 3 + 2] = (unsigned char)(texels[i] >> 16);
+        }
+    }
+}
+
+#endif
+
+// Writes an RGBA colour to an RGB output pixel, blended over black if the
+// source has alpha
+static void storeTexel(unsigned char *out, unsigned int color, int alpha)
+{
+    int c;
+
+    for (c = 0; c < 3; c++)
+        out[c] = (unsigned char)(alpha ? blendChannel((color >> 8 * c) & 255, color >> 24) :
+                                 (color >> 8 * c) & 255);
+}
+
+// Samples at 16.16 coordinates (S, T), clamping to the edges. Only used for
+// the few pixels along the image's border, everything inside the border
+// goes through the walkers below
+static unsigned int sampleFixedClamped(const Pixmap *source, int sampling, long long S, long long T)
+{
+    long long x0, y0, x1, y1;
+    int wx, wy, c;
+    unsigned int c00, c10, c01, c11, color = 0;
+
+    if (sampling == SAMPLE_NEAREST)
+    {
+        x0 = S >> FIXED_SHIFT;
+        y0 = T >> FIXED_SHIFT;
+        return fetchTexel(source, (int)(x0 < source->width - 1 ? x0 : source->width - 1),
+                          (int)(y0 < source->height - 1 ? y0 : source->height - 1));
+    }
+
+    S -= FIXED_HALF;
+    T -= FIXED_HALF;
+    x0 = S >> FIXED_SHIFT;
+    y0 = T >> FIXED_SHIFT;
+    wx = (int)(S >> 8) & 255;
+    wy = (int)(T >> 8) & 255;
+    x1 = x0 + 1 < source->width - 1 ? x0 + 1 : source->width - 1;
+    y1 = y0 + 1 < source->height - 1 ? y0 + 1 : source->height - 1;
+    x0 = x0 > 0 ? x0 : 0;
+    y0 = y0 > 0 ? y0 : 0;
+    c00 = fetchTexel(source, (int)x0, (int)y0);
+    c10 = fetchTexel(source, (int)x1, (int)y0);
+    c01 = fetchTexel(source, (int)x0, (int)y1);
+    c11 = fetchTexel(source, (int)x1, (int)y1);
+    for (c = 0; c < 32; c += 8)
+        color |= lerpChannel(lerpChannel((c00 >> c) & 255, (c10 >> c) & 255, wx),
+                             lerpChannel((c01 >> c) & 255, (c11 >> c) & 255, wx), wy) << c;
+    return color;
+}
+
+// Narrows [*first, *last] to the pixels x whose s0 + x * ds falls in
+// [lo, hi]. Worked out in double, so it can be a pixel out either way;
+// tightenSpan settles that in fixed point
+static void clipSpan(double s0, double ds, double lo, double hi, int *first, int *last)
+{
+    double a, b, swap;
+
+    if (ds == 0)
+    {
+        if (s0 < lo || s0 > hi)
+            *last = *first - 1;
+        return;
+    }
+    a = (lo - s0) / ds;
+    b = (hi - s0) / ds;
+    if (a > b)
+    {
+        swap = a;
+        a = b;
+        b = swap;
+    }
+    a = ceil(a);
+    b = floor(b);
+    if (a > *first)
+        *first = a > *last + 1 ? *last + 1 : (int)a;
+    if (b < *last)
+        *last = b < *first - 1 ? *first - 1 : (int)b;
+}
+
+// Moves the ends of [*first, *last] inwards until S0 + x * dS is within
+// [lo, hi] at both. S is linear in x, so then it is at every pixel between
+// and the walkers need no bounds checks
+static void tightenSpan(long long S0, long long dS, long long lo, long long hi, int *first, int *last)
+{
+    while (*first <= *last && (S0 + *first * dS < lo || S0 + *first * dS > hi))
+        (*first)++;
+    while (*first <= *last && (S0 + *last * dS < lo || S0 + *last * dS > hi))
+        (*last)--;
+}
+
+// Nearest samples for count pixels from (S, T), all known to be inside
+static void walkNearest(const Pixmap *source, unsigned int S, unsigned int T, int dS, int dT,
+                        int count, unsigned char *out)
+{
+    size_t stride = (size_t)source->width * source->channels;
+    int channels = source->channels, alpha = channels == 2 || channels == 4;
+    const unsigned char *p;
+    int i;
+
+    if (channels == 3)
+    {
+        for (i = 0; i < count; i++, S += dS, T += dT, out += 3)
+        {
+            p = source->image + (T >> FIXED_SHIFT) * stride + (S >> FIXED_SHIFT) * 3;
+            out[0] = p[0];
+            out[1] = p[1];
+            out[2] = p[2];
+        }
+    }
+    else
+    {
+        for (i = 0; i < count; i++, S += dS, T += dT, out += 3)
+            storeTexel(out, loadTexel(source->image + (T >> FIXED_SHIFT) * stride +
+                                      (S >> FIXED_SHIFT) * channels, channels), alpha);
+    }
+}
+
+#ifdef EZ_X86
+
+// Bilinear samples for count pixels from (S, T) like walkBilinear, four at
+// a time. The four lanes' coordinates step with one add each, and the
+// weights, blending and alpha are done across the lanes. Returns how many
+// pixels it did, the last few are left over
+EZ_TARGET("sse2")
+static int walkBilinearSse2(const Pixmap *source, unsigned int S, unsigned int T, int dS, int dT,
+                            int count, unsigned char *out)
+{
+    size_t stride = (size_t)source->width * source->channels;
+    int channels = source->channels, alpha = channels == 2 || channels == 4;
+    const __m128i half = _mm_set1_epi32(FIXED_HALF), fraction = _mm_set1_epi32(255);
+    const __m128i stepS = _mm_set1_epi32((int)((unsigned int)dS * 4));
+    const __m128i stepT = _mm_set1_epi32((int)((unsigned int)dT * 4));
+    __m128i s = _mm_sub_epi32(_mm_setr_epi32((int)S, (int)(S + dS), (int)(S + 2 * dS), (int)(S + 3 * dS)), half);
+    __m128i t = _mm_sub_epi32(_mm_setr_epi32((int)T, (int)(T + dT), (int)(T + 2 * dT), (int)(T + 3 * dT)), half);
+    const unsigned char *p;
+    unsigned int texels[16];
+    int i, lane, xs[4], ys[4];
+    __m128i color;
+
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_si128((__m128i *)xs, _mm_srli_epi32(s, FIXED_SHIFT));
+        _mm_storeu_si128((__m128i *)ys, _mm_srli_epi32(t, FIXED_SHIFT));
+        for (lane = 0; lane < 4; lane++)
+        {
+            p = source->image + (size_t)ys[lane] * stride + (size_t)xs[lane] * channels;
+            texels[lane] = loadTexel(p, channels);
+            texels[lane + 4] = loadTexel(p + channels, channels);
+            texels[lane + 8] = loadTexel(p + stride, channels);
+            texels[lane + 12] = loadTexel(p + stride + channels, channels);
+        }
+        color = bilinearSse2(_mm_loadu_si128((const __m128i *)texels),
+                             _mm_loadu_si128((const __m128i *)(texels + 4)),
+                             _mm_loadu_si128((const __m128i *)(texels + 8)),
+                             _mm_loadu_si128((const __m128i *)(texels + 12)),
+                             _mm_and_si128(_mm_srli_epi32(s, 8), fraction),
+                             _mm_and_si128(_mm_srli_epi32(t, 8), fraction));
+        if (alpha)
+            color = blendOverBlackSse2(color);
+        _mm_storeu_si128((__m128i *)texels, color);
+        for (lane = 0; lane < 4; lane++, out += 3)
+        {
+            out[0] = (unsigned char)texels[lane];
+            out[1] = (unsigned char)(texels[lane] >> 8);
+            out[2] = (unsigned char)(texels[lane] >> 16);
+        }
+        s = _mm_add_epi32(s, stepS);
+        t = _mm_add_epi32(t, stepT);
+    }
+    return i;
+}
+
+#endif
+
+// Bilinear samples for count pixels from (S, T), all at least half a texel
+// inside so their four texels are too
+static void walkBilinear(const Pixmap *source, unsigned int S, unsigned int T, int dS, int dT,
+                         int count, unsigned char *out)
+{
+    int alpha = source->channels == 2 || source->channels == 4;
+    int i = 0;
+
+#ifdef EZ_X86
+    i = walkBilinearSse2(source, S, T, dS, dT, count, out);
+    S += (unsigned int)i * dS;
+    T += (unsigned int)i * dT;
+    out += i * 3;
+#endif
+    for (; i < count; i++, S += dS, T += dT, out += 3)
+        storeTexel(out, sampleFixedClamped(source, SAMPLE_BILINEAR, S, T), alpha);
+}
+
+// Renders one output row by walking 16.16 coordinates along it. The row is
+// first clipped to the quad, everything outside is black. Bilinear rows are
+// clipped again to where all four texels are inside the image, and only
+// the pixels between the two clips need clamping
+static void renderRowFixed(const RenderJob *job, int y, unsigned char *out)
+{
+    const Pixmap *source = job->source;
+    double s0 = job->toTexel[2][0] + (double)y * job->toTexel[1][0], ds = job->toTexel[0][0];
+    double t0 = job->toTexel[2][1] + (double)y * job->toTexel[1][1], dt = job->toTexel[0][1];
+    long long S0 = (long long)floor(s0 * FIXED_ONE + 0.5), T0 = (long long)floor(t0 * FIXED_ONE + 0.5);
+    int dS = (int)floor(ds * FIXED_ONE + 0.5), dT = (int)floor(dt * FIXED_ONE + 0.5);
+    long long sMax = (long long)(job->sMax * FIXED_ONE), tMax = (long long)(job->tMax * FIXED_ONE);
+    int alpha = source->channels == 2 || source->channels == 4;
+    int first = 0, last = job->width - 1, inFirst, inLast, x;
+
+    // The quad
+    clipSpan(s0, ds, 0, job->sMax, &first, &last);
+    clipSpan(t0, dt, 0, job->tMax, &first, &last);
+    tightenSpan(S0, dS, 0, sMax, &first, &last);
+    tightenSpan(T0, dT, 0, tMax, &first, &last);
+    if (first > last)
+    {
+        memset(out, 0, (size_t)job->width * 3);
+        return;
+    }
+    memset(out, 0, (size_t)first * 3);
+    memset(out + (size_t)(last + 1) * 3, 0, (size_t)(job->width - 1 - last) * 3);
+
+    if (job->sampling == SAMPLE_NEAREST)
+    {
+        walkNearest(source, (unsigned int)(S0 + first * (long long)dS), (unsigned int)(T0 + first * (long long)dT),
+                    dS, dT, last - first + 1, out + (size_t)first * 3);
+        return;
+    }
+
+    // Where x0 = (S - half) >> 16 is at least 0 and x0 + 1 at most the last column
+    inFirst = first;
+    inLast = last;
+    clipSpan(s0, ds, 0.5, source->width - 0.5, &inFirst, &inLast);
+    clipSpan(t0, dt, 0.5, source->height - 0.5, &inFirst, &inLast);
+    tightenSpan(S0, dS, FIXED_HALF, (long long)(source->width - 1) * FIXED_ONE + FIXED_HALF - 1, &inFirst, &inLast);
+    tightenSpan(T0, dT, FIXED_HALF, (long long)(source->height - 1) * FIXED_ONE + FIXED_HALF - 1, &inFirst, &inLast);
+    if (inFirst > inLast)
+    {
+        inFirst = last + 1;
+        inLast = last;
+    }
+
+    for (x = first; x < inFirst; x++)
+        storeTexel(out + (size_t)x * 3, sampleFixedClamped(source, SAMPLE_BILINEAR, S0 + x * (long long)dS,
+                                                           T0 + x * (long long)dT), alpha);
+    if (inFirst <= inLast)
+        walkBilinear(source, (unsigned int)(S0 + inFirst * (long long)dS), (unsigned int)(T0 + inFirst * (long long)dT),
+                     dS, dT, inLast - inFirst + 1, out + (size_t)inFirst * 3);
+    for (x = inLast + 1; x <= last; x++)
+        storeTexel(out + (size_t)x * 3, sampleFixedClamped(source, SAMPLE_BILINEAR, S0 + x * (long long)dS,
+                                                           T0 + x * (long long)dT), alpha);
+}
+
+static void renderWorker(void *context, int index)
+{
+    RenderJob *job = (RenderJob *)context;
+    long band;
+    int y, last;
+
+    while ((band = atomicIncrement(&job->nextBand) - 1) * RENDER_BAND_ROWS < job->height)
+    {
+        y = (int)band * RENDER_BAND_ROWS;
+        last = y + RENDER_BAND_ROWS < job->height ? y + RENDER_BAND_ROWS : job->height;
+        for (; y < last; y++)
+        {
+            if (job->walker == WALK_FIXED)
+                renderRowFixed(job, y, job->pixels + (size_t)y * job->width * 3);
+            else
+#ifdef EZ_X86
+                renderRowSse2(job, y, job->pixels + (size_t)y * job->width * 3);
+#else
+                renderRowScalar(job, y, job->pixels + (size_t)y * job->width * 3);
+#endif
+        }
+    }
+}
+
+// Output pixel centres to clip space, clip space to the image quad with
+// inverse, and the quad to texels the way vertexes maps it. *sMax and
+// *tMax get the far edges of the quad in texels, the near ones are 0
+static void viewToTexel(const Pixmap *source, mat2x3 inverse, int width, int height, mat2x3 toTexel,
+                        float *sMax, float *tMax)
+{
+    mat2x3 toNdc, toQuad, quadToTexel;
+
+    toNdc[0][0] = 2.0f / width;  toNdc[0][1] = 0;
+    toNdc[1][0] = 0;             toNdc[1][1] = -2.0f / height;
+    toNdc[2][0] = 1.0f / width - 1;
+    toNdc[2][1] = 1 - 1.0f / height;
+    *sMax = vertexes[0].TexCoord[0] * source->width;
+    *tMax = vertexes[0].TexCoord[1] * source->height;
+    mat2x3_scale(quadToTexel, *sMax / 2, -*tMax / 2);
+    quadToTexel[2][0] = *sMax / 2;
+    quadToTexel[2][1] = *tMax / 2;
+    mat2x3_mul(toQuad, inverse, toNdc);
+    mat2x3_mul(toTexel, quadToTexel, toQuad);
+}
+
+// Renders source into width by height RGB pixels, the same as a window of
+// that size would show it through the view whose inverse is given: either
+// viewInverse, or turnedInverse for a copy turned by quarterTurns. Bands of rows
+// are shared out over the cores. WALK_FIXED falls back to WALK_FLOAT when
+// the source or the view does not fit 16.16
+static void renderView(const Pixmap *source, mat2x3 inverse, int width, int height, int sampling,
+                       int walker, unsigned char *pixels)
+{
+    RenderJob job;
+    int workers;
+
+    // A view flattened onto a line covers no pixels
+    if (!viewInvertible)
+    {
+        memset(pixels, 0, (size_t)width * height * 3);
+        return;
+    }
+
+    viewToTexel(source, inverse, width, height, job.toTexel, &job.sMax, &job.tMax);
+    job.source = source;
+    job.pixels = pixels;
+    job.width = width;
+    job.height = height;
+    job.sampling = sampling;
+    job.walker = walker;
+    if (source->width > FIXED_MAX_SIZE || source->height > FIXED_MAX_SIZE ||
+        fabsf(job.toTexel[0][0]) > FIXED_MAX_STEP || fabsf(job.toTexel[0][1]) > FIXED_MAX_STEP)
+        job.walker = WALK_FLOAT;
+    job.nextBand = 0;
+
+    workers = cpuCount();
+    if (workers > (height + RENDER_BAND_ROWS - 1) / RENDER_BAND_ROWS)
+        workers = (height + RENDER_BAND_ROWS - 1) / RENDER_BAND_ROWS;
+    runWorkers(workers, renderWorker, &job);
+}
+
+// The three pass engine. Like Paeth's three shear rotation, the view's map
+// from texels (s, t) to output pixels (x, y) is split into
+//
+//   pass 1, along rows:     u = a * s + b * t
+//   pass 2, along columns:  y = c * u + d * t + g2
+//   pass 3, along rows:     x = u + e * y + g3
+//
+// with e chosen so that a and d come out the same size. For a plain
+// rotation they are both 1 and every pass is a subpixel shift, other views
+// scale in the first two passes as well. Each pass filters in one
+// direction only, linear or nearest, along lines that lie in order in
+// memory: pass 1 writes its output turned over, a column to a line, so
+// that pass 2 runs along lines too, and pass 2 turns its output back.
+// The turning over is done through a small block in cache, SHEAR_BLOCK
+// lines at a time. The images between the passes hold RGB premultiplied
+// by alpha, one 32 bit word to a pixel, so the filters never need to know
+// the source's format. The first two passes carry the edge texels
+// outwards and the last blacks out whatever is off the image quad, so the
+// edges are as sharp as the warp's. Three passes of linear filtering are
+// not the same filter as one bilinear tap though, and the two engines only
+// agree closely where the image is smooth: on photographs 99 in 100
+// samples are within a level of the warp's, but sharp edges inside the
+// image can differ by tens of levels, and on noise most samples differ by
+// more than 8. -selftest holds the engine to the first of these
+
+// Views whose images between the passes would hold more than this many
+// times the source and output pixels together, ones close to flat, are
+// left to the warp
+#define SHEAR_MAX_GROWTH 4
+
+// Lines are handed out to the workers, and turned over, this many at a time
+#define SHEAR_BLOCK 16
+
+typedef struct ShearJob
+{
+    const Pixmap *source;
+    unsigned char *pixels;      // width * height RGB, top row first
+    int width, height;
+    int pass;                   // 1, 2 or 3
+    unsigned int weightMask;    // 255 for linear, 0 always takes the nearer texel
+    double a, b, c, d, e, g2, g3;
+    mat2x3 toTexel;             // output pixel to source texel coordinates, for the quad's edges
+    float sMax, tMax;           // the far edges of the quad in texels
+    double u0;                  // u at the first column of both images
+    int across;                 // how many columns they have
+    int firstRow, rows;         // the source rows pass 1 keeps
+    unsigned int *columns;      // pass 1 output, a column to a line of rows + 2 with the edge texels repeated
+    unsigned int *rowImage;     // pass 2 output, height rows of across
+    unsigned int *scratch;      // a block of lines and one more line for each worker
+    size_t scratchLength;
+    volatile long nextBand;
+} ShearJob;
+
+// Samples count pixels along a line of 32 bit pixels. Pixel k blends the
+// words at i and i + 1, where i is the integer part of P + k * dP and the
+// weight is the top 8 bits of its fraction, masked by weightMask
+static void sampleLineScalar(const unsigned int *line, unsigned int P, int dP, unsigned int weightMask, int count,
+                             unsigned int *out)
+{
+    const unsigned int *q;
+    unsigned int color;
+    int k, c, w;
+
+    for (k = 0; k < count; k++, P += dP)
+    {
+        q = line + (P >> FIXED_SHIFT);
+        w = (int)((P >> 8) & weightMask);
+        color = 0;
+        for (c = 0; c < 24; c += 8)
+            color |= lerpChannel((q[0] >> c) & 255, (q[1] >> c) & 255, w) << c;
+        out[k] = color;
+    }
+}
+
+#ifdef EZ_X86
+
+// sampleLineScalar four pixels at a time. A step of one whole word is a
+// plain shift with one weight for the whole line. Otherwise, when the four
+// lanes' words are side by side, as they are for steps close to one, they
+// come in with two loads instead of eight. Returns how many pixels it did,
+// the last few are left over
+EZ_TARGET("sse2")
+static int sampleLineSse2(const unsigned int *line, unsigned int P, int dP, unsigned int weightMask, int count,
+                          unsigned int *out)
+{
+    const __m128i zero = _mm_setzero_si128(), mask = _mm_set1_epi32((int)weightMask);
+    const __m128i step = _mm_set1_epi32((int)((unsigned int)dP * 4));
+    __m128i p = _mm_setr_epi32((int)P, (int)(P + dP), (int)(P + 2 * dP), (int)(P + 3 * dP));
+    __m128i near, far, wLow, wHigh, low, high;
+    unsigned int index[4], nearWords[4], farWords[4];
+    const unsigned int *q;
+    int k, lane;
+
+    if (dP == FIXED_ONE)
+    {
+        spreadWeightsSse2(_mm_set1_epi32((int)((P >> 8) & weightMask)), &wLow, &wHigh);
+        q = line + (P >> FIXED_SHIFT);
+        for (k = 0; k + 4 <= count; k += 4)
+        {
+            near = _mm_loadu_si128((const __m128i *)(q + k));
+            far = _mm_loadu_si128((const __m128i *)(q + k + 1));
+            low = lerpChannelsSse2(_mm_unpacklo_epi8(near, zero), _mm_unpacklo_epi8(far, zero), wLow);
+            high = lerpChannelsSse2(_mm_unpackhi_epi8(near, zero), _mm_unpackhi_epi8(far, zero), wHigh);
+            _mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(low, high));
+        }
+        return k;
+    }
+
+    for (k = 0; k + 4 <= count; k += 4)
+    {
+        _mm_storeu_si128((__m128i *)index, _mm_srli_epi32(p, FIXED_SHIFT));
+        if (index[3] - index[0] == 3)
+        {
+            near = _mm_loadu_si128((const __m128i *)(line + index[0]));
+            far = _mm_loadu_si128((const __m128i *)(line + index[0] + 1));
+        }
+        else
+        {
+            for (lane = 0; lane < 4; lane++)
+            {
+                nearWords[lane] = line[index[lane]];
+                farWords[lane] = line[index[lane] + 1];
+            }
+            near = _mm_loadu_si128((const __m128i *)nearWords);
+            far = _mm_loadu_si128((const __m128i *)farWords);
+        }
+        spreadWeightsSse2(_mm_and_si128(_mm_srli_epi32(p, 8), mask), &wLow, &wHigh);
+        low = lerpChannelsSse2(_mm_unpacklo_epi8(near, zero), _mm_unpacklo_epi8(far, zero), wLow);
+        high = lerpChannelsSse2(_mm_unpackhi_epi8(near, zero), _mm_unpackhi_epi8(far, zero), wHigh);
+        _mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(low, high));
+        p = _mm_add_epi32(p, step);
+    }
+    return k;
+}
+
+// transposeWords on whole 4 by 4 tiles. Each group of four columns goes
+// down all the rows before moving on, so every line of dst it writes gets
+// rows words in a row
+EZ_TARGET("sse2")
+static void transposeWordsSse2(const unsigned int *src, size_t srcPitch, int rows, int count, unsigned int *dst,
+                               size_t dstPitch)
+{
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+    const unsigned int *from;
+    unsigned int *to;
+    int i, j;
+
+    for (j = 0; j + 4 <= count; j += 4)
+    {
+        for (i = 0; i + 4 <= rows; i += 4)
+        {
+            from = src + (size_t)i * srcPitch + j;
+            to = dst + (size_t)j * dstPitch + i;
+            r0 = _mm_loadu_si128((const __m128i *)from);
+            r1 = _mm_loadu_si128((const __m128i *)(from + srcPitch));
+            r2 = _mm_loadu_si128((const __m128i *)(from + 2 * srcPitch));
+            r3 = _mm_loadu_si128((const __m128i *)(from + 3 * srcPitch));
+            t0 = _mm_unpacklo_epi32(r0, r1);
+            t1 = _mm_unpacklo_epi32(r2, r3);
+            t2 = _mm_unpackhi_epi32(r0, r1);
+            t3 = _mm_unpackhi_epi32(r2, r3);
+            _mm_storeu_si128((__m128i *)to, _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *)(to + dstPitch), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *)(to + 2 * dstPitch), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i *)(to + 3 * dstPitch), _mm_unpackhi_epi64(t2, t3));
+        }
+    }
+}
+
+#endif
+
+static void sampleLine(const unsigned int *line, unsigned int P, int dP, unsigned int weightMask, int count,
+                       unsigned int *out)
+{
+    int k = 0;
+
+#ifdef EZ_X86
+    k = sampleLineSse2(line, P, dP, weightMask, count, out);
+    P += (unsigned int)k * dP;
+#endif
+    sampleLineScalar(line, P, dP, weightMask, count - k, out + k);
+}
+
+// Copies rows lines of count words at src, srcPitch words apart, to dst
+// turned over its diagonal: word j of line i lands at dst[j * dstPitch + i]
+static void transposeWords(const unsigned int *src, size_t srcPitch, int rows, int count, unsigned int *dst,
+                           size_t dstPitch)
+{
+    int tiledRows = 0, tiledCount = 0, i, j;
+
+#ifdef EZ_X86
+    tiledRows = rows / 4 * 4;
+    tiledCount = count / 4 * 4;
+    transposeWordsSse2(src, srcPitch, tiledRows, tiledCount, dst, dstPitch);
+#endif
+    for (i = 0; i < rows; i++)
+        for (j = i < tiledRows ? tiledCount : 0; j < count; j++)
+            dst[(size_t)j * dstPitch + i] = src[(size_t)i * srcPitch + j];
+}
+
+// Where along a line the 16.16 positions P0 + k * dP fall in [lo, hi], for
+// s0 + k * ds the same positions in double. [*first, *last] is left empty
+// if none do
+static void shearSpan(double s0, double ds, double sLo, double sHi, long long P0, int dP, long long lo,
+                      long long hi, int count, int *first, int *last)
+{
+    *first = 0;
+    *last = count - 1;
+    clipSpan(s0, ds, sLo, sHi, first, last);
+    tightenSpan(P0, dP, lo, hi, first, last);
+}
+
+// The pixels of a line outside [first, last] get the sample at lo or hi,
+// whichever their position is nearer, which carries the edge outwards the
+// way clamping does. (Nearer rather than past, as the span's ends were
+// found in double and a pixel just outside one can still be at it in
+// fixed point)
+static void carryEdges(const unsigned int *line, long long P0, int dP, long long lo, long long hi,
+                       unsigned int weightMask, int count, int first, int last, unsigned int *out)
+{
+    long long middle = lo + (hi - lo) / 2;
+    unsigned int low, high;
+    int k;
+
+    sampleLineScalar(line, (unsigned int)lo, 0, weightMask, 1, &low);
+    sampleLineScalar(line, (unsigned int)hi, 0, weightMask, 1, &high);
+    for (k = 0; k < count; k++)
+    {
+        if (k == first)
+            k = last + 1;
+        if (k < count)
+            out[k] = P0 + k * (long long)dP < middle ? low : high;
+    }
+}
+
+// Pass 1 for source row firstRow + r, into out. The row is first copied
+// to line as premultiplied words with its end texels repeated once on
+// either side, which is the clamping the warp does at the edges
+static void shearRow(ShearJob *job, int r, unsigned int *line, unsigned int *out)
+{
+    const Pixmap *source = job->source;
+    int channels = source->channels, alpha = channels == 2 || channels == 4;
+    const unsigned char *p = source->image + (size_t)(job->firstRow + r) * source->width * channels;
+    double t = job->firstRow + r + 0.5, s0 = (job->u0 - job->b * t) / job->a, ds = 1 / job->a;
+    double offset = job->weightMask ? 0.5 : 1;
+    long long P0 = (long long)floor((s0 + offset) * FIXED_ONE + 0.5), lo = (long long)(offset * FIXED_ONE);
+    long long hi = (long long)(job->sMax * FIXED_ONE) + lo;
+    int dP = (int)floor(ds * FIXED_ONE + 0.5), first, last, x, c;
+    unsigned int color;
+
+    if (channels == 3)
+        for (x = 1; x <= source->width; x++, p += 3)
+            line[x] = p[0] | p[1] << 8 | p[2] << 16;
+    else
+    {
+        for (x = 1; x <= source->width; x++, p += channels)
+        {
+            color = loadTexel(p, channels);
+            line[x] = 0;
+            for (c = 0; c < 24; c += 8)
+                line[x] |= (alpha ? blendChannel((color >> c) & 255, color >> 24) : (color >> c) & 255) << c;
+        }
+    }
+    line[0] = line[1];
+    line[source->width + 1] = line[source->width];
+
+    shearSpan(s0, ds, 0, job->sMax, P0, dP, lo, hi, job->across, &first, &last);
+    carryEdges(line, P0, dP, lo, hi, job->weightMask, job->across, first, last, out);
+    if (first <= last)
+        sampleLine(line, (unsigned int)(P0 + first * (long long)dP), dP, job->weightMask, last - first + 1,
+                   out + first);
+}
+
+// Pass 2 for column k, from its line of columns into out, height long
+static void shearColumn(ShearJob *job, int k, unsigned int *out)
+{
+    unsigned int *line = job->columns + (size_t)k * (job->rows + 2);
+    double dt = 1 / job->d, t0 = (-job->c * (job->u0 + k) - job->g2) / job->d;
+    double offset = (job->weightMask ? 0.5 : 1) - job->firstRow;
+    long long P0 = (long long)floor((t0 + offset) * FIXED_ONE + 0.5);
+    long long start = (long long)floor(offset * FIXED_ONE + 0.5), lo = start > 0 ? start : 0;
+    long long hi = (long long)(job->tMax * FIXED_ONE) + start;
+    int dP = (int)floor(dt * FIXED_ONE + 0.5), first, last;
+
+    line[0] = line[1];
+    line[job->rows + 1] = line[job->rows];
+
+    // The two texels a pixel blends must both be on the line, copies included
+    if (hi > (long long)(job->rows + 1) * FIXED_ONE - 1)
+        hi = (long long)(job->rows + 1) * FIXED_ONE - 1;
+    shearSpan(t0 + offset, dt, lo / (double)FIXED_ONE, hi / (double)FIXED_ONE, P0, dP, lo, hi, job->height,
+              &first, &last);
+    carryEdges(line, P0, dP, lo, hi, job->weightMask, job->height, first, last, out);
+    if (first <= last)
+        sampleLine(line, (unsigned int)(P0 + first * (long long)dP), dP, job->weightMask, last - first + 1,
+                   out + first);
+}
+
+// Pass 3 for output row y, a pure shift along the row. The row is clipped
+// to the image quad the same way renderRowFixed does it, everything off
+// the quad is black
+static void shearOutputRow(ShearJob *job, int y, unsigned int *line)
+{
+    unsigned char *out = job->pixels + (size_t)y * job->width * 3;
+    double s0 = job->toTexel[2][0] + (double)y * job->toTexel[1][0], ds = job->toTexel[0][0];
+    double t0 = job->toTexel[2][1] + (double)y * job->toTexel[1][1], dt = job->toTexel[0][1];
+    long long S0 = (long long)floor(s0 * FIXED_ONE + 0.5), T0 = (long long)floor(t0 * FIXED_ONE + 0.5);
+    int dS = (int)floor(ds * FIXED_ONE + 0.5), dT = (int)floor(dt * FIXED_ONE + 0.5);
+    double p0 = -job->e * y - job->g3 - job->u0 + (job->weightMask ? 0 : 0.5);
+    long long P0 = (long long)floor(p0 * FIXED_ONE + 0.5);
+    int first = 0, last = job->width - 1, x;
+
+    clipSpan(s0, ds, 0, job->sMax, &first, &last);
+    clipSpan(t0, dt, 0, job->tMax, &first, &last);
+    tightenSpan(S0, dS, 0, (long long)(job->sMax * FIXED_ONE), &first, &last);
+    tightenSpan(T0, dT, 0, (long long)(job->tMax * FIXED_ONE), &first, &last);
+
+    // Both columns a pixel blends must be in the image. They always are on
+    // the quad, planShear leaves a column to spare
+    clipSpan(p0, 1, 0, job->across - 1, &first, &last);
+    tightenSpan(P0, FIXED_ONE, 0, (long long)(job->across - 1) * FIXED_ONE - 1, &first, &last);
+    if (first > last)
+    {
+        memset(out, 0, (size_t)job->width * 3);
+        return;
+    }
+    memset(out, 0, (size_t)first * 3);
+    memset(out + (size_t)(last + 1) * 3, 0, (size_t)(job->width - 1 - last) * 3);
+    sampleLine(job->rowImage + (size_t)y * job->across, (unsigned int)(P0 + first * (long long)FIXED_ONE), FIXED_ONE,
+               job->weightMask, last - first + 1, line);
+    for (x = first, out += (size_t)first * 3; x <= last; x++, out += 3)
+    {
+        out[0] = (unsigned char)line[x - first];
+        out[1] = (unsigned char)(line[x - first] >> 8);
+        out[2] = (unsigned char)(line[x - first] >> 16);
+    }
+}
+
+// Passes 1 and 2 fill a block of lines and turn it over into the next
+// image, pass 3 goes straight to the output
+static void shearWorker(void *context, int index)
+{
+    ShearJob *job = (ShearJob *)context;
+    unsigned int *block = job->scratch + (size_t)index * job->scratchLength;
+    int lines = job->pass == 1 ? job->rows : job->pass == 2 ? job->across : job->height;
+    long band;
+    int i, first, last;
+
+    while ((band = atomicIncrement(&job->nextBand) - 1) * SHEAR_BLOCK < lines)
+    {
+        first = (int)band * SHEAR_BLOCK;
+        last = first + SHEAR_BLOCK < lines ? first + SHEAR_BLOCK : lines;
+        if (job->pass == 1)
+        {
+            for (i = first; i < last; i++)
+                shearRow(job, i, block + (size_t)SHEAR_BLOCK * job->across, block + (size_t)(i - first) * job->across);
+            transposeWords(block, job->across, last - first, job->across, job->columns + first + 1, job->rows + 2);
+        }
+        else if (job->pass == 2)
+        {
+            for (i = first; i < last; i++)
+                shearColumn(job, i, block + (size_t)(i - first) * job->height);
+            transposeWords(block, job->height, last - first, job->height, job->rowImage + first, job->across);
+        }
+        else
+            for (i = first; i < last; i++)
+                shearOutputRow(job, i, block);
+    }
+}
+
+// Splits the view into the three passes and works out which columns and
+// source rows the images between them need. Returns 0 if the view is too
+// close to flat for the passes to be worth it, or too big for 16.16
+static int planShear(ShearJob *job, const Pixmap *source, mat2x3 inverse, int width, int height)
+{
+    double m00, m01, m10, m11, ox, oy, det, size, u, t, uLow, uHigh, tLow, tHigh, needLow, needHigh, phase;
+    int corner;
+
+    if (source->width + 2 > FIXED_MAX_SIZE || source->height + 2 > FIXED_MAX_SIZE)
+        return 0;
+
+    // The view's map from texels to output pixels, which is the inverse of
+    // the warp's map from output pixels to texels
+    viewToTexel(source, inverse, width, height, job->toTexel, &job->sMax, &job->tMax);
+    det = (double)job->toTexel[0][0] * job->toTexel[1][1] - (double)job->toTexel[1][0] * job->toTexel[0][1];
+    if (det == 0)
+        return 0;
+    m00 = job->toTexel[1][1] / det;
+    m01 = -job->toTexel[1][0] / det;
+    m10 = -job->toTexel[0][1] / det;
+    m11 = job->toTexel[0][0] / det;
+    ox = -(m00 * job->toTexel[2][0] + m01 * job->toTexel[2][1]);
+    oy = -(m10 * job->toTexel[2][0] + m11 * job->toTexel[2][1]);
+
+    // Any e splits the view exactly as long as a = m00 - e * m10. Paeth's
+    // choice makes a the square root of the determinant, with the sign of
+    // m00 so that views past a quarter turn flip instead of shearing further.
+    // (m00 - a) / m10 is worked out as (m00 * m00 - a * a) / (m10 * (m00 + a))
+    // to keep it from cancelling to noise near no turn or a half turn. Views
+    // that barely move s into y, or would need a steeper shear than a
+    // quarter turn does, are split with no e at all
+    det = m00 * m11 - m01 * m10;
+    size = sqrt(fabs(det));
+    job->e = 0;
+    if (fabs(m10) > 1e-4 * size)
+    {
+        job->a = m00 < 0 ? -size : size;
+        job->e = (det > 0 ? m00 * (m00 - m11) + m01 * m10 : m00 * (m00 + m11) - m01 * m10) /
+                 (m10 * (m00 + job->a));
+        if (fabs(job->e) > 1 && fabs(m00) > 0.25 * size)
+            job->e = 0;
+    }
+    job->a = m00 - job->e * m10;
+    job->b = m01 - job->e * m11;
+    job->c = m10 / job->a;
+    job->d = det / job->a;
+    job->g2 = oy;
+    job->g3 = ox - job->e * oy;
+    if (fabs(1 / job->a) > FIXED_MAX_STEP || fabs(1 / job->d) > FIXED_MAX_STEP ||
+        fabs(job->c / job->d) > FIXED_MAX_STEP)
+        return 0;
+
+    // Columns with anything in them, narrowed to the ones pass 3 reaches,
+    // with one to spare on either side. They are placed a whole number of
+    // pixels from the output's, so without a shear pass 3 just copies
+    uLow = needLow = 1e30;
+    uHigh = needHigh = -1e30;
+    for (corner = 0; corner < 4; corner++)
+    {
+        u = job->a * (corner & 1 ? job->sMax : 0) + job->b * (corner & 2 ? job->tMax : 0);
+        uLow = u < uLow ? u : uLow;
+        uHigh = u > uHigh ? u : uHigh;
+        u = (corner & 1 ? width - 1 : 0) - job->e * (corner & 2 ? height - 1 : 0) - job->g3;
+        needLow = u < needLow ? u : needLow;
+        needHigh = u > needHigh ? u : needHigh;
+    }
+    uLow = (uLow > needLow ? uLow : needLow) - 1;
+    uHigh = (uHigh < needHigh ? uHigh : needHigh) + 1;
+    job->across = 0;
+    job->rows = 0;
+    if (uLow > uHigh)
+        return 1;
+    if (uHigh - uLow > FIXED_MAX_SIZE - 4)
+        return 0;
+    phase = -job->g3 - floor(-job->g3);
+    job->u0 = floor(uLow - phase) + phase;
+    job->across = (int)ceil(uHigh - job->u0) + 1;
+
+    // Source rows pass 2 reaches from those columns, with one to spare
+    tLow = 1e30;
+    tHigh = -1e30;
+    for (corner = 0; corner < 4; corner++)
+    {
+        t = ((corner & 2 ? height - 1 : 0) - job->c * (corner & 1 ? job->u0 + job->across - 1 : job->u0) -
+             job->g2) / job->d;
+        tLow = t < tLow ? t : tLow;
+        tHigh = t > tHigh ? t : tHigh;
+    }
+    tLow = tLow > 0 ? tLow : 0;
+    tHigh = tHigh < source->height ? tHigh : source->height;
+    if (tLow > tHigh)
+        return 1;
+    job->firstRow = (int)floor(tLow - 0.5) - 1;
+    job->firstRow = job->firstRow > 0 ? job->firstRow : 0;
+    job->rows = (int)ceil(tHigh) + 1;
+    job->rows = (job->rows < source->height - 1 ? job->rows : source->height - 1) - job->firstRow + 1;
+
+    return (double)job->across * (job->rows + 2 + height) <=
+           SHEAR_MAX_GROWTH * ((double)source->width * source->height + (double)width * height);
+}
+
+// Renders the same view as renderView with the three passes. Returns 0,
+// having drawn nothing, if the view is one planShear turns down or the
+// images between the passes do not fit in memory, so the caller can warp
+// instead
+static int renderSheared(const Pixmap *source, mat2x3 inverse, int width, int height, int sampling,
+                         unsigned char *pixels)
+{
+    ShearJob job;
+    int workers = cpuCount(), lines;
+
+    if (!viewInvertible)
+    {
+        memset(pixels, 0, (size_t)width * height * 3);
+        return 1;
+    }
+    if (!planShear(&job, source, inverse, width, height))
+        return 0;
+    if (job.across == 0 || job.rows == 0)
+    {
+        memset(pixels, 0, (size_t)width * height * 3);
+        return 1;
+    }
+
+    job.source = source;
+    job.pixels = pixels;
+    job.width = width;
+    job.height = height;
+    job.weightMask = sampling == SAMPLE_BILINEAR ? 255 : 0;
+    job.scratchLength = (size_t)SHEAR_BLOCK * (job.across > height ? job.across : height) +
+                        (source->width + 2 > width ? source->width + 2 : width);
+    job.columns = (unsigned int *)malloc((size_t)job.across * (job.rows + 2) * 4);
+    job.rowImage = (unsigned int *)malloc((size_t)height * job.across * 4);
+    job.scratch = (unsigned int *)malloc((size_t)workers * job.scratchLength * 4);
+    if (!job.columns || !job.rowImage || !job.scratch)
+    {
+        free(job.columns);
+        free(job.rowImage);
+        free(job.scratch);
+        return 0;
+    }
+
+    for (job.pass = 1; job.pass <= 3; job.pass++)
+    {
+        lines = job.pass == 1 ? job.rows : job.pass == 2 ? job.across : height;
+        job.nextBand = 0;
+        runWorkers(workers < (lines + SHEAR_BLOCK - 1) / SHEAR_BLOCK ? workers : (lines + SHEAR_BLOCK - 1) / SHEAR_BLOCK,
+                   shearWorker, &job);
+    }
+
+    free(job.columns);
+    free(job.rowImage);
+    free(job.scratch);
+    return 1;
+}
+
+// The resampler behind -sample bicubic and lanczos, and behind -export
+// with -size. It resizes in two passes, first every row to the new width
+// and then every column to the new height, each output pixel taking a
+// weighted sum of the source pixels under the filter. The weights depend
+// only on the output pixel's place along its axis, so they are worked out
+// once per axis before any pixel is touched. When shrinking, the filter is
+// stretched to cover every source pixel that falls under an output one,
+// which is what keeps small previews from aliasing. Bands of output rows
+// are shared out over the cores, each worker resizes the rows its band
+// reads into a buffer of its own and then runs down that buffer while it
+// is still in cache. Channels are filtered independently, alpha included,
+// the same as the mipmaps
+
+// Weights are fixed point with this many fraction bits and, for every
+// output pixel, add up to exactly RESIZE_ONE
+#define RESIZE_SHIFT 14
+#define RESIZE_ONE (1 << RESIZE_SHIFT)
+
+// Output rows are handed out to the workers in bands of this many
+#define RESIZE_BAND_ROWS 32
+
+// How far the filter for each sampling mode reaches either side, in source
+// pixels when not shrinking: a box, a tent, Catmull-Rom and Lanczos 3
+static const double resizeSupport[] = { 0.5, 1, 2, 3 };
+
+typedef struct ResizeAxis
+{
+    int *first;                 // the first source pixel each output pixel reads
+    short *weights;             // taps weights for each output pixel, RESIZE_ONE in total
+    int taps;                   // how many source pixels in a row each output pixel reads
+} ResizeAxis;
+
+typedef struct ResizeJob
+{
+    const Pixmap *source;
+    Pixmap *out;
+    ResizeAxis across, down;
+    unsigned char *scratch;     // each worker's rows resized across, scratchRows of them
+    const unsigned char **rows; // each worker's pointers to the rows one output row reads
+    int scratchRows;
+    volatile long nextBand;
+} ResizeJob;
+
+// The filter for sampling at distance x, in source pixels unstretched
+static double resizeKernel(int sampling, double x)
+{
+    x = fabs(x);
+    switch (sampling)
+    {
+    case SAMPLE_NEAREST:
+        return x <= 0.5 ? 1 : 0;
+    case SAMPLE_BILINEAR:
+        return x < 1 ? 1 - x : 0;
+    case SAMPLE_BICUBIC:
+        if (x < 1)
+            return (1.5 * x - 2.5) * x * x + 1;
+        return x < 2 ? ((-0.5 * x + 2.5) * x - 4) * x + 2 : 0;
+    default:
+        if (x < 1e-8)
+            return 1;
+        return x < 3 ? 3 * sin(pi * x) * sin(pi * x / 3) / (pi * pi * x * x) : 0;
+    }
+}
+
+// Works out the weights for resizing from pixels to to along one axis.
+// Source pixels off the ends count as the end pixel, so every output
+// pixel's window lies inside the source, taps wide: a whole number of
+// groups of four for the SIMD passes, unless the source is narrower still.
+// Returns 0 if out of memory
+static int buildResizeAxis(ResizeAxis *axis, int from, int to, int sampling)
+{
+    double scale = (double)from / to, stretch = scale > 1 ? scale : 1;
+    double support = resizeSupport[sampling] * stretch, center, total, *exact;
+    int i, j, k, low, high, start, biggest, sum;
+
+    axis->taps = ((int)ceil(2 * support) + 1 + 3) & ~3;
+    if (axis->taps > from)
+        axis->taps = from;
+    axis->first = (int *)malloc(sizeof(int) * to);
+    axis->weights = (short *)malloc(sizeof(short) * to * axis->taps);
+    exact = (double *)malloc(sizeof(double) * axis->taps);
+    if (!axis->first || !axis->weights || !exact)
+    {
+        free(axis->first);
+        free(axis->weights);
+        free(exact);
+        return 0;
+    }
+
+    for (i = 0; i < to; i++)
+    {
+        // Pixel j's centre is at j + 0.5, the same as the renderer's texels
+        center = (i + 0.5) * scale;
+        low = (int)ceil(center - support - 0.5);
+        high = (int)floor(center + support - 0.5);
+        start = low > 0 ? low : 0;
+        if (start > from - axis->taps)
+            start = from - axis->taps;
+        for (k = 0; k < axis->taps; k++)
+            exact[k] = 0;
+        total = 0;
+        for (j = low; j <= high; j++)
+        {
+            double w = resizeKernel(sampling, (j + 0.5 - center) / stretch);
+            exact[(j < 0 ? 0 : j >= from ? from - 1 : j) - start] += w;
+            total += w;
+        }
+
+        // Rounding can leave the sum a little off, the biggest weight takes
+        // up the difference where it shows least
+        sum = 0;
+        biggest = 0;
+        for (k = 0; k < axis->taps; k++)
+        {
+            axis->weights[i * axis->taps + k] = (short)floor(exact[k] / total * RESIZE_ONE + 0.5);
+            sum += axis->weights[i * axis->taps + k];
+            if (exact[k] > exact[biggest])
+                biggest = k;
+        }
+        axis->weights[i * axis->taps + biggest] += (short)(RESIZE_ONE - sum);
+        axis->first[i] = start;
+    }
+    free(exact);
+    return 1;
+}
+
+// A weighted sum back to a byte, rounded and clamped, since Catmull-Rom
+// and Lanczos overshoot at hard edges
+static unsigned char resizedValue(int sum)
+{
+    sum += RESIZE_ONE / 2;
+    return sum <= 0 ? 0 : sum >= 255 << RESIZE_SHIFT ? 255 : (unsigned char)(sum >> RESIZE_SHIFT);
+}
+
+// Resizes one row across, output pixels [first, count)
+static void resizeRowScalar(const unsigned char *src, int channels, const ResizeAxis *axis, int first, int count,
+                            unsigned char *out)
+{
+    const unsigned char *p;
+    const short *w;
+    int x, k, c, sum;
+
+    for (x = first; x < count; x++)
+    {
+        p = src + (size_t)axis->first[x] * channels;
+        w = axis->weights + (size_t)x * axis->taps;
+        for (c = 0; c < channels; c++)
+        {
+            sum = 0;
+            for (k = 0; k < axis->taps; k++)
+                sum += w[k] * p[k * channels + c];
+            out[x * channels + c] = resizedValue(sum);
+        }
+    }
+}
+
+// Sums bytes [first, count) of taps rows, weighed by weights, into out
+static void resizeColumnsScalar(const unsigned char *const *rows, const short *weights, int taps, size_t first,
+                                size_t count, unsigned char *out)
+{
+    size_t i;
+    int k, sum;
+
+    for (i = first; i < count; i++)
+    {
+        sum = 0;
+        for (k = 0; k < taps; k++)
+            sum += weights[k] * rows[k][i];
+        out[i] = resizedValue(sum);
+    }
+}
+
+#ifdef EZ_X86
+
+// resizeRowScalar for RGB, four taps at a time. The four pixels' 12 bytes
+// go to both halves of the register and each half picks out two of them,
+// every channel's pair side by side as 16 bits, so one multiply-add gives
+// the R, G and B sums of two taps in each half. Returns how many pixels it
+// did, none if the taps do not come in fours
+EZ_TARGET("avx2")
+static int resizeRowAvx2(const unsigned char *src, const ResizeAxis *axis, int count, unsigned char *out)
+{
+    const __m256i spreadPixels = _mm256_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1, 2, -1, 5, -1, -1, -1, -1, -1,
+                                                  6, -1, 9, -1, 7, -1, 10, -1, 8, -1, 11, -1, -1, -1, -1, -1);
+    const __m256i spreadWeights = _mm256_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, -1, -1, -1, -1,
+                                                   4, 5, 6, 7, 4, 5, 6, 7, 4, 5, 6, 7, -1, -1, -1, -1);
+    const __m128i half = _mm_set1_epi32(RESIZE_ONE / 2);
+    const unsigned char *p;
+    const short *w;
+    __m256i sum, pixels, weights;
+    __m128i total;
+    int x, k, tail, color;
+
+    if (axis->taps & 3)
+        return 0;
+    for (x = 0; x < count; x++)
+    {
+        p = src + (size_t)axis->first[x] * 3;
+        w = axis->weights + (size_t)x * axis->taps;
+        sum = _mm256_setzero_si256();
+        for (k = 0; k < axis->taps; k += 4, p += 12)
+        {
+            memcpy(&tail, p + 8, 4);
+            pixels = _mm256_broadcastsi128_si256(
+                _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)p), _mm_cvtsi32_si128(tail)));
+            weights = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i *)(w + k)));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_shuffle_epi8(pixels, spreadPixels),
+                                                          _mm256_shuffle_epi8(weights, spreadWeights)));
+        }
+        total = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        total = _mm_srai_epi32(_mm_add_epi32(total, half), RESIZE_SHIFT);
+        total = _mm_packs_epi32(total, total);
+        color = _mm_cvtsi128_si32(_mm_packus_epi16(total, total));
+        out[3 * x] = (unsigned char)color;
+        out[3 * x + 1] = (unsigned char)(color >> 8);
+        out[3 * x + 2] = (unsigned char)(color >> 16);
+    }
+    return count;
+}
+
+// resizeColumnsScalar 16 bytes at a time. Two rows' bytes are interleaved
+// as 16 bits so one multiply-add weighs both taps. Returns how many bytes
+// it did
+EZ_TARGET("avx2")
+static size_t resizeColumnsAvx2(const unsigned char *const *rows, const short *weights, int taps, size_t count,
+                                unsigned char *out)
+{
+    const __m256i half = _mm256_set1_epi32(RESIZE_ONE / 2), zero = _mm256_setzero_si256();
+    __m256i low, high, a, b, w;
+    size_t i;
+    int k;
+
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        low = high = half;
+        for (k = 0; k + 2 <= taps; k += 2)
+        {
+            a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + i)));
+            b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k + 1] + i)));
+            w = _mm256_set1_epi32((int)((unsigned short)weights[k] |
+                                        (unsigned int)(unsigned short)weights[k + 1] << 16));
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        if (k < taps)
+        {
+            a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + i)));
+            w = _mm256_set1_epi32((unsigned short)weights[k]);
+            low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), w));
+            high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), w));
+        }
+        // Within each half the low and high sums are bytes 0-3 and 4-7 of
+        // it, so packing them keeps the bytes in order
+        a = _mm256_packs_epi32(_mm256_srai_epi32(low, RESIZE_SHIFT), _mm256_srai_epi32(high, RESIZE_SHIFT));
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, a), 0x08);
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(a));
+    }
+    return i;
+}
+
+#endif
+
+static void resizeRow(const unsigned char *src, int channels, const ResizeAxis *axis, int count, unsigned char *out)
+{
+    int x = 0;
+
+#ifdef EZ_X86
+    if (haveAvx2 && channels == 3)
+        x = resizeRowAvx2(src, axis, count, out);
+#endif
+    resizeRowScalar(src, channels, axis, x, count, out);
+}
+
+static void resizeColumns(const unsigned char *const *rows, const short *weights, int taps, size_t count,
+                          unsigned char *out)
+{
+    size_t i = 0;
+
+#ifdef EZ_X86
+    if (haveAvx2)
+        i = resizeColumnsAvx2(rows, weights, taps, count, out);
+#endif
+    resizeColumnsScalar(rows, weights, taps, i, count, out);
+}
+
+// The source rows a band of output rows reads are resized across into the
+// worker's buffer first, then each output row is summed down from there
+static void resizeWorker(void *context, int index)
+{
+    ResizeJob *job = (ResizeJob *)context;
+    const Pixmap *source = job->source;
+    Pixmap *out = job->out;
+    size_t srcRow = (size_t)source->width * source->channels, outRow = (size_t)out->width * out->channels;
+    unsigned char *buffer = job->scratch + (size_t)index * job->scratchRows * outRow;
+    const unsigned char **rows = job->rows + (size_t)index * job->down.taps;
+    long band;
+    int first, last, top, bottom, y, k;
+
+    while ((band = atomicIncrement(&job->nextBand) - 1) * RESIZE_BAND_ROWS < out->height)
+    {
+        first = (int)band * RESIZE_BAND_ROWS;
+        last = first + RESIZE_BAND_ROWS < out->height ? first + RESIZE_BAND_ROWS : out->height;
+        top = job->down.first[first];
+        bottom = job->down.first[last - 1] + job->down.taps;
+        for (y = top; y < bottom; y++)
+            resizeRow(source->image + (size_t)y * srcRow, source->channels, &job->across, out->width,
+                      buffer + (size_t)(y - top) * outRow);
+        for (y = first; y < last; y++)
+        {
+            for (k = 0; k < job->down.taps; k++)
+                rows[k] = buffer + (size_t)(job->down.first[y] - top + k) * outRow;
+            resizeColumns(rows, job->down.weights + (size_t)y * job->down.taps, job->down.taps, outRow,
+                          out->image + (size_t)y * outRow);
+        }
+    }
+}
+
+// Resizes source to width by height into *out with the filter for
+// sampling. Returns 0 if out of memory
+static int resizePixmap(const Pixmap *source, int width, int height, int sampling, Pixmap *out)
+{
+    ResizeJob job;
+    int workers = cpuCount(), bands = (height + RESIZE_BAND_ROWS - 1) / RESIZE_BAND_ROWS, band, rows, last;
+    int ok;
+
+    out->width = width;
+    out->height = height;
+    out->channels = source->channels;
+    out->image = (unsigned char *)malloc((size_t)width * height * source->channels);
+    job.across.first = job.down.first = NULL;
+    job.across.weights = job.down.weights = NULL;
+    job.scratch = NULL;
+    job.rows = NULL;
+    ok = out->image && buildResizeAxis(&job.across, source->width, width, sampling) &&
+         buildResizeAxis(&job.down, source->height, height, sampling);
+
+    if (ok)
+    {
+        if (workers > bands)
+            workers = bands;
+        job.scratchRows = 0;
+        for (band = 0; band < bands; band++)
+        {
+            last = (band + 1) * RESIZE_BAND_ROWS < height ? (band + 1) * RESIZE_BAND_ROWS : height;
+            rows = job.down.first[last - 1] + job.down.taps - job.down.first[band * RESIZE_BAND_ROWS];
+            if (rows > job.scratchRows)
+                job.scratchRows = rows;
+        }
+        job.scratch = (unsigned char *)malloc((size_t)workers * job.scratchRows * width * source->channels);
+        job.rows = (const unsigned char **)malloc(sizeof(unsigned char *) * workers * job.down.taps);
+        ok = job.scratch && job.rows;
+    }
+    if (ok)
+    {
+        job.source = source;
+        job.out = out;
+        job.nextBand = 0;
+        runWorkers(workers, resizeWorker, &job);
+    }
+    else
+    {
+        free(out->image);
+        out->image = NULL;
+    }
+
+    free(job.across.first);
+    free(job.across.weights);
+    free(job.down.first);
+    free(job.down.weights);
+    free(job.scratch);
+    free((void *)job.rows);
+    return ok;
+}
+
+// For -sample bicubic and lanczos: when the view shrinks the image, it is
+// resized first to about the size it is shown at, so that the bilinear
+// draw after it finds every source pixel already filtered in. Returns 0
+// when the view does not shrink the image either way, the image is then
+// drawn bilinear as it is
+static int shrinkForView(const Pixmap *source, mat2x3 inverse, int width, int height, int sampling,
+                         Pixmap *shrunk)
+{
+    mat2x3 toTexel;
+    float sMax, tMax;
+    double across, down;
+
+    if (!viewInvertible)
+        return 0;
+
+    // How many texels one output pixel spans along each of the image's axes
+    viewToTexel(source, inverse, width, height, toTexel, &sMax, &tMax);
+    across = sqrt(toTexel[0][0] * toTexel[0][0] + toTexel[1][0] * toTexel[1][0]);
+    down = sqrt(toTexel[0][1] * toTexel[0][1] + toTexel[1][1] * toTexel[1][1]);
+    if (across <= 1 && down <= 1)
+        return 0;
+
+    if (!resizePixmap(source, across > 1 ? (int)ceil(source->width / across) : source->width,
+                      down > 1 ? (int)ceil(source->height / down) : source->height, sampling, shrunk))
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the render!");
+        exit(-1);
+    }
+    return 1;
+}
+
+// Saves pixels as binary netpbm: pgm for gray, ppm for RGB and pam for
+// either with alpha
+static int writeNetpbm(const char *path, int width, int height, int channels, const unsigned char *pixels)
+{
+    static const char *tupleTypes[] = { "", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA" };
+    size_t pixelCount = (size_t)width * height;
+    FILE *out = fopen(path, "wb");
+    int ok;
+
+    if (!out)
+        return 0;
+    if (channels == 1 || channels == 3)
+        ok = fprintf(out, "P%d\n%d %d\n255\n", channels == 1 ? 5 : 6, width, height) > 0;
+    else
+        ok = fprintf(out, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                     width, height, channels, tupleTypes[channels]) > 0;
+    ok = ok && fwrite(pixels, channels, pixelCount, out) == pixelCount;
+    return fclose(out) == 0 && ok;
+}
+
+// Renders the view to a ppm file (-render) and says how long it took.
+// Quarter turns are done first by turning the pixels themselves, so they
+// add no resampling of their own
+static void renderToFile(const Pixmap *source, const char *path, int width, int height, int sampling)
+{
+    unsigned char *pixels = (unsigned char *)malloc((size_t)width * height * 3);
+    const Pixmap *image = source;
+    vec2 *inverse = viewInverse;
+    Pixmap turned, shrunk;
+    double start, turnTime = 0, shrinkTime = 0;
+    int engine = renderEngine, shrinking = 0, draw = sampling > SAMPLE_BILINEAR ? SAMPLE_BILINEAR : sampling;
+
+    if (!pixels)
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the render!");
+        exit(-1);
+    }
+
+    start = nowSeconds();
+    if (quarterTurns)
+    {
+        if (!turnPixmap(source, &turned))
+        {
+            fprintf(stderr, "\nERROR: Cannot allocate memory for the render!");
+            exit(-1);
+        }
+        turnTime = nowSeconds() - start;
+        image = &turned;
+        inverse = turnedInverse;
+    }
+    if (sampling > SAMPLE_BILINEAR)
+    {
+        shrinkTime = nowSeconds();
+        shrinking = shrinkForView(image, inverse, width, height, sampling, &shrunk);
+        shrinkTime = nowSeconds() - shrinkTime;
+        if (shrinking)
+        {
+            // The turned copy is not needed past this
+            if (quarterTurns)
+                free(turned.image);
+            image = &shrunk;
+        }
+    }
+    if (engine == ENGINE_SHEAR && !renderSheared(image, inverse, width, height, draw, pixels))
+    {
+        printf("Render: the view does not suit three passes, warping instead\n");
+        engine = ENGINE_WARP;
+    }
+    if (engine == ENGINE_WARP)
+        renderView(image, inverse, width, height, draw, WALK_FIXED, pixels);
+    if (shrinking)
+        free(shrunk.image);
+    else if (quarterTurns)
+        free(turned.image);
+    printf("Render: %d x %d from %d x %d, %s, %s, %d threads, %.2f ms", width, height,
+           source->width, source->height, sampleNames[sampling],
+           engine == ENGINE_SHEAR ? "three shears" : "warp", cpuCount(), (nowSeconds() - start) * 1000);
+    if (quarterTurns)
+        printf(" (%.2f ms of it turning)", turnTime * 1000);
+    if (shrinking)
+        printf(" (%.2f ms of it resizing to %d x %d)", shrinkTime * 1000, shrunk.width, shrunk.height);
+    printf("\n");
+
+    if (!writeNetpbm(path, width, height, 3, pixels))
+    {
+        fprintf(stderr, "\nERROR: Could not write %s!\n", path);
+        free(pixels);
+        exit(-1);
+    }
+    free(pixels);
+}
+
+// Saves the image itself turned by quarterTurns, pixel for pixel
+// (-export). With a fit size, from -size, the turned image is resized with
+// the filter for sampling to the biggest size of the same shape that fits
+static void exportToFile(const Pixmap *source, const char *path, int fitWidth, int fitHeight, int sampling)
+{
+    Pixmap turned, resized;
+    double start = nowSeconds(), resizeStart, fit;
+
+    if (!turnPixmap(source, &turned))
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the export!");
+        exit(-1);
+    }
+    printf("Export: %d x %d turned %d quarter turns in %.2f ms\n", source->width, source->height,
+           quarterTurns, (nowSeconds() - start) * 1000);
+    if (fitWidth)
+    {
+        resizeStart = nowSeconds();
+        fit = (double)fitWidth / turned.width < (double)fitHeight / turned.height ?
+              (double)fitWidth / turned.width : (double)fitHeight / turned.height;
+        if (!resizePixmap(&turned, turned.width * fit > 1 ? (int)floor(turned.width * fit + 0.5) : 1,
+                          turned.height * fit > 1 ? (int)floor(turned.height * fit + 0.5) : 1, sampling, &resized))
+        {
+            fprintf(stderr, "\nERROR: Cannot allocate memory for the export!");
+            exit(-1);
+        }
+        printf("Export: resized to %d x %d, %s, %d threads, %.2f ms\n", resized.width, resized.height,
+               sampleNames[sampling], cpuCount(), (nowSeconds() - resizeStart) * 1000);
+        free(turned.image);
+        turned = resized;
+    }
+    if (!writeNetpbm(path, turned.width, turned.height, turned.channels, turned.image))
+    {
+        fprintf(stderr, "\nERROR: Could not write %s!\n", path);
+        free(turned.image);
+        exit(-1);
+    }
+    free(turned.image);
+}
+
+// Allocates a made up width by height RGB source for the benchmarks and
+// fills it. Returns 0 if out of memory
+static int makeBenchImage(Pixmap *source, int width, int height)
+{
+    size_t bytes = (size_t)width * height * 3, k;
+
+    source->width = width;
+    source->height = height;
+    source->channels = 3;
+    source->image = (unsigned char *)malloc(bytes);
+    if (!source->image)
+        return 0;
+    for (k = 0; k < bytes; k++)
+        source->image[k] = (unsigned char)(k * 31 + (k >> 12));
+    return 1;
+}
+
+// Times both walkers on a synthetic source at a few rotations and shears
+// and prints the milliseconds for a 1080p frame (-benchrender). The view
+// is put back afterwards
+static void benchmarkRender(void)
+{
+    static const struct { float degrees, shearX, shearY, zoom; } views[] = {
+        { 0, 0, 0, 1 }, { 10, 0, 0, 1 }, { 45, 0, 0, 1 }, { 0, 0.3f, 0, 1 },
+        { 30, 0.2f, -0.4f, 1 }, { 45, 0, 0, 3 }, { 45, 0, 0, 0.25f }
+    };
+    SavedView saved;
+    int width = 1920, height = 1080, sampling, walker, i, run;
+    unsigned char *pixels = (unsigned char *)malloc((size_t)width * height * 3);
+    Pixmap source;
+    double start, elapsed, best[2];
+
+    if (!makeBenchImage(&source, 4096, 4096) || !pixels)
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the render benchmark!");
+        exit(-1);
+    }
+
+    printf("Render benchmark, %d x %d from %d x %d RGB, %d threads, ms best of 5\n",
+           width, height, source.width, source.height, cpuCount());
+    printf("  rotate  shear x  shear y  zoom   nearest:  float   fixed  bilinear:  float   fixed\n");
+    saveView(&saved);
+    translateX = translateY = 0;
+    quarterTurns = 0;
+    for (i = 0; i < (int)(sizeof(views) / sizeof(views[0])); i++)
+    {
+        rotation = (float)(views[i].degrees * pi / 180);
+        shearX = views[i].shearX;
+        shearY = views[i].shearY;
+        scale = views[i].zoom;
+        buildView();
+        printf("  %6.0f  %7.1f  %7.1f  %4.2f", views[i].degrees, shearX, shearY, scale);
+        for (sampling = SAMPLE_NEAREST; sampling <= SAMPLE_BILINEAR; sampling++)
+        {
+            for (walker = WALK_FLOAT; walker <= WALK_FIXED; walker++)
+            {
+                best[walker] = 1e30;
+                for (run = 0; run < 5; run++)
+                {
+                    start = nowSeconds();
+                    renderView(&source, viewInverse, width, height, sampling, walker, pixels);
+                    elapsed = nowSeconds() - start;
+                    best[walker] = elapsed < best[walker] ? elapsed : best[walker];
+                }
+            }
+            printf("  %15.2f %7.2f", best[WALK_FLOAT] * 1000, best[WALK_FIXED] * 1000);
+        }
+        printf("\n");
+    }
+
+    restoreView(&saved);
+    free(source.image);
+    free(pixels);
+}
+
+// Times the warp against the three passes on square RGB sources of
+// growing size, rotated 30 degrees with and without a shear and drawn at
+// their own size, and says from which size on the passes win
+// (-benchshear). The view is put back afterwards
+static void benchmarkShear(void)
+{
+    static const int sizes[] = { 256, 512, 1024, 2048, 4096, 8192 };
+    static const float shears[] = { 0, 0.2f };
+    const int sizeCount = (int)(sizeof(sizes) / sizeof(sizes[0]));
+    SavedView saved;
+    double best[2][2][2][sizeof(sizes) / sizeof(sizes[0])], start, elapsed;
+    int i, v, sampling, engine, run, from, declined = 0;
+    unsigned char *pixels;
+    Pixmap source;
+
+    printf("Shear benchmark, N x N RGB rotated 30 degrees to N x N, %d threads, ms best of 3\n", cpuCount());
+    printf("      N  shear x  nearest:   warp   shears  bilinear:   warp   shears\n");
+    saveView(&saved);
+    rotation = (float)(30 * pi / 180);
+    scale = 1;
+    shearY = 0;
+    translateX = translateY = 0;
+    quarterTurns = 0;
+    for (i = 0; i < sizeCount; i++)
+    {
+        pixels = (unsigned char *)malloc((size_t)sizes[i] * sizes[i] * 3);
+        if (!makeBenchImage(&source, sizes[i], sizes[i]) || !pixels)
+        {
+            fprintf(stderr, "\nERROR: Cannot allocate memory for the shear benchmark!");
+            exit(-1);
+        }
+
+        for (v = 0; v < 2; v++)
+        {
+            shearX = shears[v];
+            buildView();
+            printf("  %5d  %7.1f", sizes[i], shearX);
+            for (sampling = SAMPLE_NEAREST; sampling <= SAMPLE_BILINEAR; sampling++)
+            {
+                for (engine = ENGINE_WARP; engine <= ENGINE_SHEAR; engine++)
+                {
+                    // A view the passes decline keeps its 1e30, so it never
+                    // counts as a win for them
+                    best[v][sampling][engine][i] = 1e30;
+                    for (run = 0; run < 3; run++)
+                    {
+                        start = nowSeconds();
+                        if (engine == ENGINE_WARP)
+                            renderView(&source, viewInverse, sizes[i], sizes[i], sampling, WALK_FIXED, pixels);
+                        else if (!renderSheared(&source, viewInverse, sizes[i], sizes[i], sampling, pixels))
+                            break;
+                        elapsed = nowSeconds() - start;
+                        if (elapsed < best[v][sampling][engine][i])
+                            best[v][sampling][engine][i] = elapsed;
+                    }
+                }
+                printf("  %16.2f", best[v][sampling][ENGINE_WARP][i] * 1000);
+                if (best[v][sampling][ENGINE_SHEAR][i] < 1e30)
+                    printf(" %8.2f", best[v][sampling][ENGINE_SHEAR][i] * 1000);
+                else
+                {
+                    printf(" %8s", "declined");
+                    declined = 1;
+                }
+            }
+            printf("\n");
+        }
+        free(source.image);
+        free(pixels);
+    }
+
+    if (declined)
+        printf("  declined: three passes turned the view down, -render would use the warp\n");
+
+    // The crossover is the smallest size from which the passes win at every
+    // size up
+    for (v = 0; v < 2; v++)
+    {
+        for (sampling = SAMPLE_NEAREST; sampling <= SAMPLE_BILINEAR; sampling++)
+        {
+            for (from = sizeCount; from > 0 &&
+                 best[v][sampling][ENGINE_SHEAR][from - 1] < best[v][sampling][ENGINE_WARP][from - 1]; from--)
+                ;
+            printf("  shear x %.1f, %s: ", shears[v], sampling == SAMPLE_NEAREST ? "nearest" : "bilinear");
+            if (from == sizeCount)
+                printf("the warp was faster at the biggest size\n");
+            else if (from == 0)
+                printf("three shears were faster at every size\n");
+            else
+                printf("three shears are faster from %d x %d up\n", sizes[from], sizes[from]);
+        }
+    }
+
+    restoreView(&saved);
+}
+
+// Times resizing a made up 8192 x 8192 RGB image down to a half, a quarter
+// and an eighth with each filter, on all cores, with and without AVX2 when
+// the cpu has it (-benchresize)
+static void benchmarkResize(void)
+{
+    static const int divisors[] = { 2, 4, 8 };
+    int withAvx2 = haveAvx2 != 0, i, sampling, simd, run;
+    double start, elapsed, best[2];
+    Pixmap source, resized;
+
+    if (!makeBenchImage(&source, 8192, 8192))
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the resize benchmark!");
+        exit(-1);
+    }
+
+    printf("Resize benchmark, 8192 x 8192 RGB, %d threads, ms best of 3\n", cpuCount());
+    printf("  filter      size       scalar      avx2\n");
+    for (sampling = SAMPLE_NEAREST; sampling <= SAMPLE_LANCZOS; sampling++)
+    {
+        for (i = 0; i < (int)(sizeof(divisors) / sizeof(divisors[0])); i++)
+        {
+            for (simd = 0; simd <= withAvx2; simd++)
+            {
+                haveAvx2 = simd;
+                best[simd] = 1e30;
+                for (run = 0; run < 3; run++)
+                {
+                    start = nowSeconds();
+                    if (!resizePixmap(&source, source.width / divisors[i], source.height / divisors[i], sampling,
+                                      &resized))
+                    {
+                        fprintf(stderr, "\nERROR: Cannot allocate memory for the resize benchmark!");
+                        exit(-1);
+                    }
+                    elapsed = nowSeconds() - start;
+                    free(resized.image);
+                    if (elapsed < best[simd])
+                        best[simd] = elapsed;
+                }
+            }
+            printf("  %-8s %5d x %-5d %8.2f", sampleNames[sampling], source.width / divisors[i],
+                   source.height / divisors[i], best[0] * 1000);
+            if (withAvx2)
+                printf("  %8.2f", best[1] * 1000);
+            printf("\n");
+        }
+    }
+    haveAvx2 = withAvx2;
+    free(source.image);
+}
+
+///////////////////////////////////// TILED TEXTURES /////////////////////////////////////
+
+// Images bigger than GL_MAX_TEXTURE_SIZE are split into a grid of tiles,
+// each its own texture drawn as its own quad with the same MVP. Tiles that
+// land completely outside the viewport are skipped before any draw call.
+// Once a still image is on screen its mip levels are added (see MIPMAPS)
+
+// Tile edge in pixels, 0 uses the largest texture the driver allows (-tile)
+int tileSize = 0;
+
+// Rows per glTexSubImage2D when a tile has to be repacked before upload
+#define TILE_UPLOAD_ROWS 64
+
+// How rows get to the driver (-upload). Packed hands over tightly packed
+// rows with GL_UNPACK_ALIGNMENT 1, pitched pads every row out to 4 bytes,
+// rgba widens RGB images to 4 byte texels, which most drivers take without
+// a swizzle of their own. Grayscale and alpha images upload pitched under rgba
+#define UPLOAD_PACKED 0
+#define UPLOAD_PITCHED 1
+#define UPLOAD_RGBA 2
+int uploadMode = UPLOAD_RGBA;
+
+typedef struct TextureGrid
+{
+    int width, height, channels;
+    GLenum format;
+    int tileSize, columns, rows, count;
+    int unpackAlignment;    // GL_UNPACK_ALIGNMENT the rows are laid out for
+    int expand;             // 1 if RGB rows are widened to RGBA on the way up
+    int compressed;         // ETC1 preset the tiles are encoded with, ETC1_OFF for none
+    int levels;             // mip levels uploaded, 1 until buildGridMipmaps
+    int mipmapped;          // 1 if every tile holds its levels as its own mip chain
+    GLuint *textures;       // row by row, columns * rows of them, then as many again
+                            // for each further level unless mipmapped
+    Vertex *vertices;       // 6 per tile, the full image quad cut down to the tile
+    unsigned char *staging; // TILE_UPLOAD_ROWS rows of one tile at up to 4 bytes a
+                            // pixel, or a whole tile of ETC1 blocks, page aligned
+                            // and shared by every upload
+    int drawn, culled, level;   // from the last drawTextureGrid
+} TextureGrid;
+
+// Works out the grid and creates the empty tile textures. Returns 0 if out
+// of memory
+static int createTextureGrid(TextureGrid *grid, int width, int height, int channels, GLenum format)
+{
+    GLint maxSize = 0;
+    int column, row, i, x0, x1, y0, y1;
+    float left, right, top, bottom;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (maxSize < 64)
+        maxSize = 64;
+
+    grid->width = width;
+    grid->height = height;
+    grid->channels = channels;
+    grid->format = format;
+    grid->compressed = channels == 1 || channels == 3 ? etc1Mode : ETC1_OFF;
+    grid->expand = uploadMode == UPLOAD_RGBA && channels == 3 && !grid->compressed;
+    if (grid->expand)
+        grid->format = format = GL_RGBA;
+    grid->unpackAlignment = uploadMode == UPLOAD_PACKED ? 1 : 4;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, grid->unpackAlignment);
+    grid->tileSize = tileSize > 0 && tileSize < maxSize ? tileSize : maxSize;
+    grid->columns = (width + grid->tileSize - 1) / grid->tileSize;
+    grid->rows = (height + grid->tileSize - 1) / grid->tileSize;
+    grid->count = grid->columns * grid->rows;
+    grid->levels = 1;
+    grid->mipmapped = 0;
+    grid->drawn = grid->culled = grid->level = 0;
+    grid->textures = (GLuint *)malloc(sizeof(GLuint) * grid->count);
+    grid->vertices = (Vertex *)malloc(sizeof(Vertex) * 6 * grid->count);
+    grid->staging = (unsigned char *)alignedAlloc(grid->compressed ?
+                                                  etc1Size(grid->tileSize, grid->tileSize) :
+                                                  (size_t)grid->tileSize * 4 * TILE_UPLOAD_ROWS);
+    if (!grid->textures || !grid->vertices || !grid->staging)
+        return 0;
+
+    glGenTextures(grid->count, grid->textures);
+    for (row = 0; row < grid->rows; row++)
+    {
+        for (column = 0; column < grid->columns; column++)
+        {
+            Vertex *quad = grid->vertices + 6 * (row * grid->columns + column);
+
+            x0 = column * grid->tileSize;
+            y0 = row * grid->tileSize;
+            x1 = x0 + grid->tileSize < width ? x0 + grid->tileSize : width;
+            y1 = y0 + grid->tileSize < height ? y0 + grid->tileSize : height;
+
+            glBindTexture(GL_TEXTURE_2D, grid->textures[row * grid->columns + column]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            // ETC1 tiles only get storage once their pixels are all there
+            if (!grid->compressed)
+                glTexImage2D(GL_TEXTURE_2D, 0, format, x1 - x0, y1 - y0, 0, format, GL_UNSIGNED_BYTE, NULL);
+
+            // Same quad and texture coordinates as the whole image, just
+            // squeezed into the part of it this tile covers
+            left = -1 + 2.0f * x0 / width;
+            right = -1 + 2.0f * x1 / width;
+            top = 1 - 2.0f * y0 / height;
+            bottom = 1 - 2.0f * y1 / height;
+            for (i = 0; i < 6; i++)
+            {
+                quad[i] = vertexes[i];
+                quad[i].Position[0] = vertexes[i].Position[0] > 0 ? right : left;
+                quad[i].Position[1] = vertexes[i].Position[1] > 0 ? top : bottom;
+            }
+        }
+    }
+    return 1;
+}
+
+#ifdef EZ_X86
+
+// Widens 4 RGB pixels at a time to RGBA with one pshufb, alpha ORed in.
+// The 16 byte loads would read past the last pixels so those are left over.
+// Returns how many pixels it did
+EZ_TARGET("ssse3")
+static size_t expandRgbToRgbaSsse3(const unsigned char *src, unsigned char *dst, size_t pixels)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    size_t i;
+
+    for (i = 0; i + 6 <= pixels; i += 4)
+    {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)(src + 3 * i));
+        _mm_storeu_si128((__m128i *)(dst + 4 * i), _mm_or_si128(_mm_shuffle_epi8(rgb, spread), alpha));
+    }
+    return i;
+}
+
+// Same as the SSSE3 one with 4 pixels in each half of the register
+EZ_TARGET("avx2")
+static size_t expandRgbToRgbaAvx2(const unsigned char *src, unsigned char *dst, size_t pixels)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    size_t i;
+
+    for (i = 0; i + 10 <= pixels; i += 8)
+    {
+        __m256i rgb = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + 3 * i))),
+            _mm_loadu_si128((const __m128i *)(src + 3 * i + 12)), 1);
+        _mm256_storeu_si256((__m256i *)(dst + 4 * i), _mm256_or_si256(_mm256_shuffle_epi8(rgb, spread), alpha));
+    }
+    return i;
+}
+
+#endif
+
+// RGB pixels to opaque RGBA ones
+static void expandRgbToRgba(const unsigned char *src, unsigned char *dst, size_t pixels)
+{
+    size_t i = 0;
+
+#ifdef EZ_X86
+    if (haveAvx2)
+        i = expandRgbToRgbaAvx2(src, dst, pixels);
+    else if (haveSsse3)
+        i = expandRgbToRgbaSsse3(src, dst, pixels);
+#endif
+    for (; i < pixels; i++)
+    {
+        dst[4 * i] = src[3 * i];
+        dst[4 * i + 1] = src[3 * i + 1];
+        dst[4 * i + 2] = src[3 * i + 2];
+        dst[4 * i + 3] = 255;
+    }
+}
+
+// Uploads the w by h block at (x, y) of an image imageWidth pixels wide to
+// the given level of the bound texture, starting at texture row dy. Whole
+// rows go up as they are if they suit the unpack alignment. Anything else
+// is repacked into the staging buffer first, since GLES2 has no
+// GL_UNPACK_ROW_LENGTH. ETC1 textures can not be updated in part, so for
+// those the block is always a whole level of the texture and dy is 0
+static void uploadBlock(TextureGrid *grid, GLint level, const unsigned char *image, int imageWidth,
+                        int x, int y, int w, int h, int dy)
+{
+    size_t rowSize = (size_t)imageWidth * grid->channels;
+    size_t used = (size_t)w * grid->channels;
+    size_t pitch = grid->expand ? (size_t)w * 4 :
+                   (used + grid->unpackAlignment - 1) & ~(size_t)(grid->unpackAlignment - 1);
+    const unsigned char *row;
+    int band, i;
+
+    if (grid->compressed)
+    {
+        encodeEtc1(image, imageWidth, grid->channels, x, y, w, h, grid->compressed, grid->staging);
+        glCompressedTexImage2D(GL_TEXTURE_2D, level, GL_ETC1_RGB8_OES, w, h, 0,
+                               (GLsizei)etc1Size(w, h), grid->staging);
+        return;
+    }
+
+    if (!grid->expand && w == imageWidth && rowSize % grid->unpackAlignment == 0)
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, dy, w, h, grid->format, GL_UNSIGNED_BYTE,
+                        image + rowSize * y);
+        return;
+    }
+
+    for (; h > 0; y += band, dy += band, h -= band)
+    {
+        band = h < TILE_UPLOAD_ROWS ? h : TILE_UPLOAD_ROWS;
+        for (i = 0; i < band; i++)
+        {
+            row = image + rowSize * (y + i) + (size_t)x * grid->channels;
+            if (grid->expand)
+                expandRgbToRgba(row, grid->staging + (size_t)i * pitch, (size_t)w);
+            else
+                memcpy(grid->staging + (size_t)i * pitch, row, used);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, dy, w, band, grid->format, GL_UNSIGNED_BYTE,
+                        grid->staging);
+    }
+}
+
+// Uploads image rows [first, last) to every tile they touch. ETC1 tiles
+// wait for the call that brings their last row and then go up whole
+static void uploadGridRows(TextureGrid *grid, const unsigned char *image, int first, int last)
+{
+    int row, column, y0, y1, x0, tileWidth;
+
+    for (row = first / grid->tileSize; row < grid->rows && row * grid->tileSize < last; row++)
+    {
+        y0 = row * grid->tileSize > first ? row * grid->tileSize : first;
+        y1 = (row + 1) * grid->tileSize < last ? (row + 1) * grid->tileSize : last;
+        if (grid->compressed)
+        {
+            if (y1 < (row + 1) * grid->tileSize && y1 < grid->height)
+                continue;
+            y0 = row * grid->tileSize;
+        }
+
+        for (column = 0; column < grid->columns; column++)
+        {
+            x0 = column * grid->tileSize;
+            tileWidth = grid->width - x0 < grid->tileSize ? grid->width - x0 : grid->tileSize;
+            glBindTexture(GL_TEXTURE_2D, grid->textures[row * grid->columns + column]);
+            uploadBlock(grid, 0, image, grid->width, x0, y0, tileWidth, y1 - y0, y0 - row * grid->tileSize);
+        }
+    }
+}
+
+// Draws every tile whose transformed bounds reach into the viewport. The
+// vertex buffer has to hold grid->vertices. Levels kept as separate
+// textures are picked here the way GL would pick a mip level, from how
+// many image pixels land on one window pixel
+static void drawTextureGrid(TextureGrid *grid, mat2x3 mvp, int windowWidth, int windowHeight)
+{
+    int i, j, level = 0;
+    float x, y, minX, maxX, minY, maxY;
+    vec2 corner;
+
+    if (!grid->mipmapped && grid->levels > 1)
+    {
+        // Window pixels covered by one image pixel along each image axis
+        x = sqrtf(mvp[0][0] * windowWidth * mvp[0][0] * windowWidth +
+                  mvp[0][1] * windowHeight * mvp[0][1] * windowHeight) / grid->width;
+        y = sqrtf(mvp[1][0] * windowWidth * mvp[1][0] * windowWidth +
+                  mvp[1][1] * windowHeight * mvp[1][1] * windowHeight) / grid->height;
+        x = x < y ? x : y;
+        if (x > 0)
+            level = (int)floorf(logf(1 / x) / logf(2) + 0.5f);
+        level = level < 0 ? 0 : level < grid->levels ? level : grid->levels - 1;
+    }
+
+    grid->drawn = grid->culled = 0;
+    grid->level = level;
+    for (i = 0; i < grid->count; i++)
+    {
+        const Vertex *quad = grid->vertices + 6 * i;
+
+        // The quad's corners in clip space
+        minX = minY = 1e30f;
+        maxX = maxY = -1e30f;
+        for (j = 0; j < 6; j++)
+        {
+            corner[0] = quad[j].Position[0];
+            corner[1] = quad[j].Position[1];
+            mat2x3_mul_vec2(corner, mvp, corner);
+            x = corner[0];
+            y = corner[1];
+            minX = x < minX ? x : minX;
+            maxX = x > maxX ? x : maxX;
+            minY = y < minY ? y : minY;
+            maxY = y > maxY ? y : maxY;
+        }
+        if (maxX < -1 || minX > 1 || maxY < -1 || minY > 1)
+        {
+            grid->culled++;
+            continue;
+        }
+
+        glBindTexture(GL_TEXTURE_2D, grid->textures[level * grid->count + i]);
+        glDrawArrays(GL_TRIANGLES, 6 * i, 6);
+        grid->drawn++;
+    }
+}
+
+static void freeTextureGrid(TextureGrid *grid)
+{
+    if (grid->textures)
+        glDeleteTextures(grid->count * (grid->mipmapped ? 1 : grid->levels), grid->textures);
+    free(grid->textures);
+    free(grid->vertices);
+    if (grid->staging)
+        alignedFree(grid->staging);
+}
+
+// Times a full upload of an RGB image through every upload mode for a few
+// widths, each width as one tile (-benchupload). Runs in a hidden window of
+// its own and prints the best of a few runs in MB/s of RGB pixels
+static void benchmarkUploads(void)
+{
+    static const int widths[] = { 255, 257, 640, 1000, 1920, 4093, 4096 };
+    GLFWwindow *window;
+    GLint maxSize = 0;
+    TextureGrid grid;
+    unsigned char *image;
+    size_t bytes;
+    double start, elapsed, best;
+    int savedMode = uploadMode, savedTile = tileSize;
+    int i, mode, run, width, height;
+
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+    glfwDefaultWindowHints();
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    window = glfwCreateWindow(64, 64, "EZ-View upload benchmark", NULL, NULL);
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+    glfwMakeContextCurrent(window);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+
+    printf("Upload benchmark, MB/s of RGB pixels, best of 5\n");
+    printf("  width    packed   pitched      rgba\n");
+    tileSize = 0;
+    for (i = 0; i < (int)(sizeof(widths) / sizeof(widths[0])); i++)
+    {
+        // Roughly 24 MB of pixels a run, as long as the driver allows it
+        width = widths[i] < maxSize ? widths[i] : maxSize;
+        height = (24 << 20) / (width * 3);
+        height = height < maxSize ? height : maxSize;
+        bytes = (size_t)width * height * 3;
+        image = (unsigned char *)alignedAlloc(bytes);
+        if (!image)
+            break;
+        for (run = 0; run < (int)bytes; run++)
+            image[run] = (unsigned char)(run * 31);
+
+        printf("  %5d", width);
+        for (mode = UPLOAD_PACKED; mode <= UPLOAD_RGBA; mode++)
+        {
+            uploadMode = mode;
+            if (!createTextureGrid(&grid, width, height, 3, GL_RGB))
+                break;
+            best = 1e30;
+            for (run = 0; run < 5; run++)
+            {
+                glFinish();
+                start = nowSeconds();
+                uploadGridRows(&grid, image, 0, height);
+                glFinish();
+                elapsed = nowSeconds() - start;
+                best = elapsed < best ? elapsed : best;
+            }
+            freeTextureGrid(&grid);
+            printf("  %8.0f", bytes / best / (1 << 20));
+        }
+        printf("\n");
+        alignedFree(image);
+    }
+
+    uploadMode = savedMode;
+    tileSize = savedTile;
+    glfwDestroyWindow(window);
+    glfwTerminate();
+}
+
+///////////////////////////////////// MIPMAPS /////////////////////////////////////
+
+// Zoomed out, the image is sampled from a smaller copy of itself instead of
+// skipping over pixels of the full one. GLES2 can only glGenerateMipmap
+// power of two textures, so the levels are box filtered on the cpu. When
+// every tile is a power of two both ways the levels become each tile's mip
+// chain and GL_LINEAR_MIPMAP_LINEAR does the rest. Otherwise every level is
+// a texture of its own and drawTextureGrid picks one by zoom
+
+// Still images get mip levels unless -nomip is given
+int mipmaps = 1;
+
+// One level being filtered down from the one above it, split by rows
+typedef struct MipJob
+{
+    const unsigned char *src;
+    unsigned char *dst;
+    int srcWidth, srcHeight, width, height, channels, workers;
+} MipJob;
+
+static int isPowerOfTwo(int value)
+{
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+#ifdef EZ_X86
+
+// Averages the 2x2 blocks of two source rows into the start of an output
+// row. Every byte gets the sum of itself, the byte a pixel to its right and
+// the two below them, then pshufb keeps the first pixel of each pair. 8
+// output bytes per step, 9 for RGB. Returns how many output bytes it did
+EZ_TARGET("ssse3")
+static size_t downsampleRowSsse3(const unsigned char *r0, const unsigned char *r1, unsigned char *out,
+                                 size_t outBytes, size_t srcBytes, int channels)
+{
+    static const signed char keep[5][16] = {
+        { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { 0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { 0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1 },
+        { 0, 1, 2, 6, 7, 8, 12, 13, 14, -1, -1, -1, -1, -1, -1, -1 },
+        { 0, 1, 2, 3, 8, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1 }
+    };
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    const __m128i pick = _mm_loadu_si128((const __m128i *)keep[channels]);
+    size_t step = channels == 3 ? 9 : 8, o;
+
+    for (o = 0; o + 16 <= outBytes && 2 * o + channels + 16 <= srcBytes; o += step)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(r0 + 2 * o));
+        __m128i b = _mm_loadu_si128((const __m128i *)(r0 + 2 * o + channels));
+        __m128i c = _mm_loadu_si128((const __m128i *)(r1 + 2 * o));
+        __m128i d = _mm_loadu_si128((const __m128i *)(r1 + 2 * o + channels));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        // The bytes past the step are junk, the next step writes over them
+        _mm_storeu_si128((__m128i *)(out + o), _mm_shuffle_epi8(_mm_packus_epi16(lo, hi), pick));
+    }
+    return o;
+}
+
+#endif
+
+// Output rows [first, last) of the next level. An odd last row or column of
+// the source is dropped, a source one pixel high or wide is used twice
+static void downsampleRows(const MipJob *job, int first, int last)
+{
+    size_t srcRow = (size_t)job->srcWidth * job->channels;
+    size_t outRow = (size_t)job->width * job->channels;
+    int channels = job->channels, x, y, c, right;
+
+    for (y = first; y < last; y++)
+    {
+        const unsigned char *r0 = job->src + srcRow * 2 * y;
+        const unsigned char *r1 = 2 * y + 1 < job->srcHeight ? r0 + srcRow : r0;
+        unsigned char *out = job->dst + outRow * y;
+        size_t done = 0;
+
+#ifdef EZ_X86
+        if (haveSsse3)
+            done = downsampleRowSsse3(r0, r1, out, outRow, srcRow, channels);
+#endif
+        for (x = (int)(done / channels); x < job->width; x++)
+        {
+            right = 2 * x + 1 < job->srcWidth ? (2 * x + 1) * channels : 2 * x * channels;
+            for (c = 0; c < channels; c++)
+                out[x * channels + c] = (unsigned char)((r0[2 * x * channels + c] + r0[right + c] +
+                                                         r1[2 * x * channels + c] + r1[right + c] + 2) >> 2);
+        }
+    }
+}
+
+static void mipWorker(void *context, int index)
+{
+    MipJob *job = (MipJob *)context;
+    int rows = (job->height + job->workers - 1) / job->workers;
+    int first = index * rows;
+    int last = first + rows < job->height ? first + rows : job->height;
+
+    if (first < last)
+        downsampleRows(job, first, last);
+}
+
+// Filters an image down to the next level, max(1, size / 2) each way, with
+// the rows shared out over the cores. Returns NULL if out of memory
+static unsigned char *downsampleImage(const unsigned char *src, int srcWidth, int srcHeight, int channels)
+{
+    MipJob job;
+
+    job.src = src;
+    job.srcWidth = srcWidth;
+    job.srcHeight = srcHeight;
+    job.width = srcWidth > 1 ? srcWidth / 2 : 1;
+    job.height = srcHeight > 1 ? srcHeight / 2 : 1;
+    job.channels = channels;
+    job.dst = (unsigned char *)malloc((size_t)job.width * job.height * channels);
+    if (!job.dst)
+        return NULL;
+
+    // Small levels are done before a thread would have started
+    job.workers = cpuCount();
+    if (job.workers > job.height / 64)
+        job.workers = job.height / 64 > 1 ? job.height / 64 : 1;
+    runWorkers(job.workers, mipWorker, &job);
+    return job.dst;
+}
+
+// Builds the levels below the image one from the other and uploads each one
+// to every tile as it is done. Returns 0 if there were none to build or no
+// memory for them, the tiles then keep drawing the full image only
+static int buildGridMipmaps(TextureGrid *grid, const unsigned char *image)
+{
+    int tileWidth = grid->columns > 1 ? grid->tileSize : grid->width;
+    int tileHeight = grid->rows > 1 ? grid->tileSize : grid->height;
+    int lastWidth = grid->width - (grid->columns - 1) * grid->tileSize;
+    int lastHeight = grid->height - (grid->rows - 1) * grid->tileSize;
+    int levels, level, levelWidth = grid->width, levelHeight = grid->height;
+    int i, x, y, w, h, column, row;
+    const unsigned char *previous = image;
+    unsigned char *current;
+    GLuint *textures;
+
+    grid->mipmapped = isPowerOfTwo(tileWidth) && isPowerOfTwo(tileHeight) &&
+                      isPowerOfTwo(lastWidth) && isPowerOfTwo(lastHeight);
+    if (grid->mipmapped)
+        levels = 1 + highestBit(tileWidth > tileHeight ? tileWidth : tileHeight);
+    else
+    {
+        // Separate textures go down while a whole tile has pixels left and,
+        // when there are several tiles, while their edges stay on whole
+        // pixels of the level. Thin last columns and rows stop at one pixel
+        levels = 1 + highestBit(tileWidth < tileHeight ? tileWidth : tileHeight);
+        if (grid->count > 1 && levels > 1 + countTrailingZeros(grid->tileSize))
+            levels = 1 + countTrailingZeros(grid->tileSize);
+
+        textures = levels > 1 ? (GLuint *)realloc(grid->textures, sizeof(GLuint) * grid->count * levels) : NULL;
+        if (!textures)
+            return 0;
+        grid->textures = textures;
+    }
+    if (levels < 2)
+        return 0;
+
+    for (level = 1; level < levels; level++)
+    {
+        current = downsampleImage(previous, levelWidth, levelHeight, grid->channels);
+        if (previous != image)
+            free((void *)previous);
+        previous = image;
+        if (!current)
+            break;
+        levelWidth = levelWidth > 1 ? levelWidth / 2 : 1;
+        levelHeight = levelHeight > 1 ? levelHeight / 2 : 1;
+
+        if (!grid->mipmapped)
+            glGenTextures(grid->count, grid->textures + level * grid->count);
+
+        for (i = 0; i < grid->count; i++)
+        {
+            // Where the tile is in this level, kept inside it once the tile
+            // has shrunk to a single pixel
+            column = i % grid->columns;
+            row = i / grid->columns;
+            w = (column < grid->columns - 1 ? tileWidth : lastWidth) >> level;
+            h = (row < grid->rows - 1 ? tileHeight : lastHeight) >> level;
+            w = w > 1 ? w : 1;
+            h = h > 1 ? h : 1;
+            x = (column * grid->tileSize) >> level;
+            y = (row * grid->tileSize) >> level;
+            x = x < levelWidth - w ? x : levelWidth - w;
+            y = y < levelHeight - h ? y : levelHeight - h;
+
+            if (grid->mipmapped)
+            {
+                glBindTexture(GL_TEXTURE_2D, grid->textures[i]);
+                if (!grid->compressed)
+                    glTexImage2D(GL_TEXTURE_2D, level, grid->format, w, h, 0, grid->format, GL_UNSIGNED_BYTE, NULL);
+                uploadBlock(grid, level, current, levelWidth, x, y, w, h, 0);
+            }
+            else
+            {
+                glBindTexture(GL_TEXTURE_2D, grid->textures[level * grid->count + i]);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                if (!grid->compressed)
+                    glTexImage2D(GL_TEXTURE_2D, 0, grid->format, w, h, 0, grid->format, GL_UNSIGNED_BYTE, NULL);
+                uploadBlock(grid, 0, current, levelWidth, x, y, w, h, 0);
+                grid->levels = level + 1;
+            }
+        }
+        previous = current;
+    }
+    if (previous != image)
+        free((void *)previous);
+
+    // A mip chain is only complete, and only switched on, with every level
+    if (grid->mipmapped && level == levels)
+    {
+        for (i = 0; i < grid->count; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, grid->textures[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        }
+        grid->levels = levels;
+    }
+    return grid->levels > 1;
+}
+
+// Every drawn frame records how long each stage took into a ring holding
+// the last FRAME_LOG_SIZE frames. Recording is a few clock reads and
+// stores into this static array, so it is always on
+#define FRAME_LOG_SIZE 4096
+
+// Animation frames also log their upload and decode. The decode runs on
+// its own thread while the frame before is up, so it is not part of the
+// frame's total
+enum { STAGE_MATRIX, STAGE_UNIFORM, STAGE_DRAW, STAGE_SWAP, STAGE_EVENTS,
+       STAGE_UPLOAD, STAGE_DECODE, STAGE_COUNT };
+
+static const char *stageNames[STAGE_COUNT] = { "matrix", "uniform", "draw", "swap", "events",
+                                               "upload", "decode" };
+
+typedef struct FrameTiming
+{
+    double start;               // seconds, from nowSeconds
+    float stage[STAGE_COUNT];   // seconds spent in each stage
+} FrameTiming;
+
+static FrameTiming frameLog[FRAME_LOG_SIZE];
+
+// Set once the events after the latest frame have been timed, so only the
+// first poll after a frame counts against it
+static int eventsTimed = 1;
+
+// Written with every logged frame on exit when -framecsv is given
+const char *frameCsvPath = NULL;
+
+// The logged frames run from the oldest still in the ring up to the latest
+static long firstLoggedFrame(void)
+{
+    return framesDrawn > FRAME_LOG_SIZE ? framesDrawn - FRAME_LOG_SIZE : 0;
+}
+
+static int compareFloats(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints the 50th, 95th and 99th percentile and the worst time of each
+// stage, and of the whole frame, over the frames still in the ring. Upload
+// and decode are left out when no animation frame was logged
+static void printFrameTimes(void)
+{
+    static float sorted[FRAME_LOG_SIZE];
+    long first = firstLoggedFrame(), f;
+    int count = (int)(framesDrawn - first), stage, i;
+
+    if (count == 0)
+        return;
+
+    printf("Frame times in ms over the last %d of %ld frames:\n", count, framesDrawn);
+    printf("            p50      p95      p99      max\n");
+    for (stage = 0; stage <= STAGE_COUNT; stage++)
+    {
+        for (f = first, i = 0; f < framesDrawn; f++, i++)
+        {
+            const FrameTiming *timing = &frameLog[f % FRAME_LOG_SIZE];
+            int j;
+
+            // The row after the last stage is the total
+            if (stage < STAGE_COUNT)
+                sorted[i] = timing->stage[stage];
+            else
+                for (sorted[i] = 0, j = 0; j < STAGE_DECODE; j++)
+                    sorted[i] += timing->stage[j];
+        }
+        qsort(sorted, count, sizeof(float), compareFloats);
+        if ((stage == STAGE_UPLOAD || stage == STAGE_DECODE) && sorted[count - 1] == 0)
+            continue;
+        printf("  %-7s %8.3f %8.3f %8.3f %8.3f\n", stage < STAGE_COUNT ? stageNames[stage] : "frame",
+               sorted[(count - 1) * 50 / 100] * 1000, sorted[(count - 1) * 95 / 100] * 1000,
+               sorted[(count - 1) * 99 / 100] * 1000, sorted[count - 1] * 1000);
+    }
+}
+
+// Writes one line per logged frame, with its start relative to the oldest
+// one and each stage in ms
+static void writeFrameCsv(const char *path)
+{
+    long first = firstLoggedFrame(), f;
+    FILE *file;
+    int stage;
+
+    file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "\nERROR: Could not write %s!\n", path);
+        return;
+    }
+    fprintf(file, "frame,start_ms");
+    for (stage = 0; stage < STAGE_COUNT; stage++)
+        fprintf(file, ",%s_ms", stageNames[stage]);
+    fprintf(file, "\n");
+
+    for (f = first; f < framesDrawn; f++)
+    {
+        const FrameTiming *timing = &frameLog[f % FRAME_LOG_SIZE];
+
+        fprintf(file, "%ld,%.3f", f, (timing->start - frameLog[first % FRAME_LOG_SIZE].start) * 1000);
+        for (stage = 0; stage < STAGE_COUNT; stage++)
+            fprintf(file, ",%.4f", timing->stage[stage] * 1000);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+// Handles whatever input is pending, timing it as the events stage of the
+// frame just drawn. Unless that input needs a redraw it then sleeps until
+// more arrives, for at most timeout seconds when timeout is above 0, or
+// not at all when it is 0
+static void processEvents(GLFWwindow* window, double timeout)
+{
+    double start = nowSeconds();
+
+    glfwPollEvents();
+    if (!eventsTimed)
+    {
+        frameLog[(framesDrawn - 1) % FRAME_LOG_SIZE].stage[STAGE_EVENTS] = (float)(nowSeconds() - start);
+        eventsTimed = 1;
+    }
+
+    if (viewDirty || timeout == 0 || glfwWindowShouldClose(window))
+        return;
+    if (timeout > 0)
+        glfwWaitEventsTimeout(timeout);
+    else
+        glfwWaitEvents();
+}
+
+// Draws the image with the current transformation
+static void drawFrame(GLFWwindow* window, GLuint program, GLint mvp_location, TextureGrid *grid)
+{
+    int windowWidth, windowHeight;
+    static int titleDrawn = -1, titleCulled = -1;
+    char title[96];
+    mat4x4 mvp;
+    FrameTiming *timing = &frameLog[framesDrawn % FRAME_LOG_SIZE];
+    double mark, now;
+
+    timing->start = mark = nowSeconds();
+    glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
+
+    glViewport(0, 0, windowWidth, windowHeight);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // Render the updated version of the image with the transform
+    // key_callback last built
+    mat4x4_from_mat2x3(mvp, view);
+    now = nowSeconds();
+    timing->stage[STAGE_MATRIX] = (float)(now - mark);
+    mark = now;
+
+    glUseProgram(program);
+    glUniformMatrix4fv(mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+    now = nowSeconds();
+    timing->stage[STAGE_UNIFORM] = (float)(now - mark);
+    mark = now;
+
+    // GL runs behind, so this is only the time to hand the draws over
+    drawTextureGrid(grid, view, windowWidth, windowHeight);
+    now = nowSeconds();
+    timing->stage[STAGE_DRAW] = (float)(now - mark);
+    mark = now;
+
+    // and this includes waiting for vsync
+    glfwSwapBuffers(window);
+    timing->stage[STAGE_SWAP] = (float)(nowSeconds() - mark);
+    timing->stage[STAGE_EVENTS] = 0;
+    timing->stage[STAGE_UPLOAD] = 0;
+    timing->stage[STAGE_DECODE] = 0;
+    eventsTimed = 0;
+    viewDirty = 0;
+    framesDrawn++;
+
+    // Tiled images show how many tiles made it through culling in the title
+    if (grid->count > 1 && (grid->drawn != titleDrawn || grid->culled != titleCulled))
+    {
+        titleDrawn = grid->drawn;
+        titleCulled = grid->culled;
+        snprintf(title, sizeof(title), "EZ-View - %d of %d tiles drawn, %d culled",
+                 grid->drawn, grid->count, grid->culled);
+        glfwSetWindowTitle(window, title);
+    }
+}
+
+
+// Plays every frame of a multi-image file in a loop. Frame 0 is already in
+// the texture. While one frame is on screen the next is decoded on the
+// decode thread into the other half of a double buffer, then uploaded with
+// uploadGridRows once it is due. Rasters that can be used in place skip
+// the buffer and upload straight from the file
+static void playAnimation(GLFWwindow* window, GLuint program, GLint mvp_location,
+                          TextureGrid *grid, ImageLoader *loader, const Frame *frames, int frameCount)
+{
+    Pixmap *buffer = loader->pixmap;
+    size_t frameSize = (size_t)buffer->width * buffer->height * buffer->channels;
+    unsigned char *buffers[2] = { NULL, NULL };
+    int shown = 0, back = 1, next, maxColor = loader->header.maxColor;
+    double deadline = nowSeconds() + 1 / framesPerSecond;
+    double uploadTime, started;
+    Thread decoder;
+    int decoderRunning;
+
+    // The first frame's heap buffer, if it has one, becomes half of the pair
+    if (!rasterInPlace(&frames[0].header))
+        buffers[0] = buffer->image;
+
+    while (!glfwWindowShouldClose(window))
+    {
+        next = (shown + 1) % frameCount;
+
+        // Point the loader at the next frame and its half of the buffer
+        loader->header = frames[next].header;
+        loader->cursor = frames[next].header.rasterOffset;
+        loader->rasterEnd = frames[next].rasterEnd;
+        loader->rowsDone = 0;
+        loader->bandRows = 0;
+        loader->rowsReady = 0;
+        loader->failed = 0;
+        if (loader->header.maxColor != maxColor)
+        {
+            free(loader->lut);
+            maxColor = loader->header.maxColor;
+            loader->lut = buildSampleLut(maxColor);
+            if (!loader->lut)
+                break;
+        }
+        if (rasterInPlace(&loader->header))
+            buffer->image = buffer->source.data + loader->header.rasterOffset;
+        else
+        {
+            if (!buffers[back])
+                buffers[back] = (unsigned char *)malloc(frameSize);
+            if (!buffers[back])
+                break;
+            buffer->image = buffers[back];
+        }
+
+        decoderRunning = 1;
+        if (!startThread(&decoder, decodeThread, loader))
+        {
+            decodeThread(loader);
+            decoderRunning = 0;
+        }
+
+        // Keep the current frame up until the next one is due, only
+        // redrawing it if something changes in the meantime
+        do
+        {
+            if (viewDirty)
+                drawFrame(window, program, mvp_location, grid);
+            processEvents(window, deadline > nowSeconds() ? deadline - nowSeconds() : 0);
+        } while (nowSeconds() < deadline && !glfwWindowShouldClose(window));
+
+        if (decoderRunning)
+            joinThread(decoder);
+        if (atomicLoad(&loader->failed))
+        {
+            fprintf(stderr,"\nERROR: Could not read the entire image! (frame %d)\n", next);
+            break;
+        }
+
+        started = nowSeconds();
+        uploadGridRows(grid, buffer->image, 0, buffer->height);
+        uploadTime = nowSeconds() - started;
+
+        // Presenting is logged by drawFrame, the rest goes in with it
+        drawFrame(window, program, mvp_location, grid);
+        frameLog[(framesDrawn - 1) % FRAME_LOG_SIZE].stage[STAGE_UPLOAD] = (float)uploadTime;
+        frameLog[(framesDrawn - 1) % FRAME_LOG_SIZE].stage[STAGE_DECODE] =
+            (float)(loader->decodeEnd - loader->decodeStart);
+        processEvents(window, 0);
+
+        if (!rasterInPlace(&loader->header))
+            back ^= 1;
+        shown = next;
+
+        // Fall back into step rather than racing to catch up after a stall
+        deadline += 1 / framesPerSecond;
+        if (deadline < nowSeconds())
+            deadline = nowSeconds() + 1 / framesPerSecond;
+    }
+
+    // Everything but the buffers goes back to the caller to clean up
+    free(buffers[0]);
+    free(buffers[1]);
+    buffer->image = NULL;
+}
+
+///////////////////////////////////// SELF TEST /////////////////////////////////////
+
+// Checks for things that once went wrong (-selftest). Each one prints a
+// line and returns 0 if it failed, so they can all run before the exit
+// code says whether any did
+
+// Wraps data in a gzip member of stored deflate blocks, which is all the
+// tests need to go through the real inflater. Returns NULL if out of memory
+static unsigned char *gzipStored(const unsigned char *data, size_t size, size_t *gzipSize)
+{
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+    size_t blocks = size / 65535 + 1, i, length;
+    unsigned char *out = (unsigned char *)malloc(10 + blocks * 5 + size + 8), *p;
+    unsigned long crc;
+
+    if (!out)
+        return NULL;
+    memcpy(out, header, 10);
+    p = out + 10;
+    for (i = 0; i < blocks; i++)
+    {
+        length = size - i * 65535 < 65535 ? size - i * 65535 : 65535;
+        *p++ = (unsigned char)(i + 1 == blocks);
+        p[0] = (unsigned char)length;
+        p[1] = (unsigned char)(length >> 8);
+        p[2] = (unsigned char)~length;
+        p[3] = (unsigned char)(~length >> 8);
+        memcpy(p + 4, data + i * 65535, length);
+        p += 4 + length;
+    }
+    crc = crc32Update(0, data, size);
+    for (i = 0; i < 4; i++)
+        p[i] = (unsigned char)(crc >> (8 * i));
+    for (i = 0; i < 4; i++)
+        p[4 + i] = (unsigned char)(size >> (8 * i));
+    *gzipSize = (size_t)(p + 8 - out);
+    return out;
+}
+
+// Decodes a gzipped P3 from memory the way a file would be. Returns what
+// decodeCompressed did, -1 if the test itself could not be set up
+static int decodeGzippedText(const char *text, size_t size)
+{
+    ImageLoader loader;
+    Pixmap pixmap;
+    int result = -1;
+
+    memset(&loader, 0, sizeof(loader));
+    memset(&pixmap, 0, sizeof(pixmap));
+    if (!parsePpmHeader((const unsigned char *)text, size, &loader.header))
+        return -1;
+    pixmap.width = loader.header.width;
+    pixmap.height = loader.header.height;
+    pixmap.channels = loader.header.depth;
+    pixmap.magicNumber = loader.header.magicNumber;
+    pixmap.image = (unsigned char *)malloc((size_t)pixmap.width * pixmap.height * pixmap.channels);
+    pixmap.source.data = gzipStored((const unsigned char *)text, size, &pixmap.source.size);
+    loader.pixmap = &pixmap;
+    loader.lut = buildSampleLut(loader.header.maxColor);
+    loader.compression = COMPRESSION_GZIP;
+    if (pixmap.image && pixmap.source.data && loader.lut)
+        result = decodeCompressed(&loader);
+    free(pixmap.image);
+    free(pixmap.source.data);
+    free(loader.lut);
+    return result;
+}
+
+// A stray letter among the samples of a gzipped P3 several times the size
+// of the text window. It has to fail, it used to leave the window full and
+// spin on it forever
+static int checkGzippedTextJunk(void)
+{
+    int width = 700, height = 700, good, bad;
+    size_t samples = (size_t)width * height * 3, room = samples * 4 + 64, length, i;
+    char *text = (char *)malloc(room);
+
+    if (!text)
+        return 0;
+    length = (size_t)sprintf(text, "P3\n%d %d\n255\n", width, height);
+    for (i = 0; i < samples; i++)
+        length += (size_t)sprintf(text + length, "%d%c", (int)(i * 7 % 256), i % 24 == 23 ? '\n' : ' ');
+
+    good = decodeGzippedText(text, length);
+    text[length / 2 - (text[length / 2] == ' ' || text[length / 2] == '\n')] = 'x';
+    bad = decodeGzippedText(text, length);
+    free(text);
+    printf("Self test: gzipped P3 with a stray letter %s\n", good == 1 && bad == 0 ? "fails as it should" : "FAILED");
+    return good == 1 && bad == 0;
+}
+
+#ifdef EZ_X86
+
+// renderRowSse2 against renderRowScalar, the version non x86 builds draw
+// with, which has to give the very same bytes. Small made up sources of
+// every channel count go through random views with both samplings,
+// including ones that run over the edges of the quad
+static int checkRenderRows(void)
+{
+    RenderJob job;
+    Pixmap source;
+    unsigned char *scalar, *simd;
+    double angle, zoom;
+    int trial, y, mismatches = 0;
+    size_t k;
+
+    srand(430);
+    job.width = 97;
+    job.height = 61;
+    scalar = (unsigned char *)malloc((size_t)job.width * 3);
+    simd = (unsigned char *)malloc((size_t)job.width * 3);
+    source.image = (unsigned char *)malloc(64 * 64 * 4);
+    if (!scalar || !simd || !source.image)
+    {
+        free(scalar);
+        free(simd);
+        free(source.image);
+        return 0;
+    }
+    for (k = 0; k < 64 * 64 * 4; k++)
+        source.image[k] = (unsigned char)rand();
+
+    for (trial = 0; trial < 400; trial++)
+    {
+        source.width = 1 + rand() % 64;
+        source.height = 1 + rand() % 64;
+        source.channels = 1 + trial % 4;
+        job.source = &source;
+        job.sampling = trial / 4 % 2 ? SAMPLE_BILINEAR : SAMPLE_NEAREST;
+        angle = rand() * 2 * pi / RAND_MAX;
+        zoom = 0.2 + 3.0 * rand() / RAND_MAX;
+        job.sMax = vertexes[0].TexCoord[0] * source.width;
+        job.tMax = vertexes[0].TexCoord[1] * source.height;
+        job.toTexel[0][0] = (float)(cos(angle) / zoom);
+        job.toTexel[0][1] = (float)(sin(angle) / zoom);
+        job.toTexel[1][0] = (float)(-sin(angle) / zoom);
+        job.toTexel[1][1] = (float)(cos(angle) / zoom);
+        job.toTexel[2][0] = (float)(source.width / 2.0 -
+                                    (job.toTexel[0][0] * job.width + job.toTexel[1][0] * job.height) / 2);
+        job.toTexel[2][1] = (float)(source.height / 2.0 -
+                                    (job.toTexel[0][1] * job.width + job.toTexel[1][1] * job.height) / 2);
+        for (y = 0; y < job.height; y++)
+        {
+            renderRowScalar(&job, y, scalar);
+            renderRowSse2(&job, y, simd);
+            mismatches += memcmp(scalar, simd, (size_t)job.width * 3) != 0;
+        }
+    }
+    free(scalar);
+    free(simd);
+    free(source.image);
+    if (mismatches)
+        printf("Self test: SSE2 and scalar render rows FAILED, %d rows differ\n", mismatches);
+    else
+        printf("Self test: SSE2 and scalar render rows match\n");
+    return !mismatches;
+}
+
+#endif
+
+// The three passes against the warp, bilinear, on a made up smooth image
+// through the views that showed the biggest differences. 99 in 100
+// samples have to be within a level of the warp's. The largest difference
+// is only reported, the quad's edges and any sharp ones in the image are
+// allowed their tens of levels. A view the passes turn down fails the
+// check, it would compare nothing. The view is put back afterwards
+static int checkShearAgreement(void)
+{
+    static const struct { float degrees, shearX, zoom; } views[] = {
+        { 89.9f, 0, 1 }, { 30, 0, 1 }, { 60, 0.3f, 1 }, { 10, 0, 1.5f }
+    };
+    SavedView saved;
+    int width = 320, height = 240, x, y, v, level, worstP99 = 0, largest = 0, declined = 0;
+    size_t bytes = (size_t)width * height * 3, histogram[256], k, count;
+    unsigned char *warp = (unsigned char *)malloc(bytes), *shear = (unsigned char *)malloc(bytes), *p;
+    Pixmap source;
+
+    source.width = source.height = 256;
+    source.channels = 3;
+    source.image = (unsigned char *)malloc(256 * 256 * 3);
+    if (!warp || !shear || !source.image)
+    {
+        free(warp);
+        free(shear);
+        free(source.image);
+        return 0;
+    }
+    for (y = 0, p = source.image; y < 256; y++)
+    {
+        for (x = 0; x < 256; x++, p += 3)
+        {
+            p[0] = (unsigned char)x;
+            p[1] = (unsigned char)y;
+            p[2] = (unsigned char)(128 + 100 * sin(x / 20.0) * cos(y / 30.0));
+        }
+    }
+
+    saveView(&saved);
+    rotation = 0;
+    shearY = 0;
+    translateX = translateY = 0;
+    quarterTurns = 0;
+    for (v = 0; v < (int)(sizeof(views) / sizeof(views[0])); v++)
+    {
+        rotation = (float)(views[v].degrees * pi / 180);
+        shearX = views[v].shearX;
+        scale = views[v].zoom;
+        buildView();
+        renderView(&source, viewInverse, width, height, SAMPLE_BILINEAR, WALK_FIXED, warp);
+        if (!renderSheared(&source, viewInverse, width, height, SAMPLE_BILINEAR, shear))
+        {
+            declined++;
+            continue;
+        }
+        memset(histogram, 0, sizeof(histogram));
+        for (k = 0; k < bytes; k++)
+            histogram[warp[k] > shear[k] ? warp[k] - shear[k] : shear[k] - warp[k]]++;
+        for (level = 0, count = histogram[0]; count < bytes - bytes / 100; count += histogram[++level])
+            ;
+        if (level > worstP99)
+            worstP99 = level;
+        for (level = 255; level > largest && !histogram[level]; level--)
+            ;
+        if (level > largest)
+            largest = level;
+    }
+
+    restoreView(&saved);
+    free(warp);
+    free(shear);
+    free(source.image);
+    if (declined)
+        printf("Self test: three shears against the warp FAILED, %d views fell back to the warp\n", declined);
+    else
+        printf("Self test: three shears against the warp, 99%% of samples within %d of the warp's, all within %d%s\n",
+               worstP99, largest, worstP99 <= 1 ? "" : ", FAILED");
+    return worstP99 <= 1 && !declined;
+}
+
+// Headers whose pixmap would not fit in an int once had their size wrap
+// around before the allocation. They have to be refused, while ordinary and
+// merely big ones still go through
+static int checkHugeHeaders(void)
+{
+    static const char *headers[] = {
+        "P6\n100000 100000\n255\n",
+        "P7\nWIDTH 2000000000\nHEIGHT 2\nDEPTH 4\nMAXVAL 255\nENDHDR\n",
+        "P3\n2000000000 2000000000\n65535\n",
+        "P6\n640 480\n255\n",
+        "P7\nWIDTH 30000\nHEIGHT 20000\nDEPTH 4\nMAXVAL 255\nENDHDR\n"
+    };
+    static const int allowed[] = { 0, 0, 0, 1, 1 };
+    PpmHeader header;
+    int i, passed = 1;
+
+    for (i = 0; i < (int)(sizeof(headers) / sizeof(headers[0])); i++)
+        passed &= parsePpmHeader((const unsigned char *)headers[i], strlen(headers[i]), &header) &&
+                  imageSizeAllowed(&header, header.depth) == allowed[i];
+    printf("Self test: oversized headers %s\n", passed ? "are refused" : "FAILED");
+    return passed;
+}
+
+// Runs every check (-selftest) and says whether they all passed
+static int selfTest(void)
+{
+    int passed = 1;
+
+    initCrc32();
+    passed &= checkGzippedTextJunk();
+#ifdef EZ_X86
+    passed &= checkRenderRows();
+#endif
+    passed &= checkShearAgreement();
+    passed &= checkHugeHeaders();
+    printf("Self test: %s\n", passed ? "all passed" : "FAILED");
+    return passed;
+}
+
+// Main will both load the ppm image be it P6 or P3
+// and will load that image into the ez-view application in order to
+// perform some affine transformations on it
+int main(int argc, char *argv[])
+{
+    GLFWwindow* window;
+    GLuint vertex_buffer, vertex_shader, fragment_shader, program;
+    GLint mvp_location, vpos_location;
+
+///////////////////////////////////// START OF IMAGE LOADING /////////////////////////////////////
+
+    // Create variables for the image loading
+    PpmHeader header;
+    ImageLoader loader;
+    Thread decoder;
+    int decoderRunning = 1;
+    int width, height, maxColor;
+    int i, stream = 0, timeline = 0;
+    size_t size;
+    const char *path = NULL;
+    Frame *frames;
+    int frameCount;
+    DecodeCache cache;
+    int useCache = 1, clearCache = 0, cached = 0, useAsync;
+    int compression, benchUpload = 0, benchRender = 0, etc1Test = 0;
+    const char *renderPath = NULL, *exportPath = NULL;
+    int benchTurn = 0, benchShear = 0, benchResize = 0, runSelfTest = 0;
+    int renderWidth = 640, renderHeight = 480, sizeGiven = 0;
+    unsigned char *peek;
+    TextureGrid grid;
+
+    // Startup timeline, all relative to launch
+    double launch = nowSeconds(), contextStart, contextEnd, compileEnd;
+    double uploadStart, uploadEnd, firstSwap = 0;
+    double viewStart, viewCpu;
+    long viewFrames;
+
+    // ezview [-stream] [-async] [-timeline] [-framecsv out.csv] [-dither] [-fps n]
+    //        [-tile n] [-nomip] [-upload packed|pitched|rgba] [-etc1 fast|best]
+    //        [-nocache] [-clearcache] [-cachesize mb] file.ppm
+    // ezview -render out.ppm [-size WxH] [-sample nearest|bilinear|bicubic|lanczos]
+    //        [-engine warp|shear] [-turn n] [-rotate degrees] [-zoom s] [-move x y] [-shear x y] file.ppm
+    // ezview -export out.ppm [-turn n] [-size WxH] [-sample nearest|bilinear|bicubic|lanczos] file.ppm
+    // ezview -etc1test file.ppm
+    // ezview -benchupload
+    // ezview -benchrender
+    // ezview -benchturn
+    // ezview -benchshear
+    // ezview -benchresize
+    // ezview -selftest
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-stream") == 0)
+            stream = 1;
+        else if (strcmp(argv[i], "-async") == 0)
+            asyncReads = stream = 1;
+        else if (strcmp(argv[i], "-tile") == 0 && i + 1 < argc)
+            tileSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-nomip") == 0)
+            mipmaps = 0;
+        else if (strcmp(argv[i], "-upload") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "packed") == 0)
+                uploadMode = UPLOAD_PACKED;
+            else if (strcmp(argv[i], "pitched") == 0)
+                uploadMode = UPLOAD_PITCHED;
+            else if (strcmp(argv[i], "rgba") == 0)
+                uploadMode = UPLOAD_RGBA;
+            else
+            {
+                fprintf(stderr, "\nERROR: -upload takes packed, pitched or rgba!");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-benchupload") == 0)
+            benchUpload = 1;
+        else if (strcmp(argv[i], "-benchrender") == 0)
+            benchRender = 1;
+        else if (strcmp(argv[i], "-benchturn") == 0)
+            benchTurn = 1;
+        else if (strcmp(argv[i], "-benchshear") == 0)
+            benchShear = 1;
+        else if (strcmp(argv[i], "-benchresize") == 0)
+            benchResize = 1;
+        else if (strcmp(argv[i], "-etc1") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "fast") == 0)
+                etc1Mode = ETC1_FAST;
+            else if (strcmp(argv[i], "best") == 0)
+                etc1Mode = ETC1_BEST;
+            else
+            {
+                fprintf(stderr, "\nERROR: -etc1 takes fast or best!");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-etc1test") == 0)
+            etc1Test = 1;
+        else if (strcmp(argv[i], "-nocache") == 0)
+            useCache = 0;
+        else if (strcmp(argv[i], "-clearcache") == 0)
+            clearCache = 1;
+        else if (strcmp(argv[i], "-cachesize") == 0 && i + 1 < argc)
+            cacheBudget = (unsigned long long)atof(argv[++i]) * 1024 * 1024;
+        else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc)
+        {
+            framesPerSecond = atof(argv[++i]);
+            if (framesPerSecond <= 0)
+                framesPerSecond = 24;
+        }
+        else if (strcmp(argv[i], "-dither") == 0)
+            dither = 1;
+        else if (strcmp(argv[i], "-timeline") == 0)
+            timeline = 1;
+        else if (strcmp(argv[i], "-framecsv") == 0 && i + 1 < argc)
+            frameCsvPath = argv[++i];
+        else if (strcmp(argv[i], "-render") == 0 && i + 1 < argc)
+            renderPath = argv[++i];
+        else if (strcmp(argv[i], "-size") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &renderWidth, &renderHeight) != 2 ||
+                renderWidth <= 0 || renderHeight <= 0)
+            {
+                fprintf(stderr, "\nERROR: -size takes WxH, e.g. 1920x1080!");
+                exit(-1);
+            }
+            sizeGiven = 1;
+        }
+        else if (strcmp(argv[i], "-sample") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "nearest") == 0)
+                renderSampling = SAMPLE_NEAREST;
+            else if (strcmp(argv[i], "bilinear") == 0)
+                renderSampling = SAMPLE_BILINEAR;
+            else if (strcmp(argv[i], "bicubic") == 0)
+                renderSampling = SAMPLE_BICUBIC;
+            else if (strcmp(argv[i], "lanczos") == 0)
+                renderSampling = SAMPLE_LANCZOS;
+            else
+            {
+                fprintf(stderr, "\nERROR: -sample takes nearest, bilinear, bicubic or lanczos!");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-engine") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "warp") == 0)
+                renderEngine = ENGINE_WARP;
+            else if (strcmp(argv[i], "shear") == 0)
+                renderEngine = ENGINE_SHEAR;
+            else
+            {
+                fprintf(stderr, "\nERROR: -engine takes warp or shear!");
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-export") == 0 && i + 1 < argc)
+            exportPath = argv[++i];
+        // The same values the keys change, for -render
+        else if (strcmp(argv[i], "-turn") == 0 && i + 1 < argc)
+            quarterTurns = atoi(argv[++i]) & 3;
+        else if (strcmp(argv[i], "-rotate") == 0 && i + 1 < argc)
+            rotation = (float)(atof(argv[++i]) * pi / 180);
+        else if (strcmp(argv[i], "-zoom") == 0 && i + 1 < argc)
+            scale = (float)atof(argv[++i]);
+        else if (strcmp(argv[i], "-move") == 0 && i + 2 < argc)
+        {
+            translateX = (float)atof(argv[++i]);
+            translateY = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-shear") == 0 && i + 2 < argc)
+        {
+            shearX = (float)atof(argv[++i]);
+            shearY = (float)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-selftest") == 0)
+            runSelfTest = 1;
+        else
+            path = argv[i];
+    }
+
+    haveAvx2 = cpuHasAvx2();
+    haveSsse3 = cpuHasSsse3();
+    buildView();
+
+    if (benchTurn)
+    {
+        benchmarkTurns();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (benchShear)
+    {
+        benchmarkShear();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (benchResize)
+    {
+        benchmarkResize();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (benchRender)
+    {
+        benchmarkRender();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (benchUpload)
+    {
+        benchmarkUploads();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (runSelfTest)
+        exit(selfTest() ? EXIT_SUCCESS : EXIT_FAILURE);
+
+    if (clearCache)
+    {
+        if (cacheDirectory(cache.directory, sizeof(cache.directory)))
+            printf("Decode cache: removed %d entries from %s\n",
+                   trimDecodeCache(cache.directory, 0), cache.directory);
+        if (path == NULL)
+            exit(EXIT_SUCCESS);
+    }
+
+    //Create a buffer for the pixmap image
+    Pixmap *buffer = (Pixmap *)malloc(sizeof(Pixmap));
+    if(!buffer)
+    {
+        fprintf(stderr, "\nERROR: Cannot allocate memory for the ppm image.");
+        exit(-1);
+    }
+    buffer->image = NULL;
+
+    if(path == NULL || !openMappedFile(path, &buffer->source))
+    {
+        fprintf(stderr, "\nERROR: File cannot be opened & or does not Exist!");
+        free(buffer);
+        exit(-1);
+    }
+
+    // Compressed files get their header from the first few decompressed
+    // bytes. The raster offset is then an offset into the decompressed stream
+    compression = compressionOf(&buffer->source);
+#ifndef EZVIEW_ZSTD
+    if (compression == COMPRESSION_ZSTD)
+    {
+        fprintf(stderr, "\nERROR: This ezview was built without zstd support (EZVIEW_ZSTD)!");
+        freePixmap(buffer);
+        exit(-1);
+    }
+#endif
+    if (compression)
+    {
+        initCrc32();
+        peek = (unsigned char *)malloc(PEEK_BYTES);
+        size = peek ? peekCompressed(&buffer->source, compression, peek) : 0;
+        i = size > 0 && parsePpmHeader(peek, size, &header);
+        free(peek);
+    }
+    else
+        i = parsePpmHeader(buffer->source.data, buffer->source.size, &header);
+
+    if (!i) //if not in a netpbm format we know then exit
+    {
+        fprintf(stderr, "\nERROR: This is not in the correct ppm format!");
+        freePixmap(buffer);
+        exit(-1);
+    }
+
+    width = header.width;
+    height = header.height;
+    maxColor = header.maxColor;
+
+    if(maxColor > 65535 || maxColor <= 0){
+        fprintf(stderr,"\nERROR: Image is not 8 or 16 bits per channel!");
+        freePixmap(buffer);
+        exit(-1);
+    }
+    buffer->width = width;
+    buffer->height = height;
+    buffer->magicNumber = header.magicNumber;
+    buffer->channels = header.depth;
+    if (!imageSizeAllowed(&header, buffer->channels))
+    {
+        fprintf(stderr, "\nERROR: Image is too large, %d x %d with %d channels!", width, height, buffer->channels);
+        freePixmap(buffer);
+        exit(-1);
+    }
+
+    // mult the size by three to account for rgb, grayscale stays at one
+    size = (size_t)width * height * buffer->channels;
+
+    // Binary rasters have to be all there before we start pointing into them
+    if (!compression && buffer->source.size - header.rasterOffset < rawRasterSize(&header, buffer->channels))
+    {
+        fprintf(stderr,"\nERROR: Could not read the entire image! \n");
+        freePixmap(buffer);
+        exit(-1);
+    }
+
+    // Text images that were decoded before come back from the cache as an
+    // 8 bit raw raster, which from here on loads just like a P5 or P6.
+    // Only single images are ever stored, so a hit needs no frame index
+    useCache = useCache && header.magicNumber <= 3 && openDecodeCache(&cache, path, &buffer->source);
+    if (useCache)
+    {
+        MappedFile entry;
+        if (loadDecodeCache(&cache, &header, &entry))
+        {
+            closeMappedFile(&buffer->source);
+            buffer->source = entry;
+            header.magicNumber = header.depth == 1 ? 5 : 6;
+            header.maxColor = maxColor = 255;
+            header.rasterOffset = CACHE_RASTER_OFFSET;
+            compression = COMPRESSION_NONE;
+            cached = 1;
+        }
+    }
+
+    // Any more images after this one turn the file into an animation.
+    // A bad first image is left for the decoder to complain about.
+    // Compressed files only ever show their first image
+    frameCount = 1;
+    frames = NULL;
+    if (!compression)
+        frameCount = indexFrames(&buffer->source, &header, &frames);
+    if (frameCount > 1)
+        printf("Animation: %d frames at %g fps\n", frameCount, framesPerSecond);
+
+    // With -async binary rasters are read in chunks instead of through the
+    // mapping, so they can not be used in place
+    useAsync = asyncReads && rawRasterSize(&header, buffer->channels) && buffer->source.mapped &&
+               !compression;
+
+    // Read the image into the buffer depending on which format it is in
+    // If its raw bits that need no conversion
+    if(rasterInPlace(&header) && !useAsync && !compression)
+    {   // The raster is already in memory so just point the pixmap at it
+        buffer->image = buffer->source.data + header.rasterOffset;
+        printf("P%d loader: %s, zero copy\n", buffer->magicNumber,
+               cached ? "decode cache hit" :
+               buffer->source.mapped ? "memory mapped" : "read into the heap");
+    }
+    else
+    {
+        // Allocate memory for the entire image
+        buffer->image = (unsigned char *)malloc(size);
+        if(!buffer->image){
+            fprintf(stderr,"\nERROR: Cannot allocate memory for the ppm image!");
+            freePixmap(buffer);
+            exit(-1);
+        }
+
+        if (compression)
+            printf("P%d loader: %s, decompressed straight into the image\n", header.magicNumber,
+                   compression == COMPRESSION_GZIP ? "gzip" : "zstd");
+        else if (rawRasterSize(&header, buffer->channels))
+            printf("P%d loader: %s, %s\n", header.magicNumber,
+                   useAsync ? "async chunked reads" :
+                   buffer->source.mapped ? "memory mapped" : "read into the heap",
+                   header.magicNumber == 4 ? "bits expanded" :
+                   maxColor > 255 ? "16 bit converted to 8" :
+                   maxColor < 255 ? "rescaled to 255" : "read into the image");
+    }
+
+    loader.pixmap = buffer;
+    loader.header = header;
+    loader.lut = buildSampleLut(maxColor);
+    if (!loader.lut)
+    {
+        fprintf(stderr,"\nERROR: Cannot allocate memory for the ppm image!");
+        freePixmap(buffer);
+        exit(-1);
+    }
+    loader.cursor = header.rasterOffset;
+    loader.rasterEnd = frames ? frames[0].rasterEnd : buffer->source.size;
+    loader.rowsDone = 0;
+    loader.bandRows = 0;
+    loader.cancel = 0;
+    loader.rowsReady = 0;
+    loader.failed = 0;
+    loader.reader = NULL;
+    loader.compression = compression;
+
+    // The readers start right away. If they can not, a raster that was
+    // going to be read into the image is used from the mapping after all
+    if (useAsync)
+    {
+        loader.reader = startChunkReader(path, &header, buffer);
+        if (!loader.reader && rasterInPlace(&header))
+        {
+            free(buffer->image);
+            buffer->image = buffer->source.data + header.rasterOffset;
+        }
+    }
+
+    // In streaming mode rows are published in bands of roughly STREAM_BAND_BYTES
+    if (stream)
+    {
+        loader.bandRows = STREAM_BAND_BYTES / (width * buffer->channels);
+        if (loader.bandRows < 1)
+            loader.bandRows = 1;
+    }
+
+    // Decode on a background thread while the window, context and shaders
+    // come up on this one. If the thread will not start just decode here
+    if (!startThread(&decoder, decodeThread, &loader))
+    {
+        decodeThread(&loader);
+        decoderRunning = 0;
+    }
+
+    // The ETC1 check only needs the decoded pixels, no window
+    if (etc1Test)
+    {
+        if (decoderRunning)
+            joinThread(decoder);
+        if (atomicLoad(&loader.failed))
+        {
+            fprintf(stderr,"\nERROR: Could not read the entire image! \n");
+            freePixmap(buffer);
+            exit(-1);
+        }
+        testEtc1(buffer);
+        freePixmap(buffer);
+        exit(EXIT_SUCCESS);
+    }
+
+    // So does rendering on the cpu, or saving the turned image
+    if (renderPath || exportPath)
+    {
+        if (decoderRunning)
+            joinThread(decoder);
+        if (atomicLoad(&loader.failed))
+        {
+            fprintf(stderr,"\nERROR: Could not read the entire image! \n");
+            freePixmap(buffer);
+            exit(-1);
+        }
+        if (renderPath)
+            renderToFile(buffer, renderPath, renderWidth, renderHeight, renderSampling);
+        if (exportPath)
+            exportToFile(buffer, exportPath, sizeGiven ? renderWidth : 0, sizeGiven ? renderHeight : 0,
+                         renderSampling);
+        freePixmap(buffer);
+        exit(EXIT_SUCCESS);
+    }
+
+///////////////////////////////////// END OF IMAGE LOADING /////////////////////////////////////
+
+    contextStart = nowSeconds();
+
+    // initialize glfw library
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+
+    // Same hints used in the demo provided
+	glfwDefaultWindowHints();
+	glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+	glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+
+    window = glfwCreateWindow(640, 480, "EZ-View", NULL, NULL);
+
+    // If the window does not initiate then terminate the program and close the window
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    // Turn on key callback in order to take in the user inputs
+    // for affine transformations
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    glfwSetWindowRefreshCallback(window, refresh_callback);
+
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(1);
+    contextEnd = nowSeconds();
+
+    // ETC1 needs the extension and has no alpha, otherwise it is quietly
+    // uncompressed after a note
+    if (etc1Mode != ETC1_OFF)
+    {
+        const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+        if (!extensions || !strstr(extensions, "GL_OES_compressed_ETC1_RGB8_texture"))
+        {
+            printf("ETC1: not supported by this driver, uploading uncompressed\n");
+            etc1Mode = ETC1_OFF;
+        }
+        else if (buffer->channels == 2 || buffer->channels == 4)
+        {
+            printf("ETC1: has no alpha, uploading uncompressed\n");
+            etc1Mode = ETC1_OFF;
+        }
+        else
+            printf("ETC1: %s preset, %.1f MB of texture instead of %.1f MB\n",
+                   etc1Mode == ETC1_FAST ? "fast" : "best", etc1Size(width, height) / 1048576.0,
+                   (double)width * height * (uploadMode == UPLOAD_RGBA && buffer->channels == 3 ? 4 : buffer->channels) / 1048576.0);
+    }
+
+    // One texture per tile, a single one unless the image is bigger than
+    // the driver allows or -tile asks for smaller tiles
+    if (!createTextureGrid(&grid, width, height, buffer->channels, pixmapFormat(buffer)))
+    {
+        fprintf(stderr,"\nERROR: Cannot allocate memory for the texture tiles!");
+        exit(-1);
+    }
+    if (grid.count > 1)
+        printf("Texture grid: %d x %d tiles of up to %d pixels\n", grid.columns, grid.rows, grid.tileSize);
+
+    glGenBuffers(1, &vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 6 * grid.count, grid.vertices, GL_STATIC_DRAW);
+
+    // Create the vertex shader and  do some error checking
+    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
+    glCompileShaderOrDie(vertex_shader);
+
+    // Create the fragment shader and do some error checking
+    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
+    glCompileShaderOrDie(fragment_shader);
+
+
+    // Create the program and do some error checking
+    program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+    glLinkProgramOrDie(program);
+    compileEnd = nowSeconds();
+
+    mvp_location = glGetUniformLocation(program, "MVP");
+    assert(mvp_location != -1);
+
+    vpos_location = glGetAttribLocation(program, "vPos");
+    assert(vpos_location != -1);
+
+    GLint texcoord_location = glGetAttribLocation(program, "TexCoordIn");
+    assert(texcoord_location != -1);
+
+    GLint tex_location = glGetUniformLocation(program, "Texture");
+    assert(tex_location != -1);
+
+    glEnableVertexAttribArray(vpos_location);
+    glVertexAttribPointer(vpos_location,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (void*) 0);
+
+    glEnableVertexAttribArray(texcoord_location);
+    glVertexAttribPointer(texcoord_location,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(Vertex),
+                          (void*) (sizeof(float) * 2));
+
+    // Everything else is ready, now we need the pixels. Streaming only has
+    // to wait for the decode thread once the texture is fully uploaded
+    if (!stream && decoderRunning)
+    {
+        joinThread(decoder);
+        decoderRunning = 0;
+    }
+
+    if (atomicLoad(&loader.failed))
+    {
+        fprintf(stderr,"\nERROR: Could not read the entire image! \n");
+        if (decoderRunning)
+            joinThread(decoder);
+        freePixmap(buffer);
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        exit(-1);
+    }
+
+    // Taken after the join, so the upload span holds no waiting on the parse
+    uploadStart = nowSeconds();
+    if (!stream)
+        uploadGridRows(&grid, buffer->image, 0, height);
+    uploadEnd = nowSeconds();
+
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(tex_location, 0);
+
+    // Images with alpha are blended over the background
+    if (buffer->channels == 2 || buffer->channels == 4)
+    {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+
+
+    // In streaming mode the texture starts out empty and every frame
+    // uploads whatever rows the decode thread has published since the last
+    if (stream)
+    {
+        int uploaded = 0;
+
+        while (uploaded < height && !glfwWindowShouldClose(window))
+        {
+            int ready = (int) atomicLoad(&loader.rowsReady);
+
+            if (atomicLoad(&loader.failed))
+            {
+                fprintf(stderr,"\nERROR: Could not read the entire image! \n");
+                joinThread(decoder);
+                freePixmap(buffer);
+                glfwDestroyWindow(window);
+                glfwTerminate();
+                exit(-1);
+            }
+
+            if (ready > uploaded)
+            {
+                uploadGridRows(&grid, buffer->image, uploaded, ready);
+                uploaded = ready;
+                uploadEnd = nowSeconds();
+                viewDirty = 1;
+            }
+
+            if (viewDirty)
+            {
+                drawFrame(window, program, mvp_location, &grid);
+                if (firstSwap == 0)
+                    firstSwap = nowSeconds();
+            }
+            processEvents(window, STREAM_WAIT_SECONDS);
+        }
+
+        atomicStore(&loader.cancel, 1);
+        if (decoderRunning)
+            joinThread(decoder);
+        if (loader.reader)
+        {
+            finishChunkReader(loader.reader, loader.rowsDone);
+            loader.reader = NULL;
+        }
+    }
+
+    if (firstSwap == 0)
+    {
+        drawFrame(window, program, mvp_location, &grid);
+        firstSwap = nowSeconds();
+        processEvents(window, 0);
+    }
+
+    // A freshly decoded text image is saved for next time once it is on
+    // screen, so the write does not hold up the first frame
+    if (useCache && !cached && frameCount == 1 && loader.rowsDone == height &&
+        !atomicLoad(&loader.failed))
+    {
+        if (storeDecodeCache(&cache, &header, buffer))
+            printf("Decode cache: saved %s\n", cache.entry);
+    }
+
+    // Mip levels wait for the first frame too. Animations go without, they
+    // would have to be rebuilt for every frame
+    if (mipmaps && frameCount == 1 && loader.rowsDone == height && !atomicLoad(&loader.failed))
+    {
+        double mipStart = nowSeconds();
+        if (buildGridMipmaps(&grid, buffer->image))
+            printf("Mipmaps: %d levels %s, built in %.1f ms\n", grid.levels,
+                   grid.mipmapped ? "as each tile's mip chain" : "as separate textures picked by zoom",
+                   (nowSeconds() - mipStart) * 1000);
+        viewDirty = 1;
+    }
+
+    if (timeline)
+    {
+        printf("Startup timeline (ms since launch)\n");
+        printf("  parse    %8.1f - %8.1f  (decode thread)\n",
+               (loader.decodeStart - launch) * 1000, (loader.decodeEnd - launch) * 1000);
+        printf("  context  %8.1f - %8.1f\n", (contextStart - launch) * 1000, (contextEnd - launch) * 1000);
+        printf("  compile  %8.1f - %8.1f\n", (contextEnd - launch) * 1000, (compileEnd - launch) * 1000);
+        printf("  upload   %8.1f - %8.1f\n", (uploadStart - launch) * 1000, (uploadEnd - launch) * 1000);
+        printf("  first swap          %8.1f\n", (firstSwap - launch) * 1000);
+    }
+
+    // From here on the image is just being looked at
+    viewStart = nowSeconds();
+    viewCpu = processCpuSeconds();
+    viewFrames = framesDrawn;
+
+    if (frameCount > 1)
+        playAnimation(window, program, mvp_location, &grid, &loader, frames, frameCount);
+
+    while (!glfwWindowShouldClose(window))
+    {
+        if (viewDirty)
+            drawFrame(window, program, mvp_location, &grid);
+
+        // Sleeps until there are events, which in this case come from the
+        // keyboard input and the window being resized or uncovered
+        processEvents(window, -1);
+    }
+
+    viewStart = nowSeconds() - viewStart;
+    viewCpu = processCpuSeconds() - viewCpu;
+    printf("Viewing: %ld frames drawn in %.1f s, %.2f s of cpu time (%.1f%% of a core)\n",
+           framesDrawn - viewFrames, viewStart, viewCpu, viewStart > 0 ? viewCpu / viewStart * 100 : 0);
+    printFrameTimes();
+    if (frameCsvPath)
+        writeFrameCsv(frameCsvPath);
+
+    // Clean Up
+    freeTextureGrid(&grid);
+    free(frames);
+    free(loader.lut);
+    freePixmap(buffer);
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
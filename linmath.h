@@ -902,4 +902,212 @@ static inline void quat_from_mat4x4(quat q, mat4x4 M)
 
 
 
+typedef float vec2[2];
+
+
+
+/* A 2D affine map stored like mat4x4, column by column: M[0] and M[1] are
+
+   where the x and y axes go and M[2] is the translation. It is the top two
+
+   rows of a 3x3 matrix whose last row is always 0 0 1 */
+
+typedef vec2 mat2x3[3];
+
+
+
+static inline void mat2x3_identity(mat2x3 M)
+
+{
+
+	M[0][0] = 1.f; M[0][1] = 0.f;
+
+	M[1][0] = 0.f; M[1][1] = 1.f;
+
+	M[2][0] = 0.f; M[2][1] = 0.f;
+
+}
+
+
+
+static inline void mat2x3_rotate(mat2x3 M, float angle)
+
+{
+
+	float s = sinf(angle);
+
+	float c = cosf(angle);
+
+	M[0][0] =  c; M[0][1] = s;
+
+	M[1][0] = -s; M[1][1] = c;
+
+	M[2][0] = 0.f; M[2][1] = 0.f;
+
+}
+
+
+
+/* quarters quarter turns counterclockwise, with entries of exactly 0 and 1
+
+   so repeated turns never drift */
+
+static inline void mat2x3_turn(mat2x3 M, int quarters)
+
+{
+
+	static const float c[4] = { 1.f, 0.f, -1.f, 0.f };
+
+	float cs = c[quarters & 3];
+
+	float sn = c[(quarters + 3) & 3];
+
+	M[0][0] =  cs; M[0][1] = sn;
+
+	M[1][0] = -sn; M[1][1] = cs;
+
+	M[2][0] = 0.f; M[2][1] = 0.f;
+
+}
+
+
+
+static inline void mat2x3_shear(mat2x3 M, float x, float y)
+
+{
+
+	M[0][0] = 1.f; M[0][1] = x;
+
+	M[1][0] = y;   M[1][1] = 1.f;
+
+	M[2][0] = 0.f; M[2][1] = 0.f;
+
+}
+
+
+
+static inline void mat2x3_scale(mat2x3 M, float x, float y)
+
+{
+
+	M[0][0] = x;   M[0][1] = 0.f;
+
+	M[1][0] = 0.f; M[1][1] = y;
+
+	M[2][0] = 0.f; M[2][1] = 0.f;
+
+}
+
+
+
+static inline void mat2x3_translate(mat2x3 M, float x, float y)
+
+{
+
+	mat2x3_identity(M);
+
+	M[2][0] = x;
+
+	M[2][1] = y;
+
+}
+
+
+
+/* M = a*b, so M applies b first and then a */
+
+static inline void mat2x3_mul(mat2x3 M, mat2x3 a, mat2x3 b)
+
+{
+
+	mat2x3 R;
+
+	int r;
+
+	for(r=0; r<2; ++r) {
+
+		R[0][r] = a[0][r]*b[0][0] + a[1][r]*b[0][1];
+
+		R[1][r] = a[0][r]*b[1][0] + a[1][r]*b[1][1];
+
+		R[2][r] = a[0][r]*b[2][0] + a[1][r]*b[2][1] + a[2][r];
+
+	}
+
+	memcpy(M, R, sizeof(R));
+
+}
+
+
+
+/* Returns 0 and leaves T alone when M squashes the plane onto a line */
+
+static inline int mat2x3_invert(mat2x3 T, mat2x3 M)
+
+{
+
+	mat2x3 R;
+
+	float det = M[0][0]*M[1][1] - M[1][0]*M[0][1];
+
+	if(det == 0.f)
+
+		return 0;
+
+	det = 1.f / det;
+
+	R[0][0] =  M[1][1] * det;
+
+	R[0][1] = -M[0][1] * det;
+
+	R[1][0] = -M[1][0] * det;
+
+	R[1][1] =  M[0][0] * det;
+
+	R[2][0] = -(R[0][0]*M[2][0] + R[1][0]*M[2][1]);
+
+	R[2][1] = -(R[0][1]*M[2][0] + R[1][1]*M[2][1]);
+
+	memcpy(T, R, sizeof(R));
+
+	return 1;
+
+}
+
+
+
+static inline void mat2x3_mul_vec2(vec2 r, mat2x3 M, vec2 v)
+
+{
+
+	float x = M[0][0]*v[0] + M[1][0]*v[1] + M[2][0];
+
+	float y = M[0][1]*v[0] + M[1][1]*v[1] + M[2][1];
+
+	r[0] = x;
+
+	r[1] = y;
+
+}
+
+
+
+/* The same map as a mat4x4 acting on the xy plane, for a uniform */
+
+static inline void mat4x4_from_mat2x3(mat4x4 M, mat2x3 A)
+
+{
+
+	mat4x4_identity(M);
+
+	M[0][0] = A[0][0]; M[0][1] = A[0][1];
+
+	M[1][0] = A[1][0]; M[1][1] = A[1][1];
+
+	M[3][0] = A[2][0]; M[3][1] = A[2][1];
+
+}
+
+
+
 #endif